@@ -28,6 +28,8 @@
  */
 
 #include "config.h"
+#include <string.h>
+#include <gmodule.h>
 #include <gtk/gtk.h>
 #include <app/gwyapp.h>
 #include <app/gwymoduleutils.h>
@@ -35,6 +37,8 @@
 #include <libprocess/filters.h>
 #include <libprocess/inttrans.h>
 #include <libprocess/datafield.h>
+#include <libprocess/brick.h>
+#include <libprocess/surface.h>
 #include <libgwyddion/gwymath.h>
 #include <libgwydgets/gwydataview.h>
 #include <libgwydgets/gwydgetutils.h>
@@ -42,9 +46,22 @@
 #include <libgwydgets/gwylayer-basic.h>
 #include <libgwydgets/gwyradiobuttons.h>
 #include <libgwymodule/gwymodule-process.h>
+#include <libgwymodule/gwymodule-volume.h>
+#include <libgwymodule/gwymodule-xyz.h>
+#include "calibrate_hcp_core.h"
 
 #define CALIBRATE_HCP_RUN_MODES (GWY_RUN_INTERACTIVE)
 
+/* Seconds the views may take to follow a drag step, one frame at 60 Hz.
+ * When they take longer, the calibrated preview waits for the end of the
+ * drag and only the overlay follows. */
+#define DRAG_BUDGET 0.016
+
+/* Predicted lattice points are drawn as circles of this radius, and only
+ * when they are at least this many screen pixels apart. */
+#define OVERLAY_RADIUS 3.0
+#define OVERLAY_MIN_SPACING 6.0
+
 typedef struct _GwyToolLevel3      GwyToolLevel3;
 
 typedef struct _GwyToolLevel3Class GwyToolLevel3Class;
@@ -65,15 +82,20 @@ struct _GwyToolLevel3
 enum
 {
     COLUMN_I,
+    COLUMN_HK,
     COLUMN_X,
     COLUMN_Y,
     COLUMN_Z,
+    COLUMN_SNR,
+    COLUMN_RESIDUAL,
     NCOLUMNS
 };
 
 enum
 {
-    PREVIEW_SIZE = 512
+    PREVIEW_SIZE = 512,
+    CALIBRATED_PREVIEW_SIZE = 256,
+    MAX_PEAKS = 48
 };
 
 typedef enum {
@@ -81,6 +103,11 @@ typedef enum {
     ZOOM_2 = 2,
 } ZoomMode;
 
+typedef enum {
+    MODE_CALIBRATE = 0,
+    MODE_MEASURE = 1,
+} CalibrationMode;
+
 typedef struct {
     gdouble lower;
     gdouble upper;
@@ -90,17 +117,44 @@ typedef struct {
     gboolean Xwarning;
     gboolean Ywarning;
     ZoomMode zoom_mode;
+    gint threads;
+    gint volume_level;
+    CalibrationMode mode;
+    gdouble known_Xscale;
+    gdouble known_Yscale;
+    gboolean zcal;
+    gdouble step;
+    gdouble Zscale;
+    gboolean all_channels;
+    gboolean write_files;
+    gboolean fourier;
+    gboolean in_place;
+    gboolean resonant;
+    HcpResonance resonance;
 } ThresholdArgs;
 
 typedef struct {
     gdouble min, max;
 } ThresholdRanges;
 
+typedef struct {
+    HcpBatchItem *items;
+    GwyInterpolationType interp;
+    gint nitems;
+    HcpLatticePeak *seeds;
+    gint nseeds;
+    gint radius;
+    gdouble lattice;
+    HcpProgress progress;
+    gint finished;
+} SeriesJob;
+
 typedef struct {
     ThresholdArgs *args;
-    const ThresholdRanges *ranges;
+    ThresholdRanges *ranges;
     GtkWidget *dialog;
     GtkWidget *view;
+    GtkWidget *calview;
     GtkWidget *lower;
     GtkWidget *upper;
     GtkWidget *xscale;
@@ -108,12 +162,22 @@ typedef struct {
     GtkWidget *xwarning;
     GtkWidget *ywarning;
     GtkWidget *warning;
+    GtkWidget *sweep;
+    GtkWidget *line_estimate;
+    GtkWidget *quality;
+    HcpQuality spectrum_quality;
     GwyContainer *mydata;
+    GwyContainer *caldata;
     GwyContainer *container;
     GwyDataField *ofield;
+    GwyDataField *calsource;
     GwyDataField *offt;
     GwyDataField *disp_data;
+    GwyDataField *disp_small;
     GwyDataField *dfield;
+    GwyBrick *brick;
+    GtkObject *level;
+    GtkObject *threads;
     gint id;
     GwySelection *selection;
     GwySIValueFormat *original_XY_Format;
@@ -121,37 +185,135 @@ typedef struct {
     GwySIValueFormat *Z_Format;
     GwyToolLevel3 *tool;
     GtkWidget *lattice;
-    gdouble p[2][3];
+    GArray *peaks;
+    GArray *shown;
+    gdouble disp_avg;
+    gdouble disp_rms;
+    gboolean refining;
+    gboolean dragging;
+    gboolean drag_slow;
+    guint factors_idle;
+    HcpFitSums sums;
+    GTimer *timer;
+    gdouble basis[4];
+    gboolean basis_valid;
+    gdouble resonance_xfreq;
     GSList *zoom_mode_radios;
+    GSList *mode_radios;
+    GtkWidget *measure;
+    GtkWidget *zcal;
+    GtkWidget *step;
+    GtkWidget *zresult;
+    GtkWidget *joint_fit;
+    GtkWidget *joint_result;
+    GtkWidget *fourier;
+    GtkWidget *in_place;
+    GtkWidget *resonant;
+    GtkWidget *resonance_result;
+    GtkWidget *all_channels;
+    GtkWidget *write_files;
+    GtkWidget *output_dir;
+    GwySIValueFormat *step_format;
+    gchar *prefix;
 } ThresholdControls;
 
 static gboolean module_register             (void);
 
 static void     calibrate_hcp               (GwyContainer *data, GwyRunType run);
+static void     calibrate_hcp_volume        (GwyContainer *data, GwyRunType run);
+static void     calibrate_hcp_xyz           (GwyContainer *data, GwyRunType run);
+static void     brick_plane                 (GwyBrick *brick, gint level,
+                                                GwyDataField *target);
 static void     perform_fft                 (GwyDataField *dfield,
+                                                GwyDataField *spectrum,
                                                 GwyContainer *data);
-static void     selection_changed           (ThresholdControls *controls);
+static void     selection_changed           (ThresholdControls *controls,
+                                                gint hint);
 static void     clear_points                (ThresholdControls *controls);
+static gboolean peak_drag                   (ThresholdControls *controls,
+                                                gint hint);
+static void     selection_finished          (ThresholdControls *controls);
+static gboolean factors_changed_idle        (gpointer user_data);
+static gint     search_radius_bins          (gint rpx,
+                                                ZoomMode zoom);
+static void     detect_peaks_clicked        (ThresholdControls *controls);
+static void     joint_fit_clicked           (ThresholdControls *controls);
+static gboolean channel_is_output           (GwyContainer *data, gint id);
 static void     peak_find                   (ThresholdControls *controls,
                                                 gdouble *point, guint idx);
+static gboolean peaks_ready                 (ThresholdControls *controls);
+static gboolean peak_pair                   (ThresholdControls *controls,
+                                             HcpPeak *p1, HcpPeak *p2);
+static void     peak_get                    (ThresholdControls *controls,
+                                                guint idx, HcpPeak *peak);
+static void     peaks_update                (ThresholdControls *controls);
+static void     factors_changed             (ThresholdControls *controls);
+static void     overlay_update              (ThresholdControls *controls);
+static void     calibrated_preview_update   (ThresholdControls *controls);
+static gboolean overlay_expose              (GtkWidget *view,
+                                             GdkEventExpose *event,
+                                             ThresholdControls *controls);
 static void     calibrate_update_scales     (ThresholdControls *controls);
 static void     calibration_get_factors     (ThresholdControls *controls);
-static void     check_warnings              (ThresholdControls *controls);
-static void     calibrate_do                (ThresholdControls *controls);
-static void     calibrate_create_output     (GwyContainer *data, 
-                                                GwyDataField *dfield,
+static void     measure_update              (ThresholdControls *controls);
+static void     mode_changed                (GtkToggleButton *button,
                                                 ThresholdControls *controls);
-static void     calibrate_hcp_dialog        (ThresholdArgs *args,
+static void     mode_apply                  (ThresholdControls *controls);
+static void     check_warnings              (ThresholdControls *controls);
+static gint     provenance_params           (const ThresholdArgs *args,
+                                                gint radius,
+                                                gdouble *params);
+static gint     calibrate_do                (GwyContainer *data,
+                                                GwyDataField *dfield, gint id,
+                                                const ThresholdArgs *args,
+                                                gint radius);
+static void     calibrate_in_place          (GwyContainer *data,
+                                                GwyDataField *dfield, gint id,
+                                                const ThresholdArgs *args,
+                                                const gchar *provenance);
+static void     calibrate_series_do         (GwyContainer *data, gint id,
+                                                gint output,
+                                                const ThresholdArgs *args,
+                                                gint radius);
+static gpointer series_thread               (gpointer user_data);
+static gint     peaks_parse                 (const gchar *str,
+                                                gdouble *xy, gint max);
+static void     calibrate_brick_do          (GwyContainer *data,
+                                                GwyBrick *brick, gint id,
+                                                const ThresholdArgs *args);
+static void     calibrate_surface_do        (GwyContainer *data,
+                                                GwySurface *surface, gint id,
+                                                const ThresholdArgs *args);
+static GwyContainer* calibrate_output_meta  (GwyContainer *data,
+                                                const gchar *meta_key,
+                                                const gchar *title_key,
+                                                const ThresholdArgs *args);
+static void     calibration_meta_add        (GwyContainer *meta,
+                                                const ThresholdArgs *args);
+static gint     calibrate_create_output     (GwyContainer *data, 
+                                                GwyDataField *dfield, gint id,
+                                                const ThresholdArgs *args,
+                                                const gchar *provenance);
+static gboolean provenance_exists           (GwyContainer *data,
+                                                const gchar *provenance);
+static gboolean calibrate_hcp_dialog        (ThresholdArgs *args,
                                                 ThresholdRanges *ranges,
                                                 GwyContainer *data,
                                                 GwyDataField *dfield,
+                                                GwyDataField *spectrum,
+                                                GwyBrick *brick,
                                                 gint id, GwyToolLevel3 *tool);
+static void     level_changed               (ThresholdControls *controls);
+static void     threads_changed             (ThresholdControls *controls);
 static void     threshold_set_to_full_range(ThresholdControls *controls);
 static void     threshold_lower_changed    (ThresholdControls *controls);
 static void     threshold_upper_changed    (ThresholdControls *controls);
 static void     preview                    (ThresholdControls *controls);
+static void     preview_range              (ThresholdControls *controls);
 static void     threshold_do               (const ThresholdArgs *args,
-                                            GwyDataField *dfield);
+                                            GwyDataField *source,
+                                            GwyDataField *dfield,
+                                            HcpRangeStats *stats);
 static void     threshold_load_args        (GwyContainer *settings,
                                                 ThresholdArgs *args,
                                                 GwyToolLevel3 *tool);
@@ -161,11 +323,35 @@ static void     threshold_save_args        (GwyContainer *settings,
 static void     scale_entry_attach         (ThresholdControls *controls,
                                                 GtkTable *table, gint row);
 static void     threshold_lattice_changed  (ThresholdControls *controls);
-static void     fft_postprocess            (GwyDataField *dfield);
-static void     set_dfield_modulus         (GwyDataField *re, GwyDataField *im,
-                                                GwyDataField *target);
 static void     zoom_mode_changed          (GtkToggleButton *button,
                                                 ThresholdControls *controls);
+static void     sweep_clicked              (ThresholdControls *controls);
+static void     line_estimate_clicked      (ThresholdControls *controls);
+static void     quality_update             (ThresholdControls *controls);
+static void     zcal_toggled               (ThresholdControls *controls);
+static void     fourier_toggled            (ThresholdControls *controls);
+static void     in_place_toggled           (ThresholdControls *controls);
+static void     resonant_toggled           (ThresholdControls *controls);
+static void     resonance_fit              (ThresholdControls *controls);
+static void     all_channels_toggled       (ThresholdControls *controls);
+static void     write_files_toggled        (ThresholdControls *controls);
+static void     output_dir_changed         (ThresholdControls *controls);
+static const gchar* output_dir_get         (void);
+static gchar*   series_output_name         (GwyContainer *data,
+                                               const gchar *dir, gint id,
+                                               const gchar *provenance);
+static gboolean gsf_has_provenance         (const gchar *filename,
+                                               const gchar *provenance);
+static void     step_changed               (ThresholdControls *controls);
+static void     step_format_value          (ThresholdControls *controls);
+static void     zcal_update                (ThresholdControls *controls);
+static void     peaks_save                 (ThresholdControls *controls,
+                                                GwyContainer *container,
+                                                const gchar *prefix,
+                                                gboolean undo);
+static gboolean peaks_restore              (ThresholdControls *controls,
+                                                GwyContainer *container,
+                                                const gchar *prefix);
 static void     xscale_changed             (ThresholdControls *controls);
 static void     yscale_changed             (ThresholdControls *controls);
 static void     gwy_tool_level3_render_cell(GtkCellLayout *layout,
@@ -173,14 +359,42 @@ static void     gwy_tool_level3_render_cell(GtkCellLayout *layout,
                                                 GtkTreeModel *model,
                                                 GtkTreeIter *iter,
                                                 gpointer user_data);
-static void gwy_tool_level3_radius_changed (GwyToolLevel3 *tool);
+static void gwy_tool_level3_radius_changed (ThresholdControls *controls);
 static void radio_buttons_attach_to_table  (GSList *group,
                                                 GtkTable *table, gint row);
 
 static const ThresholdArgs threshold_defaults = {
-    0.0, 0.0, 0.000000001, 1.0, 1.0, FALSE, FALSE, 1
+    0.0, 0.0, 0.000000001, 1.0, 1.0, FALSE, FALSE, 1, 0, -1,
+    MODE_CALIBRATE, 1.0, 1.0, FALSE, 2.36e-10, 1.0, FALSE, FALSE, FALSE, FALSE,
+    FALSE, { 0.0, 0.0, 1.0, 0.0, 0 }
 };
 
+/* Fourier resampling keeps the corrugation sharp but assumes a band
+ * limited image; linear is the safe default. */
+static inline GwyInterpolationType
+calibrate_interp(const ThresholdArgs *args)
+{
+    return args->fourier ? HCP_INTERPOLATION_FOURIER : GWY_INTERPOLATION_LINEAR;
+}
+
+/* The columns can only be remapped when the image is resampled. */
+static inline gboolean
+resonance_active(const ThresholdArgs *args)
+{
+    return args->resonant && !args->in_place && args->resonance.nbands > 0;
+}
+
+/* Factor by which linearising the sweep moves x in the spectrum. */
+static inline gdouble
+resonance_xcorrection(const ThresholdArgs *args)
+{
+    return resonance_active(args) ? args->resonance.xcorrection : 1.0;
+}
+
+/* Kept for the lifetime of the module so that repeated calibrations of
+ * images of the same size do not set up the transform again. */
+static HcpWorkspace *workspace = NULL;
+
 static GwyModuleInfo module_info = {
     GWY_MODULE_ABI_VERSION, &module_register,
     N_("Tool to calibrate and adjust the lateral dimensions of a scanning "
@@ -193,6 +407,13 @@ static GwyModuleInfo module_info = {
 
 GWY_MODULE_QUERY(module_info)
 
+G_MODULE_EXPORT void
+g_module_unload(G_GNUC_UNUSED GModule *module)
+{
+    hcp_workspace_free(workspace);
+    workspace = NULL;
+}
+
 static gboolean
 module_register(void)
 {
@@ -201,6 +422,17 @@ module_register(void)
                 N_("/_Correct Data/_Calibrate HCP"),
                 NULL, CALIBRATE_HCP_RUN_MODES, GWY_MENU_FLAG_DATA,
                 N_("Calibrate image against known HCP lattice"));
+    gwy_volume_func_register("calibrate_hcp_volume",
+                (GwyVolumeFunc)&calibrate_hcp_volume,
+                N_("/Calibrate _HCP..."),
+                NULL, CALIBRATE_HCP_RUN_MODES, GWY_MENU_FLAG_VOLUME,
+                N_("Calibrate volume data laterally against known HCP "
+                   "lattice"));
+    gwy_xyz_func_register("calibrate_hcp_xyz",
+                (GwyXYZFunc)&calibrate_hcp_xyz,
+                N_("/Calibrate _HCP..."),
+                NULL, CALIBRATE_HCP_RUN_MODES, GWY_MENU_FLAG_XYZ,
+                N_("Calibrate XYZ data against known HCP lattice"));
     return TRUE;
 }
 
@@ -211,23 +443,127 @@ calibrate_hcp(GwyContainer *data, GwyRunType run)
     ThresholdRanges ranges;
     GwyDataField *dfield;
     GQuark quark;
-    gint id;
+    gint id, output, radius;
     GwyToolLevel3 tool;
     tool.rpx = 3;
     g_return_if_fail(run & CALIBRATE_HCP_RUN_MODES);
+    if (!workspace)
+        workspace = hcp_workspace_new();
     threshold_load_args(gwy_app_settings_get(), &args, &tool);
+    hcp_set_n_threads(args.threads);
     gwy_app_data_browser_get_current(GWY_APP_DATA_FIELD, &dfield,
                                      GWY_APP_DATA_FIELD_ID, &id,
                                      GWY_APP_DATA_FIELD_KEY, &quark, 0);
     g_return_if_fail(dfield);
     if (run == GWY_RUN_INTERACTIVE)
     {
-        calibrate_hcp_dialog(&args, &ranges, data,
-            gwy_data_field_duplicate(dfield), id, &tool);
+        if (calibrate_hcp_dialog(&args, &ranges, data,
+                gwy_data_field_duplicate(dfield), NULL, NULL, id, &tool))
+        {
+            radius = search_radius_bins(tool.rpx, args.zoom_mode);
+            output = calibrate_do(data, dfield, id, &args, radius);
+            if (args.all_channels)
+                calibrate_series_do(data, id, output, &args, radius);
+        }
         gwy_data_field_data_changed(dfield);
     }
 }
 
+/*
+ *  Bricks are calibrated from the spectrum of one level, or by default
+ *  from the mean spectrum of all levels, which keeps the lattice peaks
+ *  of every level while averaging out the noise.  The dialog shows the
+ *  corresponding plane in place of an image.
+ */
+static void
+calibrate_hcp_volume(GwyContainer *data, GwyRunType run)
+{
+    ThresholdArgs args;
+    ThresholdRanges ranges;
+    GwyBrick *brick;
+    GwyDataField *plane, *spectrum;
+    gint id;
+    GwyToolLevel3 tool;
+    tool.rpx = 3;
+    g_return_if_fail(run & CALIBRATE_HCP_RUN_MODES);
+    if (!workspace)
+        workspace = hcp_workspace_new();
+    threshold_load_args(gwy_app_settings_get(), &args, &tool);
+    hcp_set_n_threads(args.threads);
+    gwy_app_data_browser_get_current(GWY_APP_BRICK, &brick,
+                                     GWY_APP_BRICK_ID, &id, 0);
+    g_return_if_fail(brick);
+    if (args.volume_level >= gwy_brick_get_zres(brick))
+        args.volume_level = -1;
+    if (run == GWY_RUN_INTERACTIVE)
+    {
+        plane = gwy_data_field_new(1, 1, 1.0, 1.0, FALSE);
+        brick_plane(brick, args.volume_level, plane);
+        spectrum = hcp_brick_spectrum(brick, args.volume_level, workspace);
+        if (calibrate_hcp_dialog(&args, &ranges, data, plane, spectrum,
+                                 brick, id, &tool))
+            calibrate_brick_do(data, brick, id, &args);
+        g_object_unref(spectrum);
+        g_object_unref(plane);
+    }
+}
+
+/*
+ *  Scattered data are transformed directly from the points.  The dialog
+ *  gets an empty field of the same extent in place of an image.
+ */
+static void
+calibrate_hcp_xyz(GwyContainer *data, GwyRunType run)
+{
+    ThresholdArgs args;
+    ThresholdRanges ranges;
+    GwySurface *surface;
+    GwyDataField *plane, *spectrum;
+    GwySIUnit *unit;
+    gdouble xmin, xmax, ymin, ymax;
+    gint id, res;
+    GwyToolLevel3 tool;
+    tool.rpx = 3;
+    g_return_if_fail(run & CALIBRATE_HCP_RUN_MODES);
+    if (!workspace)
+        workspace = hcp_workspace_new();
+    threshold_load_args(gwy_app_settings_get(), &args, &tool);
+    hcp_set_n_threads(args.threads);
+    gwy_app_data_browser_get_current(GWY_APP_SURFACE, &surface,
+                                     GWY_APP_SURFACE_ID, &id, 0);
+    g_return_if_fail(surface);
+    if (run == GWY_RUN_INTERACTIVE)
+    {
+        spectrum = hcp_surface_spectrum(surface, 0, workspace);
+        g_return_if_fail(spectrum);
+        res = gwy_data_field_get_xres(spectrum);
+        gwy_surface_get_xrange(surface, &xmin, &xmax);
+        gwy_surface_get_yrange(surface, &ymin, &ymax);
+        plane = gwy_data_field_new(res, res, xmax - xmin, ymax - ymin, TRUE);
+        unit = gwy_si_unit_duplicate(gwy_surface_get_si_unit_xy(surface));
+        gwy_data_field_set_si_unit_xy(plane, unit);
+        g_object_unref(unit);
+        if (calibrate_hcp_dialog(&args, &ranges, data, plane, spectrum,
+                                 NULL, id, &tool))
+            calibrate_surface_do(data, surface, id, &args);
+        g_object_unref(spectrum);
+        g_object_unref(plane);
+    }
+}
+
+static void
+brick_plane(GwyBrick *brick, gint level, GwyDataField *target)
+{
+    gint xres = gwy_brick_get_xres(brick);
+    gint yres = gwy_brick_get_yres(brick);
+    if (level >= 0)
+        gwy_brick_extract_plane(brick, target, 0, 0, level,
+                                xres, yres, -1, TRUE);
+    else
+        gwy_brick_mean_plane(brick, target, 0, 0, 0,
+                             xres, yres, gwy_brick_get_zres(brick), TRUE);
+}
+
 static void
 threshold_format_value(ThresholdControls *controls,
                        GtkEntry *entry, gdouble value)
@@ -304,32 +640,47 @@ scale_entry_attach(ThresholdControls *controls,
                             G_CALLBACK(yscale_changed), controls);
 }
 
-static void
+static gboolean
 calibrate_hcp_dialog(ThresholdArgs *args, ThresholdRanges *ranges,
                  GwyContainer *data, GwyDataField *dfield,
+                 GwyDataField *spectrum, GwyBrick *brick,
                  gint id, GwyToolLevel3 *tool)
 {
-    GtkWidget *dialog, *hbox, *button, *label;
+    GtkWidget *dialog, *hbox, *hbox2, *button, *label;
     GtkTable *table;
     GwyVectorLayer *vlayer;
     ThresholdControls controls;
     gint response;
     GwyPixmapLayer *layer;
     gint row;
+    gboolean apply;
     controls.ofield = gwy_data_field_duplicate(dfield);
     controls.container = data;
     controls.id = id;    
     controls.args = args;
     controls.ranges = ranges;
     controls.dfield = dfield;
+    controls.brick = brick;
+    controls.level = NULL;
     controls.tool = tool;
+    /* Where the peaks of this channel are kept, see peaks_save(). */
+    if (brick)
+        controls.prefix = g_strdup_printf("/brick/%d", id);
+    else if (spectrum)
+        controls.prefix = g_strdup_printf("/xyz/%d", id);
+    else
+        controls.prefix = g_strdup_printf("/%d", id);
     controls.original_XY_Format = gwy_data_field_get_value_format_xy
                             (dfield, GWY_SI_UNIT_FORMAT_MARKUP, NULL);
+    controls.step_format = gwy_data_field_get_value_format_z
+                            (dfield, GWY_SI_UNIT_FORMAT_MARKUP, NULL);
     controls.mydata = gwy_container_new();
-    perform_fft(controls.dfield, controls.mydata);
+    perform_fft(controls.dfield, spectrum, controls.mydata);
     controls.offt = gwy_data_field_duplicate(controls.dfield);
     controls.disp_data = gwy_data_field_duplicate(controls.dfield);
-    dfield = gwy_data_field_duplicate(controls.dfield);
+    controls.disp_small = hcp_field_downsample_max(controls.disp_data,
+                                                   PREVIEW_SIZE);
+    dfield = gwy_data_field_duplicate(controls.disp_small);
     gwy_data_field_get_min_max(dfield, &ranges->min, &ranges->max);
     controls.XY_Format = gwy_data_field_get_value_format_xy
                             (dfield, GWY_SI_UNIT_FORMAT_MARKUP, NULL);
@@ -354,9 +705,11 @@ calibrate_hcp_dialog(ThresholdArgs *args, ThresholdRanges *ranges,
     gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
     gtk_misc_set_alignment(GTK_MISC(label), 0.5, 0.5);
     gtk_table_attach(table, label, 0, 1, 0, 1, GTK_FILL, 0, 0, 0);
-    gwy_app_sync_data_items(data, controls.mydata, id, 0, FALSE,
-                GWY_DATA_ITEM_PALETTE, GWY_DATA_ITEM_MASK_COLOR,
-                GWY_DATA_ITEM_RANGE, GWY_DATA_ITEM_REAL_SQUARE, 0);
+    /* Volume and XYZ ids are not channel ids. */
+    if (!brick && !spectrum)
+        gwy_app_sync_data_items(data, controls.mydata, id, 0, FALSE,
+                    GWY_DATA_ITEM_PALETTE, GWY_DATA_ITEM_MASK_COLOR,
+                    GWY_DATA_ITEM_RANGE, GWY_DATA_ITEM_REAL_SQUARE, 0);
     gwy_container_set_object_by_name(controls.mydata, "/0/data", dfield);
     controls.view = gwy_data_view_new(controls.mydata);
     layer = gwy_layer_basic_new();
@@ -367,19 +720,75 @@ calibrate_hcp_dialog(ThresholdArgs *args, ThresholdRanges *ranges,
     gwy_data_view_set_data_prefix(GWY_DATA_VIEW(controls.view), "/0/data");
     gwy_data_view_set_base_layer(GWY_DATA_VIEW(controls.view), layer);
     gwy_set_data_preview_size(GWY_DATA_VIEW(controls.view), PREVIEW_SIZE);
+    controls.basis_valid = FALSE;
+    g_signal_connect_after(controls.view, "expose-event",
+                           G_CALLBACK(overlay_expose), &controls);
     vlayer = g_object_new(g_type_from_name("GwyLayerPoint"),
                   "selection-key", "/0/select/point", NULL);
     gwy_data_view_set_top_layer(GWY_DATA_VIEW(controls.view), vlayer);
     controls.selection = gwy_vector_layer_ensure_selection(vlayer);
-    gwy_selection_set_max_objects(controls.selection, 2);
+    gwy_selection_set_max_objects(controls.selection, MAX_PEAKS);
     g_signal_connect_swapped(controls.selection, "changed",
                          G_CALLBACK(selection_changed), &controls);
+    g_signal_connect_swapped(controls.selection, "finished",
+                         G_CALLBACK(selection_finished), &controls);
     gtk_table_attach(table, controls.view, 0, 1, 1, 2, GTK_FILL, 0, 0, 0);
+    controls.caldata = gwy_container_new();
+    controls.calsource = hcp_field_downsample(controls.ofield,
+                                              CALIBRATED_PREVIEW_SIZE);
+    gwy_container_set_object_by_name(controls.caldata, "/0/data",
+                                     controls.calsource);
+    if (!brick && !spectrum)
+        gwy_app_sync_data_items(data, controls.caldata, id, 0, FALSE,
+                                GWY_DATA_ITEM_PALETTE, 0);
+    /* XYZ data have no image to preview. */
+    controls.calview = NULL;
+    if (brick || !spectrum)
+    {
+        label = gtk_label_new(NULL);
+        gtk_label_set_markup(GTK_LABEL(label),
+                             "<b>Calibrated data</b>\nPreview resolution");
+        gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
+        gtk_misc_set_alignment(GTK_MISC(label), 0.5, 0.5);
+        gtk_table_attach(table, label, 1, 2, 0, 1, GTK_FILL, 0, 0, 0);
+        controls.calview = gwy_data_view_new(controls.caldata);
+        layer = gwy_layer_basic_new();
+        g_object_set(layer, "data-key", "/0/data",
+                     "gradient-key", "/0/base/palette", NULL);
+        gwy_data_view_set_data_prefix(GWY_DATA_VIEW(controls.calview),
+                                      "/0/data");
+        gwy_data_view_set_base_layer(GWY_DATA_VIEW(controls.calview), layer);
+        gwy_set_data_preview_size(GWY_DATA_VIEW(controls.calview),
+                                  CALIBRATED_PREVIEW_SIZE);
+        gtk_table_attach(table, controls.calview, 1, 2, 1, 2,
+                         GTK_FILL, GTK_FILL, 0, 0);
+    }
     label = gtk_label_new(
-        "Select two peaks in the first hexagonal ring around center");
+        "Select two peaks in the first hexagonal ring around center,\n"
+        "or more peaks of any ring");
     gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_CENTER);
     gtk_misc_set_alignment(GTK_MISC(label), 0.5, 0.5);
     gtk_table_attach(table, label, 0, 1, 2, 3, GTK_FILL, 0, 0, 0);
+    controls.quality = gtk_label_new(NULL);
+    gtk_label_set_justify(GTK_LABEL(controls.quality), GTK_JUSTIFY_CENTER);
+    gtk_misc_set_alignment(GTK_MISC(controls.quality), 0.5, 0.5);
+    gtk_table_attach(table, controls.quality, 0, 1, 3, 4, GTK_FILL, 0, 0, 0);
+    quality_update(&controls);
+    if (brick)
+    {
+        GtkWidget *spin;
+        controls.level = gtk_adjustment_new(args->volume_level, -1,
+                                            gwy_brick_get_zres(brick) - 1,
+                                            1, 10, 0);
+        spin = gtk_spin_button_new(GTK_ADJUSTMENT(controls.level), 1, 0);
+        label = gtk_label_new(_("Level (-1 averages all levels):"));
+        hbox2 = gtk_hbox_new(FALSE, 6);
+        gtk_box_pack_start(GTK_BOX(hbox2), label, FALSE, FALSE, 0);
+        gtk_box_pack_start(GTK_BOX(hbox2), spin, FALSE, FALSE, 0);
+        gtk_table_attach(table, hbox2, 0, 1, 4, 5, GTK_FILL, 0, 0, 0);
+        g_signal_connect_swapped(controls.level, "value-changed",
+                                 G_CALLBACK(level_changed), &controls);
+    }
     table = GTK_TABLE(gtk_table_new(5, 4, FALSE));
     gtk_table_set_row_spacings(table, 2);
     gtk_table_set_col_spacings(table, 6);
@@ -429,13 +838,22 @@ calibrate_hcp_dialog(ThresholdArgs *args, ThresholdRanges *ranges,
     GtkTreeViewColumn *column;
     GtkCellRenderer *renderer;
     GwyNullStore *store;
-    store = gwy_null_store_new(2);
+    GtkWidget *scwin;
+    controls.peaks = g_array_new(FALSE, TRUE, sizeof(HcpLatticePeak));
+    controls.shown = g_array_new(FALSE, TRUE, sizeof(HcpLatticePeak));
+    controls.timer = g_timer_new();
+    controls.refining = controls.dragging = controls.drag_slow = FALSE;
+    controls.factors_idle = 0;
+    controls.resonance_xfreq = 0.0;
+    store = gwy_null_store_new(0);
     tool->model = GTK_TREE_MODEL(store);
     tool->treeview = GTK_TREE_VIEW(gtk_tree_view_new_with_model(tool->model));
-    gchar *XUnits, *YUnits, *ZUnits;
+    gchar *XUnits, *YUnits, *ZUnits, *RUnits;
     XUnits = g_strdup_printf("<b>x</b> [%s]", controls.XY_Format->units);
     YUnits = g_strdup_printf("<b>y</b> [%s]", controls.XY_Format->units);
     ZUnits = g_strdup_printf("<b>value</b> [%s]", controls.Z_Format->units);
+    RUnits = g_strdup_printf("<b>residual</b> [%s]",
+                             controls.XY_Format->units);
     guint i;
     for (i = 0; i < NCOLUMNS; i++) {
         column = gtk_tree_view_column_new();
@@ -453,25 +871,57 @@ calibrate_hcp_dialog(ThresholdArgs *args, ThresholdRanges *ranges,
                 gtk_label_set_markup(GTK_LABEL(label), "<b>n</b>");
                 break;
             case 1:
-                gtk_label_set_markup(GTK_LABEL(label), XUnits);
+                gtk_label_set_markup(GTK_LABEL(label), "<b>h,k</b>");
                 break;
             case 2:
-                gtk_label_set_markup(GTK_LABEL(label), YUnits);
+                gtk_label_set_markup(GTK_LABEL(label), XUnits);
                 break;
             case 3:
+                gtk_label_set_markup(GTK_LABEL(label), YUnits);
+                break;
+            case 4:
                 gtk_label_set_markup(GTK_LABEL(label), ZUnits);
                 break;
+            case 5:
+                gtk_label_set_markup(GTK_LABEL(label), "<b>SNR</b>");
+                break;
+            case 6:
+                gtk_label_set_markup(GTK_LABEL(label), RUnits);
+                break;
         }
         gtk_tree_view_column_set_widget(column, label);
         gtk_widget_show(label);
         gtk_tree_view_append_column(tool->treeview, column);
     }
-    gtk_table_attach(table, GTK_WIDGET(tool->treeview), 0, 3, row, row+1,
-                        GTK_FILL, 0, 0, 0);
+    /* Auto-detection can fill dozens of rows. */
+    scwin = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scwin),
+                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_size_request(scwin, -1, 160);
+    gtk_container_add(GTK_CONTAINER(scwin), GTK_WIDGET(tool->treeview));
+    gtk_table_attach(table, scwin, 0, 3, row, row+1, GTK_FILL, GTK_FILL, 0, 0);
     row++;
     g_free(XUnits);
     g_free(YUnits);
     g_free(ZUnits);
+    g_free(RUnits);
+    button = gtk_button_new_with_mnemonic(_("_Detect Peaks"));
+    gtk_table_attach(table, button, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(detect_peaks_clicked), &controls);
+    row++;
+    controls.joint_fit = gtk_button_new_with_mnemonic(
+                                    _("Fit _Jointly with All Channels"));
+    gtk_table_attach(table, controls.joint_fit, 0, 3, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls.joint_fit, "clicked",
+                             G_CALLBACK(joint_fit_clicked), &controls);
+    row++;
+    controls.joint_result = gtk_label_new(NULL);
+    gtk_misc_set_alignment(GTK_MISC(controls.joint_result), 0.0, 0.5);
+    gtk_table_attach(table, controls.joint_result, 0, 3, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    row++;
     button = gtk_button_new_with_mnemonic(_("Clear Points"));
     gtk_table_attach(table, button, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
     g_signal_connect_swapped(button, "clicked",
@@ -481,9 +931,32 @@ calibrate_hcp_dialog(ThresholdArgs *args, ThresholdRanges *ranges,
     gwy_table_attach_spinbutton(GTK_WIDGET(table), row, 
                         _("Peak search radius:"), "px", tool->radius);
     g_signal_connect_swapped(tool->radius, "value-changed",
-                         G_CALLBACK(gwy_tool_level3_radius_changed), tool);
+                         G_CALLBACK(gwy_tool_level3_radius_changed), &controls);
+    row++;
+    controls.threads = gtk_adjustment_new(args->threads, 0, 64, 1, 4, 0);
+    gwy_table_attach_spinbutton(GTK_WIDGET(table), row,
+                                _("Threads (0 is automatic):"), NULL,
+                                controls.threads);
+    g_signal_connect_swapped(controls.threads, "value-changed",
+                             G_CALLBACK(threads_changed), &controls);
+#ifndef _OPENMP
+    gwy_table_hscale_set_sensitive(controls.threads, FALSE);
+#endif
     row++;
     gtk_table_set_row_spacing(GTK_TABLE(table), row-1, 20);
+    label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(label), "<b>Mode:</b>");
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
+    row++;
+    controls.mode_radios
+        = gwy_radio_buttons_createl(G_CALLBACK(mode_changed), &controls,
+                                    args->mode,
+                                    _("_Calibrate"), MODE_CALIBRATE,
+                                    _("_Measure"), MODE_MEASURE,
+                                    NULL);
+    radio_buttons_attach_to_table(controls.mode_radios, table, row);
+    row++;
     label = gtk_label_new("Specify HCP lattice constant:");
     gtk_label_set_markup(GTK_LABEL(label),
                         "<b>Specify HCP lattice constant:</b>");
@@ -508,8 +981,145 @@ calibrate_hcp_dialog(ThresholdArgs *args, ThresholdRanges *ranges,
     gtk_misc_set_alignment(GTK_MISC(controls.warning), 0.5, 0.5);
     gtk_table_attach(table, controls.warning, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
     row++;
+    controls.measure = gtk_label_new(NULL);
+    gtk_misc_set_alignment(GTK_MISC(controls.measure), 0.0, 0.5);
+    gtk_table_attach(table, controls.measure, 0, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    row++;
+    button = gtk_button_new_with_mnemonic(_("Parameter _Sweep"));
+    gtk_table_attach(table, button, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(sweep_clicked), &controls);
+    /* Scattered data have no image to sweep the settings over. */
+    gtk_widget_set_sensitive(button, !spectrum || brick);
+    row++;
+    controls.sweep = gtk_label_new(NULL);
+    gtk_misc_set_alignment(GTK_MISC(controls.sweep), 0.0, 0.5);
+    gtk_table_attach(table, controls.sweep, 0, 4, row, row+1, GTK_FILL, 0, 0, 0);
+    row++;
+    button = gtk_button_new_with_mnemonic(_("_Line Spectra Estimate"));
+    gtk_table_attach(table, button, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(button, "clicked",
+                             G_CALLBACK(line_estimate_clicked), &controls);
+    gtk_widget_set_sensitive(button, !spectrum || brick);
+    row++;
+    controls.line_estimate = gtk_label_new(NULL);
+    gtk_misc_set_alignment(GTK_MISC(controls.line_estimate), 0.0, 0.5);
+    gtk_table_attach(table, controls.line_estimate, 0, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    row++;
+    gtk_table_set_row_spacing(GTK_TABLE(table), row-1, 20);
+    label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(label), "<b>Z calibration:</b>");
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 3, row, row+1, GTK_FILL, 0, 0, 0);
+    row++;
+    controls.zcal = gtk_check_button_new_with_mnemonic(
+                                    _("Calibrate _Z from terrace steps"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(controls.zcal),
+                                 args->zcal);
+    gtk_table_attach(table, controls.zcal, 0, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls.zcal, "toggled",
+                             G_CALLBACK(zcal_toggled), &controls);
+    row++;
+    label = gtk_label_new_with_mnemonic(_("Known s_tep:"));
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 0, 1, row, row+1, GTK_FILL, 0, 0, 0);
+    controls.step = gtk_entry_new();
+    gwy_widget_set_activate_on_unfocus(controls.step, TRUE);
+    gtk_entry_set_width_chars(GTK_ENTRY(controls.step), 8);
+    gtk_label_set_mnemonic_widget(GTK_LABEL(label), controls.step);
+    gtk_table_attach(table, controls.step, 1, 3, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(label), controls.step_format->units);
+    gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+    gtk_table_attach(table, label, 3, 4, row, row+1, GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls.step, "activate",
+                             G_CALLBACK(step_changed), &controls);
+    row++;
+    controls.zresult = gtk_label_new(NULL);
+    gtk_misc_set_alignment(GTK_MISC(controls.zresult), 0.0, 0.5);
+    gtk_table_attach(table, controls.zresult, 0, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    row++;
+    controls.fourier = gtk_check_button_new_with_mnemonic(
+                                    _("_Fourier resampling"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(controls.fourier),
+                                 args->fourier);
+    gtk_table_attach(table, controls.fourier, 0, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls.fourier, "toggled",
+                             G_CALLBACK(fourier_toggled), &controls);
+    row++;
+    controls.in_place = gtk_check_button_new_with_mnemonic(
+                                    _("Rescale _in place, no resampling"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(controls.in_place),
+                                 args->in_place);
+    gtk_table_attach(table, controls.in_place, 0, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls.in_place, "toggled",
+                             G_CALLBACK(in_place_toggled), &controls);
+    row++;
+    controls.resonant = gtk_check_button_new_with_mnemonic(
+                                    _("Linearize _resonant fast axis"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(controls.resonant),
+                                 args->resonant);
+    gtk_table_attach(table, controls.resonant, 0, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls.resonant, "toggled",
+                             G_CALLBACK(resonant_toggled), &controls);
+    row++;
+    controls.resonance_result = gtk_label_new(NULL);
+    gtk_misc_set_alignment(GTK_MISC(controls.resonance_result), 0.0, 0.5);
+    gtk_table_attach(table, controls.resonance_result, 0, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    row++;
+    controls.all_channels = gtk_check_button_new_with_mnemonic(
+                                    _("Apply to all _channels"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(controls.all_channels),
+                                 args->all_channels);
+    gtk_table_attach(table, controls.all_channels, 0, 4, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls.all_channels, "toggled",
+                             G_CALLBACK(all_channels_toggled), &controls);
+    row++;
+    controls.write_files = gtk_check_button_new_with_mnemonic(
+                                    _("_Write to files in"));
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(controls.write_files),
+                                 args->write_files);
+    gtk_table_attach(table, controls.write_files, 0, 2, row, row+1,
+                     GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls.write_files, "toggled",
+                             G_CALLBACK(write_files_toggled), &controls);
+    controls.output_dir = gtk_file_chooser_button_new(_("Output Folder"),
+                                    GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER);
+    if (output_dir_get())
+        gtk_file_chooser_set_filename(GTK_FILE_CHOOSER(controls.output_dir),
+                                      output_dir_get());
+    gtk_table_attach(table, controls.output_dir, 2, 4, row, row+1,
+                     GTK_EXPAND | GTK_FILL, 0, 0, 0);
+    g_signal_connect_swapped(controls.output_dir, "selection-changed",
+                             G_CALLBACK(output_dir_changed), &controls);
+    row++;
+    gtk_widget_set_sensitive(controls.all_channels, !spectrum);
+    gtk_widget_set_sensitive(controls.joint_fit, !spectrum);
+    gtk_widget_set_sensitive(controls.in_place, !spectrum);
+    /* Only images are resampled column by column. */
+    gtk_widget_set_sensitive(controls.resonant, !spectrum && !brick);
+    in_place_toggled(&controls);
+    all_channels_toggled(&controls);
+    /* Heights are only rescaled in images. */
+    gtk_widget_set_sensitive(controls.zcal, !spectrum);
+    gtk_widget_set_sensitive(controls.step, !spectrum);
+    step_format_value(&controls);
+    mode_apply(&controls);
     preview(&controls);
+    if (!peaks_restore(&controls, data, controls.prefix))
+        peaks_restore(&controls, gwy_app_settings_get(), "/module");
     gtk_widget_show_all(dialog);
+    zcal_update(&controls);
     do
     {
         response = gtk_dialog_run(GTK_DIALOG(dialog));
@@ -519,11 +1129,23 @@ calibrate_hcp_dialog(ThresholdArgs *args, ThresholdRanges *ranges,
             case GTK_RESPONSE_DELETE_EVENT:
                 gtk_widget_destroy(dialog);
             case GTK_RESPONSE_NONE:
+                peaks_save(&controls, gwy_app_settings_get(), "/module",
+                           FALSE);
                 g_object_unref(controls.mydata);
+                g_object_unref(controls.caldata);
+                g_object_unref(controls.calsource);
+                g_object_unref(controls.disp_small);
+                g_free(controls.prefix);
+                g_array_free(controls.peaks, TRUE);
+                g_array_free(controls.shown, TRUE);
+                g_timer_destroy(controls.timer);
+                if (controls.factors_idle)
+                    g_source_remove(controls.factors_idle);
                 gwy_si_unit_value_format_free(controls.XY_Format);
                 gwy_si_unit_value_format_free(controls.Z_Format);
+                gwy_si_unit_value_format_free(controls.step_format);
                 threshold_save_args(gwy_app_settings_get(), args, tool);
-                return;
+                return FALSE;
                 break;
             case GTK_RESPONSE_OK:
                 break;
@@ -533,15 +1155,27 @@ calibrate_hcp_dialog(ThresholdArgs *args, ThresholdRanges *ranges,
         }
     } while (response != GTK_RESPONSE_OK);
     threshold_save_args(gwy_app_settings_get(), args, tool);
-    if (gwy_selection_is_full(controls.selection))
-        calibrate_do(&controls);
-    else if (controls.args->Xscale > 0 && controls.args->Yscale > 0)
-        calibrate_do(&controls);
+    apply = (peaks_ready(&controls)
+             || (controls.args->Xscale > 0 && controls.args->Yscale > 0));
+    peaks_save(&controls, gwy_app_settings_get(), "/module", FALSE);
+    if (apply)
+        peaks_save(&controls, data, controls.prefix, TRUE);
     gtk_widget_destroy(dialog);
     g_object_unref(controls.mydata);
+    g_object_unref(controls.caldata);
+    g_object_unref(controls.calsource);
+    g_object_unref(controls.disp_small);
+    g_free(controls.prefix);
+    g_array_free(controls.peaks, TRUE);
+    g_array_free(controls.shown, TRUE);
+    g_timer_destroy(controls.timer);
+    if (controls.factors_idle)
+        g_source_remove(controls.factors_idle);
     gwy_si_unit_value_format_free(controls.original_XY_Format);
     gwy_si_unit_value_format_free(controls.XY_Format);
     gwy_si_unit_value_format_free(controls.Z_Format);
+    gwy_si_unit_value_format_free(controls.step_format);
+    return apply;
 }
 
 static void
@@ -552,7 +1186,7 @@ threshold_set_to_range(ThresholdControls *controls,
     gtk_widget_activate(controls->lower);
     threshold_format_value(controls, GTK_ENTRY(controls->upper), upper);
     gtk_widget_activate(controls->upper);
-    preview(controls);
+    preview_range(controls);
 }
 
 static void
@@ -579,7 +1213,7 @@ threshold_lower_changed(ThresholdControls *controls)
     }
     threshold_format_value(controls,
         GTK_ENTRY(controls->lower), controls->args->lower);
-    preview(controls);
+    preview_range(controls);
 }
 
 static void
@@ -599,7 +1233,7 @@ threshold_upper_changed(ThresholdControls *controls)
     }
     threshold_format_value(controls, GTK_ENTRY(controls->upper),
             controls->args->upper);
-    preview(controls);
+    preview_range(controls);
 }
 
 static void
@@ -656,60 +1290,102 @@ preview(ThresholdControls *controls)
     gwy_data_field_set_yoffset(controls->disp_data, Yoff/zoom);
     gwy_data_field_set_si_unit_xy(controls->disp_data, XY_Units);
     gwy_data_field_set_si_unit_z(controls->disp_data, Z_Units);
-    gwy_data_field_copy(controls->disp_data, dfield, FALSE);
-    threshold_do(controls->args, dfield);
+    /* Peaks are found and scored on the full resolution; only the shown
+     * field is reduced to the size of the view. */
+    controls->disp_avg = gwy_data_field_get_avg(controls->disp_data);
+    controls->disp_rms = gwy_data_field_get_rms(controls->disp_data);
+    g_object_unref(controls->disp_small);
+    controls->disp_small = hcp_field_downsample_max(controls->disp_data,
+                                                    PREVIEW_SIZE);
+    gwy_data_field_resample(dfield,
+                            gwy_data_field_get_xres(controls->disp_small),
+                            gwy_data_field_get_yres(controls->disp_small),
+                            GWY_INTERPOLATION_NONE);
+    gwy_data_field_set_xreal(dfield, Xreal/zoom);
+    gwy_data_field_set_yreal(dfield, Yreal/zoom);
+    preview_range(controls);
+}
+
+/*
+ *  The part of preview() that depends on the intensity range only, so
+ *  range edits do not extract and zoom the spectrum again.  The clamped
+ *  copy is made of the display sized spectrum.
+ */
+static void
+preview_range(ThresholdControls *controls)
+{
+    GwyDataField *dfield;
+    HcpRangeStats stats;
+    dfield = GWY_DATA_FIELD(
+            gwy_container_get_object_by_name(controls->mydata, "/0/data"));
+    threshold_do(controls->args, controls->disp_small, dfield, &stats);
 }
 
 static void
 reFind_Peaks(ThresholdControls *controls)
 {
-    int i, num = 0;
-    for (i = 0; i < 4; i++)
+    guint i;
+    controls->refining = TRUE;
+    for (i = 0; i < controls->peaks->len; i++)
     {
         double point[2];
         if (gwy_selection_get_object(controls->selection, i, point))
         {
+            HcpLatticePeak *peak;
             gdouble xoff, yoff;
             peak_find(controls, point, i);
+            peak = &g_array_index(controls->peaks, HcpLatticePeak, i);
             xoff = gwy_data_field_get_xoffset(controls->disp_data);
             yoff = gwy_data_field_get_yoffset(controls->disp_data);
-            point[0] = controls->p[num][0] - xoff;
-            point[1] = controls->p[num][1] - yoff;
+            point[0] = peak->x - xoff;
+            point[1] = peak->y - yoff;
             gwy_selection_set_object(controls->selection, i, point);
-            num++;
         }
     }
+    controls->refining = FALSE;
+    peaks_update(controls);
     preview(controls);
 }
 
 static void
 zoom_adjust_peaks(ThresholdControls *controls)
 {
-    int i, num = 0;
-    for (i = 0; i < 4; i++)
+    guint i;
+    controls->refining = TRUE;
+    for (i = 0; i < controls->peaks->len; i++)
     {
         double point[2];
         if (gwy_selection_get_object(controls->selection, i, point))
         {
+            const HcpLatticePeak *peak
+                = &g_array_index(controls->peaks, HcpLatticePeak, i);
             gdouble xoff, yoff, multiplier;
             multiplier = 1.0/controls->args->zoom_mode;
             xoff = gwy_data_field_get_xoffset(controls->dfield) * multiplier;
             yoff = gwy_data_field_get_yoffset(controls->dfield) * multiplier;
-            point[0] = controls->p[num][0] - xoff;
-            point[1] = controls->p[num][1] - yoff;
+            point[0] = peak->x - xoff;
+            point[1] = peak->y - yoff;
             gwy_selection_set_object(controls->selection, i, point);
-            num++;
         }
     }
+    controls->refining = FALSE;
     reFind_Peaks(controls);
 }
 
+/*
+ *  Copies source to dfield clamped to the range in a single pass; the two
+ *  fields have the same resolution.
+ */
 static void
-threshold_do(const ThresholdArgs *args, GwyDataField *dfield)
+threshold_do(const ThresholdArgs *args, GwyDataField *source,
+             GwyDataField *dfield, HcpRangeStats *stats)
 {
     gdouble lower = MIN(args->lower, args->upper);
     gdouble upper = MAX(args->lower, args->upper);
-    gwy_data_field_clamp(dfield, lower, upper);
+    hcp_clamp_copy(gwy_data_field_get_data_const(source),
+                   gwy_data_field_get_xres(source)
+                   * gwy_data_field_get_yres(source),
+                   lower, upper, gwy_data_field_get_data(dfield), stats);
     gwy_data_field_data_changed(dfield);
 }
 
@@ -720,10 +1396,167 @@ clear_points(ThresholdControls *controls)
     calibrate_update_scales(controls);
 }
 
+/*
+ *  The search radius is given in display pixels, which are finer than the
+ *  spectrum bins when zoomed.  Searches in the spectrum itself take it
+ *  rounded to whole bins; a radius of zero stays zero.
+ */
+static gint
+search_radius_bins(gint rpx, ZoomMode zoom)
+{
+    if (rpx <= 0)
+        return 0;
+    return MAX(GWY_ROUND((gdouble)rpx/zoom), 1);
+}
+
+/*
+ *  Replaces the selection with the strongest local maxima of the full
+ *  spectrum that fall in the displayed part; indexing and the fit then
+ *  sort out which are lattice peaks.
+ */
+static void
+detect_peaks_clicked(ThresholdControls *controls)
+{
+    GwyDataField *disp = controls->disp_data;
+    HcpLatticePeak peaks[MAX_PEAKS];
+    gdouble xoff, yoff, xreal, yreal, *xy;
+    gint i, n, m = 0;
+    n = hcp_field_detect_peaks(controls->offt,
+                               search_radius_bins(controls->tool->rpx,
+                                                  controls->args->zoom_mode),
+                               MAX_PEAKS, peaks);
+    xoff = gwy_data_field_get_xoffset(disp);
+    yoff = gwy_data_field_get_yoffset(disp);
+    xreal = gwy_data_field_get_xreal(disp);
+    yreal = gwy_data_field_get_yreal(disp);
+    xy = g_new(gdouble, 2*MAX(n, 1));
+    for (i = 0; i < n; i++)
+    {
+        gdouble x = peaks[i].x - xoff, y = peaks[i].y - yoff;
+        if (x < 0.0 || x >= xreal || y < 0.0 || y >= yreal)
+            continue;
+        xy[2*m] = x;
+        xy[2*m + 1] = y;
+        m++;
+    }
+    gwy_selection_set_data(controls->selection, m, xy);
+    g_free(xy);
+}
+
+/*
+ *  Calibration outputs carry the provenance digest of their source next
+ *  to the scaling factors, or at least have the title they were given.
+ *  A Provenance entry alone may come from anywhere.
+ */
+static gboolean
+channel_is_output(GwyContainer *data, gint id)
+{
+    GwyContainer *meta;
+    const guchar *value, *title;
+    gchar *key = g_strdup_printf("/%i/meta", id);
+    gboolean output = FALSE;
+    if (gwy_container_gis_object_by_name(data, key, &meta)
+        && gwy_container_gis_string_by_name(meta, "Provenance", &value)
+        && strlen((const gchar*)value) == HCP_PROVENANCE_LENGTH - 1
+        && strspn((const gchar*)value, "0123456789abcdef")
+           == HCP_PROVENANCE_LENGTH - 1)
+    {
+        output = gwy_container_contains_by_name(meta, "X Scaling Factor");
+        g_free(key);
+        key = g_strdup_printf("/%i/data/title", id);
+        if (gwy_container_gis_string_by_name(data, key, &title))
+            output = output || !strcmp((const gchar*)title, _("Calibrated"));
+    }
+    g_free(key);
+    return output;
+}
+
+/*
+ *  Refines the current peaks in every height channel of the file, i.e.
+ *  with the same units for Z as for XY, that is not itself a calibration
+ *  output and fits factors shared by all of them, which are taken as the
+ *  calibration.  Selecting peaks afterwards goes back to the fit of this
+ *  image alone.
+ */
+static void
+joint_fit_clicked(ThresholdControls *controls)
+{
+    GwyContainer *data = controls->container;
+    GwyDataField **fields;
+    HcpJointFit fit;
+    gint *ids, i, n = 0;
+    gchar *s, *shear;
+    if (!peaks_ready(controls) || controls->args->mode == MODE_MEASURE)
+        return;
+    ids = gwy_app_data_browser_get_data_ids(data);
+    for (i = 0; ids[i] != -1; i++)
+        ;
+    fields = g_new(GwyDataField*, i);
+    for (i = 0; ids[i] != -1; i++)
+    {
+        GwyDataField *field;
+        if (channel_is_output(data, ids[i]))
+            continue;
+        field = gwy_container_get_object(data,
+                                         gwy_app_get_data_key_for_id(ids[i]));
+        if (gwy_si_unit_equal(gwy_data_field_get_si_unit_xy(field),
+                              gwy_data_field_get_si_unit_z(field)))
+            fields[n++] = field;
+    }
+    if (hcp_field_fit_joint(fields, n,
+                            (const HcpLatticePeak*)controls->peaks->data,
+                            controls->peaks->len,
+                            search_radius_bins(controls->tool->rpx,
+                                               controls->args->zoom_mode),
+                            controls->args->lattice, &fit, NULL))
+    {
+        controls->args->Xscale = fit.factors.Xscale;
+        controls->args->Yscale = fit.factors.Yscale;
+        s = g_strdup_printf("%f", fit.factors.Xscale);
+        gtk_entry_set_text(GTK_ENTRY(controls->xscale), s);
+        g_free(s);
+        s = g_strdup_printf("%f", fit.factors.Yscale);
+        gtk_entry_set_text(GTK_ENTRY(controls->yscale), s);
+        g_free(s);
+        factors_changed(controls);
+        if (isnan(fit.shear_err))
+            shear = g_strdup("");
+        else
+            shear = g_strdup_printf(_(", shear %.4f ± %.4f"),
+                                    fit.shear, fit.shear_err);
+        s = g_strdup_printf(_("%d images, %d peaks: X ± %.4f, Y ± %.4f%s"),
+                            n, fit.npeaks, fit.Xscale_err, fit.Yscale_err,
+                            shear);
+        g_free(shear);
+    }
+    else
+        s = g_strdup(_("Joint fit failed"));
+    controls->args->Xwarning = fit.factors.Xwarning;
+    controls->args->Ywarning = fit.factors.Ywarning;
+    check_warnings(controls);
+    gtk_label_set_text(GTK_LABEL(controls->joint_result), s);
+    g_free(s);
+    g_free(fields);
+    g_free(ids);
+}
+
 static const gchar lower_key[] = "/module/calibrate_hcp/lower";
 static const gchar upper_key[] = "/module/calibrate_hcp/upper";
 static const gchar lattice_key[] = "/module/calibrate_hcp/lattice";
 static const gchar radius_key[] = "/module/calibrate_hcp/radius";
+static const gchar threads_key[] = "/module/calibrate_hcp/threads";
+static const gchar volume_level_key[] = "/module/calibrate_hcp/volume_level";
+static const gchar mode_key[] = "/module/calibrate_hcp/mode";
+static const gchar known_xscale_key[] = "/module/calibrate_hcp/known_xscale";
+static const gchar known_yscale_key[] = "/module/calibrate_hcp/known_yscale";
+static const gchar zcal_key[] = "/module/calibrate_hcp/zcal";
+static const gchar step_key[] = "/module/calibrate_hcp/step";
+static const gchar fourier_key[] = "/module/calibrate_hcp/fourier";
+static const gchar in_place_key[] = "/module/calibrate_hcp/in_place";
+static const gchar resonant_key[] = "/module/calibrate_hcp/resonant";
+static const gchar all_channels_key[] = "/module/calibrate_hcp/all_channels";
+static const gchar write_files_key[] = "/module/calibrate_hcp/write_files";
+static const gchar output_dir_key[] = "/module/calibrate_hcp/output_dir";
 
 static void
 threshold_load_args(GwyContainer *settings, 
@@ -734,6 +1567,33 @@ threshold_load_args(GwyContainer *settings,
     gwy_container_gis_double_by_name(settings, upper_key, &args->upper);
     gwy_container_gis_double_by_name(settings, lattice_key, &args->lattice);
     gwy_container_gis_int32_by_name(settings, radius_key, &(tool->rpx));
+    gwy_container_gis_int32_by_name(settings, threads_key, &args->threads);
+    gwy_container_gis_int32_by_name(settings, volume_level_key,
+                                    &args->volume_level);
+    gwy_container_gis_enum_by_name(settings, mode_key, &args->mode);
+    gwy_container_gis_double_by_name(settings, known_xscale_key,
+                                     &args->known_Xscale);
+    gwy_container_gis_double_by_name(settings, known_yscale_key,
+                                     &args->known_Yscale);
+    gwy_container_gis_boolean_by_name(settings, zcal_key, &args->zcal);
+    gwy_container_gis_double_by_name(settings, step_key, &args->step);
+    gwy_container_gis_boolean_by_name(settings, fourier_key, &args->fourier);
+    gwy_container_gis_boolean_by_name(settings, in_place_key,
+                                      &args->in_place);
+    gwy_container_gis_boolean_by_name(settings, resonant_key,
+                                      &args->resonant);
+    gwy_container_gis_boolean_by_name(settings, all_channels_key,
+                                      &args->all_channels);
+    gwy_container_gis_boolean_by_name(settings, write_files_key,
+                                      &args->write_files);
+    if (!(args->step > 0.0))
+        args->step = threshold_defaults.step;
+    args->mode = MIN(args->mode, MODE_MEASURE);
+    if (args->mode == MODE_MEASURE)
+    {
+        args->Xscale = args->known_Xscale;
+        args->Yscale = args->known_Yscale;
+    }
 }
 
 static void
@@ -744,6 +1604,23 @@ threshold_save_args(GwyContainer *settings,
     gwy_container_set_double_by_name(settings, upper_key, args->upper);
     gwy_container_set_double_by_name(settings, lattice_key, args->lattice);
     gwy_container_set_int32_by_name(settings, radius_key, tool->rpx);
+    gwy_container_set_int32_by_name(settings, threads_key, args->threads);
+    gwy_container_set_int32_by_name(settings, volume_level_key,
+                                    args->volume_level);
+    gwy_container_set_enum_by_name(settings, mode_key, args->mode);
+    gwy_container_set_double_by_name(settings, known_xscale_key,
+                                     args->known_Xscale);
+    gwy_container_set_double_by_name(settings, known_yscale_key,
+                                     args->known_Yscale);
+    gwy_container_set_boolean_by_name(settings, zcal_key, args->zcal);
+    gwy_container_set_double_by_name(settings, step_key, args->step);
+    gwy_container_set_boolean_by_name(settings, fourier_key, args->fourier);
+    gwy_container_set_boolean_by_name(settings, in_place_key, args->in_place);
+    gwy_container_set_boolean_by_name(settings, resonant_key, args->resonant);
+    gwy_container_set_boolean_by_name(settings, all_channels_key,
+                                      args->all_channels);
+    gwy_container_set_boolean_by_name(settings, write_files_key,
+                                      args->write_files);
 }
 
 static void
@@ -753,8 +1630,8 @@ gwy_tool_level3_render_cell(GtkCellLayout *layout,
 {
     ThresholdControls *controls = (ThresholdControls*)user_data;
     const GwySIValueFormat *vf;
+    const HcpLatticePeak *peak;
     gchar buf[32];
-    gdouble point[2];
     gdouble val;
     guint idx, id;
     id = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(layout), "id"));
@@ -765,26 +1642,45 @@ gwy_tool_level3_render_cell(GtkCellLayout *layout,
         g_object_set(renderer, "text", buf, NULL);
         return;
     }
-    if (!controls->selection ||
-            !gwy_selection_get_object(controls->selection, idx, point))
+    if (idx >= controls->peaks->len)
     {
         g_object_set(renderer, "text", "", NULL);
         return;
     }
+    peak = &g_array_index(controls->peaks, HcpLatticePeak, idx);
     switch (id)
     {
+        case COLUMN_HK:
+            if (peak->h || peak->k)
+                g_snprintf(buf, sizeof(buf), "%d,%d", peak->h, peak->k);
+            else
+                g_snprintf(buf, sizeof(buf), "–");
+            g_object_set(renderer, "text", buf, NULL);
+            return;
         case COLUMN_X:
-            peak_find(controls, point, idx);
             vf = controls->XY_Format;
-            val = controls->p[idx][0];
+            val = peak->x;
             break;
         case COLUMN_Y:
             vf = controls->XY_Format;
-            val = controls->p[idx][1];
+            val = peak->y;
             break;
         case COLUMN_Z:
             vf = controls->Z_Format;
-            val = controls->p[idx][2];
+            val = peak->z;
+            break;
+        case COLUMN_SNR:
+            g_snprintf(buf, sizeof(buf), "%.1f", peak->snr);
+            g_object_set(renderer, "text", buf, NULL);
+            return;
+        case COLUMN_RESIDUAL:
+            if (isnan(peak->residual))
+            {
+                g_object_set(renderer, "text", "", NULL);
+                return;
+            }
+            vf = controls->XY_Format;
+            val = peak->residual;
             break;
         default:
             g_return_if_reached();
@@ -796,13 +1692,18 @@ gwy_tool_level3_render_cell(GtkCellLayout *layout,
     else
         g_snprintf(buf, sizeof(buf), "%.3g", val);
     g_object_set(renderer, "text", buf, NULL);
-    calibrate_update_scales(controls);
 }
 
 static void
 calibrate_update_scales(ThresholdControls *controls)
 {
-    if (gwy_selection_is_full(controls->selection))
+    if (controls->args->mode == MODE_MEASURE)
+    {
+        measure_update(controls);
+        factors_changed(controls);
+        return;
+    }
+    if (peaks_ready(controls))
     {
         calibration_get_factors(controls);
         gtk_entry_set_text(GTK_ENTRY(controls->xscale),
@@ -824,82 +1725,126 @@ calibrate_update_scales(ThresholdControls *controls)
         g_free(s1);
         g_free(s2);
     }
+    factors_changed(controls);
 }
 
 static void
 peak_find(ThresholdControls *controls, gdouble *point, guint idx)
 {
     GwyDataField *dfield = controls->disp_data;
-    gint i, j, low_i, high_i, low_j, high_j;
-    gdouble temp_i, temp_j, temp_z;
     gint col = gwy_data_field_rtoj(dfield, point[0]);
     gint row = gwy_data_field_rtoi(dfield, point[1]);
-    temp_i = col;
-    temp_j = row;    
-    temp_z = gwy_data_field_get_val(dfield, col, row);
-    gint32 r = controls->tool->rpx;
-    gint Xres, Yres;
-    Xres = gwy_data_field_get_xres(dfield);
-    Yres = gwy_data_field_get_yres(dfield);
-    low_i = col - r;
-    high_i = col + r;
-    if (low_i < 0)
-        low_i = 0;
-    if (high_i > Xres)
-        high_i = Xres;
-    low_j = row - r;
-    high_j = row + r;
-    if (low_j < 0)
-        low_j = 0;
-    if (high_j > Yres)
-        high_j = Yres;
-    for (i = low_i; i < high_i; i++)
-    {
-        for (j = low_j; j < high_j; j++)
-        {
-            if (gwy_data_field_get_val(dfield, i, j) > temp_z)
-            {
-                temp_i = i;
-                temp_j = j;
-                temp_z = gwy_data_field_get_val(dfield, i, j);
-            }
-        }
-    }
-    controls->p[idx][0] = gwy_data_field_jtor(dfield, temp_i)
+    gdouble z;
+    col = CLAMP(col, 0, gwy_data_field_get_xres(dfield) - 1);
+    row = CLAMP(row, 0, gwy_data_field_get_yres(dfield) - 1);
+    gboolean moved = hcp_field_peak_find(dfield, controls->tool->rpx,
+                                         &col, &row, &z);
+    HcpLatticePeak *peak;
+    if (idx >= controls->peaks->len)
+        g_array_set_size(controls->peaks, idx + 1);
+    peak = &g_array_index(controls->peaks, HcpLatticePeak, idx);
+    peak->x = gwy_data_field_jtor(dfield, col)
                 + gwy_data_field_get_xoffset(dfield);
-    controls->p[idx][1] = gwy_data_field_itor(dfield, temp_j)
+    peak->y = gwy_data_field_itor(dfield, row)
                 + gwy_data_field_get_yoffset(dfield);
-    controls->p[idx][2] = temp_z;
-    if ((row - temp_j) != 0 || (col - temp_i) != 0)
+    peak->z = z;
+    peak->snr = controls->disp_rms > 0.0
+                ? (z - controls->disp_avg)/controls->disp_rms : 0.0;
+    if (moved)
     {
-        point[0] = gwy_data_field_jtor(dfield, temp_i);
-        point[1] = gwy_data_field_itor(dfield, temp_j);
+        point[0] = gwy_data_field_jtor(dfield, col);
+        point[1] = gwy_data_field_itor(dfield, row);
         gwy_selection_set_object(controls->selection, idx, point);
     }
 }
 
 static void
-gwy_tool_level3_radius_changed(GwyToolLevel3 *tool)
+gwy_tool_level3_radius_changed(ThresholdControls *controls)
 {
+    GwyToolLevel3 *tool = controls->tool;
     tool->rpx = gwy_adjustment_get_int(tool->radius);
-    guint i;
-    GwyNullStore *store = GWY_NULL_STORE(tool->model);
-    for (i = 0; i < 2; i++)
-        gwy_null_store_row_changed(store, i);
+    selection_changed(controls, -1);
+}
+
+static gboolean
+peaks_ready(ThresholdControls *controls)
+{
+    return controls->peaks->len >= 2;
+}
+
+/*
+ *  The two first ring peaks the sweep and the measurement start from: the
+ *  strongest peak indexed to the first ring and the first ring peak
+ *  nearest to 60 or 120 degrees from it.  The peak list is sorted by
+ *  height after detection, so its first two entries need not be
+ *  neighbours, or even on the first ring.  Without such a pair, e.g. with
+ *  just two peaks selected, the first two are taken as they are.
+ */
+static gboolean
+peak_pair(ThresholdControls *controls, HcpPeak *p1, HcpPeak *p2)
+{
+    const HcpLatticePeak *peaks = (const HcpLatticePeak*)controls->peaks->data;
+    gdouble best = G_MAXDOUBLE;
+    gint i, b1 = -1, b2 = -1, n = controls->peaks->len;
+    if (n < 2)
+        return FALSE;
+    for (i = 0; i < n; i++)
+    {
+        const HcpLatticePeak *p = peaks + i;
+        if (p->h*p->h + p->k*p->k + p->h*p->k != 1)
+            continue;
+        if (b1 < 0 || p->z > peaks[b1].z)
+            b1 = i;
+    }
+    for (i = 0; b1 >= 0 && i < n; i++)
+    {
+        const HcpLatticePeak *p = peaks + i;
+        gdouble gamma, d;
+        if (i == b1 || p->h*p->h + p->k*p->k + p->h*p->k != 1)
+            continue;
+        gamma = fabs(remainder(atan2(p->y, p->x)
+                               - atan2(peaks[b1].y, peaks[b1].x), 2.0*G_PI));
+        d = MIN(fabs(gamma - G_PI/3.0), fabs(gamma - 2.0*G_PI/3.0));
+        if (d < best)
+        {
+            best = d;
+            b2 = i;
+        }
+    }
+    if (b2 < 0)
+    {
+        b1 = 0;
+        b2 = 1;
+    }
+    peak_get(controls, b1, p1);
+    peak_get(controls, b2, p2);
+    return TRUE;
+}
+
+static void
+peak_get(ThresholdControls *controls, guint idx, HcpPeak *peak)
+{
+    const HcpLatticePeak *p
+        = &g_array_index(controls->peaks, HcpLatticePeak, idx);
+    peak->x = p->x;
+    peak->y = p->y;
+    peak->z = p->z;
+}
+
+static void
+threads_changed(ThresholdControls *controls)
+{
+    controls->args->threads = gwy_adjustment_get_int(controls->threads);
+    hcp_set_n_threads(controls->args->threads);
 }
 
 static void
-perform_fft(GwyDataField *dfield, GwyContainer *data)
+perform_fft(GwyDataField *dfield, GwyDataField *spectrum, GwyContainer *data)
 {    
-    GwyDataField *raout, *ipout;
-    raout = gwy_data_field_new_alike(dfield, FALSE);
-    ipout = gwy_data_field_new_alike(dfield, FALSE);
-    gwy_data_field_2dfft(dfield, NULL, raout, ipout,
-                         GWY_WINDOWING_HANN,
-                         GWY_TRANSFORM_DIRECTION_FORWARD,
-                         GWY_INTERPOLATION_LINEAR, FALSE, 1);
-    set_dfield_modulus(raout, ipout, dfield);
-    fft_postprocess(dfield);
+    if (spectrum)
+        gwy_data_field_copy(spectrum, dfield, TRUE);
+    else
+        hcp_field_spectrum(dfield, workspace);
     gchar *key;
     key = g_strdup_printf("/%i/base/palette", 0);
     gwy_container_set_string_by_name(data, key, g_strdup("Gray"));
@@ -907,92 +1852,324 @@ perform_fft(GwyDataField *dfield, GwyContainer *data)
     key = g_strdup_printf("/%i/base/range-type", 0);
     gwy_container_set_enum_by_name(data, key, GWY_LAYER_BASIC_RANGE_ADAPT);
     g_free(key);
-    g_object_unref(raout);
-    g_object_unref(ipout);
 }
 
+/*
+ *  The peak cache holds one entry per selected point.  A change of one
+ *  point (hint >= 0) refines only that peak; the indices and the fit,
+ *  which depend on all of them, are redone in peaks_update().
+ */
 static void
-set_dfield_modulus(GwyDataField *re, GwyDataField *im, GwyDataField *target)
+selection_changed(ThresholdControls *controls, gint hint)
 {
-    const gdouble *datare, *dataim;
-    gdouble *data;
-    gint xres, yres, i;
-    xres = gwy_data_field_get_xres(re);
-    yres = gwy_data_field_get_yres(re);
-    datare = gwy_data_field_get_data_const(re);
-    dataim = gwy_data_field_get_data_const(im);
-    data = gwy_data_field_get_data(target);
-    for (i = xres*yres; i; i--, datare++, dataim++, data++)
-        *data = hypot(*datare, *dataim);
+    gdouble point[2];
+    guint i, n;
+    if (controls->refining)
+        return;
+    n = gwy_selection_get_data(controls->selection, NULL);
+    if (hint >= 0 && n == controls->peaks->len && peak_drag(controls, hint))
+        return;
+    controls->dragging = FALSE;
+    controls->refining = TRUE;
+    if (n != controls->peaks->len)
+        hint = -1;
+    g_array_set_size(controls->peaks, n);
+    for (i = 0; i < n; i++)
+    {
+        if (hint >= 0 && i != (guint)hint)
+            continue;
+        if (gwy_selection_get_object(controls->selection, i, point))
+            peak_find(controls, point, i);
+    }
+    controls->refining = FALSE;
+    peaks_update(controls);
 }
 
-static void
-fft_postprocess(GwyDataField *dfield)
+/*
+ *  Fast path for a peak being dragged: only the moved peak is refined and
+ *  its old ring equation is swapped for the new one in the running sums.
+ *  Indexing is cheap and redone on every step; if it changes any (h, k),
+ *  the sums are rebuilt from all peaks.  The views follow from an idle
+ *  handler, so a burst of motion events costs one redraw.  Returns FALSE
+ *  when the full update is needed instead, which includes a linearised
+ *  sweep since that follows the peaks.
+ */
+static gboolean
+peak_drag(ThresholdControls *controls, gint hint)
 {
-    gint res;
-    gdouble r;
-    gwy_data_field_2dfft_humanize(dfield);
-    GwySIUnit *xyunit;
-    xyunit = gwy_data_field_get_si_unit_xy(dfield);
-    gwy_si_unit_power(xyunit, -1, xyunit);
-    gwy_data_field_set_xreal(dfield, 1.0/gwy_data_field_get_xmeasure(dfield));
-    gwy_data_field_set_yreal(dfield, 1.0/gwy_data_field_get_ymeasure(dfield));
-    res = gwy_data_field_get_xres(dfield);
-    r = res / 2.0;
-    gwy_data_field_set_xoffset(dfield, -gwy_data_field_jtor(dfield, r));
-    res = gwy_data_field_get_yres(dfield);
-    r = res / 2.0;
-    gwy_data_field_set_yoffset(dfield, -gwy_data_field_itor(dfield, r));
-    gdouble dmin, dmax;
-    gwy_data_field_get_min_max(dfield, &dmin, &dmax);
-    gwy_data_field_add(dfield, -dmin);
+    GArray *peaks = controls->peaks;
+    HcpLatticePeak *data = (HcpLatticePeak*)peaks->data, *peak;
+    HcpFactors factors;
+    gint hk[2*MAX_PEAKS];
+    gdouble point[2], lattice = controls->args->lattice;
+    gchar buf[32];
+    gboolean reindexed = FALSE;
+    guint i;
+    if (controls->args->mode != MODE_CALIBRATE || !peaks_ready(controls)
+        || resonance_active(controls->args)
+        || controls->shown->len != peaks->len || peaks->len > MAX_PEAKS)
+        return FALSE;
+    if (!controls->dragging)
+    {
+        memset(&controls->sums, 0, sizeof(HcpFitSums));
+        for (i = 0; i < peaks->len; i++)
+            hcp_fit_sums_add(&controls->sums, data + i, lattice, 1);
+        controls->dragging = TRUE;
+        controls->drag_slow = FALSE;
+    }
+    peak = data + hint;
+    hcp_fit_sums_add(&controls->sums, peak, lattice, -1);
+    controls->refining = TRUE;
+    if (gwy_selection_get_object(controls->selection, hint, point))
+        peak_find(controls, point, hint);
+    controls->refining = FALSE;
+    for (i = 0; i < peaks->len; i++)
+    {
+        hk[2*i] = data[i].h;
+        hk[2*i + 1] = data[i].k;
+    }
+    if (hcp_index_peaks(data, peaks->len) < 2)
+        return FALSE;
+    for (i = 0; i < peaks->len && !reindexed; i++)
+        reindexed = (data[i].h != hk[2*i] || data[i].k != hk[2*i + 1]);
+    if (reindexed)
+    {
+        memset(&controls->sums, 0, sizeof(HcpFitSums));
+        for (i = 0; i < peaks->len; i++)
+            hcp_fit_sums_add(&controls->sums, data + i, lattice, 1);
+    }
+    else
+        hcp_fit_sums_add(&controls->sums, peak, lattice, 1);
+    hcp_fit_sums_solve(&controls->sums, &factors);
+    controls->args->Xscale = factors.Xscale;
+    controls->args->Yscale = factors.Yscale;
+    controls->args->Xwarning = factors.Xwarning;
+    controls->args->Ywarning = factors.Ywarning;
+    g_snprintf(buf, sizeof(buf), "%f", factors.Xscale);
+    gtk_entry_set_text(GTK_ENTRY(controls->xscale), buf);
+    g_snprintf(buf, sizeof(buf), "%f", factors.Yscale);
+    gtk_entry_set_text(GTK_ENTRY(controls->yscale), buf);
+    check_warnings(controls);
+    if (!controls->factors_idle)
+        controls->factors_idle = g_idle_add(factors_changed_idle, controls);
+    for (i = 0; i < peaks->len; i++)
+    {
+        if (!reindexed && i != (guint)hint)
+            continue;
+        data[i].residual = hcp_fit_residual(data + i, &factors, lattice);
+        g_array_index(controls->shown, HcpLatticePeak, i) = data[i];
+        gwy_null_store_row_changed(GWY_NULL_STORE(controls->tool->model), i);
+    }
+    return TRUE;
 }
 
-static void
-selection_changed(ThresholdControls *controls)
+/*
+ *  The views following a drag.  The calibrated preview is left for the
+ *  end of the drag once an update has gone over DRAG_BUDGET.
+ */
+static gboolean
+factors_changed_idle(gpointer user_data)
 {
-    guint i;
-    GwyNullStore *store = GWY_NULL_STORE(controls->tool->model);
-    for (i = 0; i < 2; i++)
-        gwy_null_store_row_changed(store, i);
+    ThresholdControls *controls = (ThresholdControls*)user_data;
+    controls->factors_idle = 0;
+    if (controls->dragging && controls->drag_slow)
+    {
+        overlay_update(controls);
+        return FALSE;
+    }
+    g_timer_start(controls->timer);
+    factors_changed(controls);
+    if (controls->dragging
+        && g_timer_elapsed(controls->timer, NULL) > DRAG_BUDGET)
+        controls->drag_slow = TRUE;
+    return FALSE;
 }
 
+/* The drag is over; index and fit everything again from scratch. */
 static void
-calibration_get_factors(ThresholdControls *controls)
+selection_finished(ThresholdControls *controls)
 {
-
-    gdouble x1, x2, y1, y2, R, xcorr, ycorr;
-    gdouble x1_2, x2_2, y1_2, y2_2;
-    x1 = controls->p[0][0];
-    y1 = controls->p[0][1];
-    x2 = controls->p[1][0];
-    y2 = controls->p[1][1];
-    R = 2 / (sqrt(3) * controls->args->lattice);
-    x1_2 = x1 * x1;
-    y1_2 = y1 * y1;
-    x2_2 = x2 * x2;
-    y2_2 = y2 * y2;
-    ycorr = R * sqrt((x1_2 - x2_2) / (x1_2 * y2_2 - x2_2 * y1_2));
-    xcorr = sqrt((R * R - (ycorr * ycorr * y1_2)) / x1_2);
-    controls->args->Xscale = 1 / xcorr;
-    controls->args->Yscale = 1 / ycorr;
-    controls->args->Xwarning = FALSE;
-    controls->args->Ywarning = FALSE;
-    if (x1_2 == x2_2)
-        controls->args->Xwarning = TRUE;
-    if (y1_2 == y2_2)
-        controls->args->Ywarning = TRUE;
-    if (x1_2 == 0)
-        controls->args->Xwarning = TRUE;
-    if (controls->args->Xscale != controls->args->Xscale)
-        controls->args->Xwarning = TRUE;
-    if (controls->args->Yscale != controls->args->Yscale)
-        controls->args->Ywarning = TRUE;
-    if (x1_2 * y2_2 == x2_2 * y1_2)
-    {
-        controls->args->Xwarning = TRUE;
-        controls->args->Ywarning = TRUE;
+    if (!controls->dragging)
+        return;
+    controls->dragging = FALSE;
+    if (controls->factors_idle)
+    {
+        g_source_remove(controls->factors_idle);
+        controls->factors_idle = 0;
+    }
+    peaks_update(controls);
+}
+
+/*
+ *  Re-indexes and re-fits the cached peaks, then tells the table about
+ *  the rows that actually differ from what it shows.
+ */
+static void
+peaks_update(ThresholdControls *controls)
+{
+    GwyNullStore *store = GWY_NULL_STORE(controls->tool->model);
+    GArray *peaks = controls->peaks, *shown = controls->shown;
+    guint i, n = peaks->len, nshown = shown->len;
+    hcp_index_peaks((HcpLatticePeak*)peaks->data, n);
+    for (i = 0; i < n; i++)
+        g_array_index(peaks, HcpLatticePeak, i).residual = NAN;
+    resonance_fit(controls);
+    calibrate_update_scales(controls);
+    if (gwy_null_store_get_n_rows(store) != n)
+        gwy_null_store_set_n_rows(store, n);
+    for (i = 0; i < MIN(n, nshown); i++)
+    {
+        if (memcmp(&g_array_index(peaks, HcpLatticePeak, i),
+                   &g_array_index(shown, HcpLatticePeak, i),
+                   sizeof(HcpLatticePeak)))
+            gwy_null_store_row_changed(store, i);
     }
+    g_array_set_size(shown, n);
+    if (n)
+        memcpy(shown->data, peaks->data, n*sizeof(HcpLatticePeak));
+}
+
+static void
+factors_changed(ThresholdControls *controls)
+{
+    overlay_update(controls);
+    calibrated_preview_update(controls);
+}
+
+/*
+ *  The predicted lattice follows the factors.  Only its basis is kept; the
+ *  points are generated when the view is exposed.
+ */
+static void
+overlay_update(ThresholdControls *controls)
+{
+    HcpFactors factors = { controls->args->Xscale, controls->args->Yscale,
+                           FALSE, FALSE };
+    /* The spectrum shown is that of the image before linearising. */
+    factors.Xscale /= resonance_xcorrection(controls->args);
+    controls->basis_valid = peaks_ready(controls)
+        && hcp_predict_basis((HcpLatticePeak*)controls->peaks->data,
+                             controls->peaks->len, controls->args->lattice,
+                             &factors, controls->basis);
+    gtk_widget_queue_draw(controls->view);
+}
+
+/*
+ *  Draws every predicted peak within the view over the spectrum as one
+ *  path, after the view has drawn itself.
+ */
+static gboolean
+overlay_expose(GtkWidget *view, GdkEventExpose *event,
+               ThresholdControls *controls)
+{
+    GwyDataView *dview = GWY_DATA_VIEW(view);
+    GwyDataField *dfield = controls->disp_data;
+    const gdouble *b = controls->basis;
+    gdouble xoff, yoff, xreal, yreal, xm, ym, det, x, y, px, py;
+    gdouble hmin = G_MAXDOUBLE, hmax = -G_MAXDOUBLE;
+    gdouble kmin = G_MAXDOUBLE, kmax = -G_MAXDOUBLE;
+    gint h, k, i;
+    cairo_t *cr;
+    if (!controls->basis_valid || !GTK_WIDGET_DRAWABLE(view))
+        return FALSE;
+    xm = gwy_data_view_get_xmeasure(dview);
+    ym = gwy_data_view_get_ymeasure(dview);
+    if (hypot(b[0]/xm, b[1]/ym) < OVERLAY_MIN_SPACING
+        || hypot(b[2]/xm, b[3]/ym) < OVERLAY_MIN_SPACING)
+        return FALSE;
+    det = b[0]*b[3] - b[1]*b[2];
+    if (!(fabs(det) > 0.0))
+        return FALSE;
+    xoff = gwy_data_field_get_xoffset(dfield);
+    yoff = gwy_data_field_get_yoffset(dfield);
+    xreal = gwy_data_field_get_xreal(dfield);
+    yreal = gwy_data_field_get_yreal(dfield);
+    for (i = 0; i < 4; i++)
+    {
+        x = xoff + (i & 1)*xreal;
+        y = yoff + (i >> 1)*yreal;
+        hmin = MIN(hmin, (x*b[3] - y*b[2])/det);
+        hmax = MAX(hmax, (x*b[3] - y*b[2])/det);
+        kmin = MIN(kmin, (b[0]*y - b[1]*x)/det);
+        kmax = MAX(kmax, (b[0]*y - b[1]*x)/det);
+    }
+    cr = gdk_cairo_create(view->window);
+    gdk_cairo_region(cr, event->region);
+    cairo_clip(cr);
+    cairo_set_line_width(cr, 1.0);
+    cairo_set_source_rgb(cr, 0.0, 1.0, 1.0);
+    for (h = (gint)floor(hmin); h <= (gint)ceil(hmax); h++)
+    {
+        for (k = (gint)floor(kmin); k <= (gint)ceil(kmax); k++)
+        {
+            if (!h && !k)
+                continue;
+            x = h*b[0] + k*b[2] - xoff;
+            y = h*b[1] + k*b[3] - yoff;
+            if (x < 0.0 || x > xreal || y < 0.0 || y > yreal)
+                continue;
+            gwy_data_view_coords_real_to_xy_float(dview, x, y, &px, &py);
+            cairo_new_sub_path(cr);
+            cairo_arc(cr, px, py, OVERLAY_RADIUS, 0.0, 2.0*G_PI);
+        }
+    }
+    cairo_stroke(cr);
+    cairo_destroy(cr);
+    return FALSE;
+}
+
+/*
+ *  Calibrates the cached downsampled image as calibrate_do() does the
+ *  channel, which takes well under a frame at this size.  Without valid
+ *  factors the image is shown as it is.
+ */
+static void
+calibrated_preview_update(ThresholdControls *controls)
+{
+    HcpFactors factors = { controls->args->Xscale, controls->args->Yscale,
+                           FALSE, FALSE };
+    GwyDataField *dfield;
+    if (!controls->calview)
+        return;
+    if (!(factors.Xscale > 0.0 && factors.Yscale > 0.0)
+        || !isfinite(factors.Xscale) || !isfinite(factors.Yscale))
+        factors.Xscale = factors.Yscale = 1.0;
+    if (resonance_active(controls->args))
+        dfield = hcp_field_apply_resonant(controls->calsource, &factors,
+                                          &controls->args->resonance,
+                                          calibrate_interp(controls->args));
+    else
+        dfield = hcp_field_apply(controls->calsource, &factors,
+                                 calibrate_interp(controls->args));
+    gwy_container_set_object_by_name(controls->caldata, "/0/data", dfield);
+    g_object_unref(dfield);
+    gwy_set_data_preview_size(GWY_DATA_VIEW(controls->calview),
+                              CALIBRATED_PREVIEW_SIZE);
+}
+
+/*
+ *  With a linearised sweep the factors are fitted to the peaks as they
+ *  will be in the remapped image.
+ */
+static void
+calibration_get_factors(ThresholdControls *controls)
+{
+    GArray *peaks = controls->peaks;
+    gdouble xcorrection = resonance_xcorrection(controls->args);
+    HcpLatticePeak *fitted;
+    HcpFactors factors;
+    guint i;
+    fitted = g_memdup(peaks->data, peaks->len*sizeof(HcpLatticePeak));
+    for (i = 0; i < peaks->len; i++)
+        fitted[i].x *= xcorrection;
+    hcp_fit_peaks(fitted, peaks->len, controls->args->lattice, &factors);
+    for (i = 0; i < peaks->len; i++)
+        g_array_index(peaks, HcpLatticePeak, i).residual = fitted[i].residual;
+    g_free(fitted);
+    controls->args->Xscale = factors.Xscale;
+    controls->args->Yscale = factors.Yscale;
+    controls->args->Xwarning = factors.Xwarning;
+    controls->args->Ywarning = factors.Ywarning;
     check_warnings(controls);
 }
 
@@ -1016,52 +2193,242 @@ check_warnings(ThresholdControls *controls)
         gtk_label_set_markup(GTK_LABEL(controls->warning), "");
 }
 
+/*
+ *  Provenance parameters of a calibration with args, started from the
+ *  peaks last saved in the settings, which is where Apply to all channels
+ *  takes its seeds from.  The dialog and the series build them only here,
+ *  so a channel done either way is recognised by the other.  radius is in
+ *  spectrum pixels; params must hold HCP_PROVENANCE_NSETTINGS
+ *  + 2*MAX_PEAKS values.
+ */
+static gint
+provenance_params(const ThresholdArgs *args, gint radius, gdouble *params)
+{
+    HcpProvenanceSettings settings;
+    gdouble xy[2*MAX_PEAKS];
+    const guchar *str;
+    gint nseeds = 0;
+    if (gwy_container_gis_string_by_name(gwy_app_settings_get(),
+                                         "/module/calibrate_hcp/peaks", &str))
+        nseeds = peaks_parse((const gchar*)str, xy, MAX_PEAKS);
+    settings.Zscale = args->zcal ? args->Zscale : 1.0;
+    settings.interp = args->in_place ? 0 : calibrate_interp(args);
+    settings.lattice = args->lattice;
+    settings.radius = radius;
+    settings.zoom = args->zoom_mode;
+    settings.level = args->volume_level;
+    settings.sweep_center = 0.0;
+    settings.sweep_span = 0.0;
+    if (resonance_active(args))
+    {
+        settings.sweep_center = args->resonance.center;
+        settings.sweep_span = args->resonance.span;
+    }
+    return hcp_provenance_params(&settings, xy, nseeds, params);
+}
+
+/*
+ *  Returns the id of the calibrated channel, which is id in place.  The
+ *  provenance also covers the spectrum the factors were found on; radius
+ *  is the search radius in spectrum pixels.
+ */
+static gint
+calibrate_do(GwyContainer *data, GwyDataField *dfield, gint id,
+             const ThresholdArgs *args, gint radius)
+{
+    HcpFactors factors = { args->Xscale, args->Yscale, FALSE, FALSE };
+    gdouble params[HCP_PROVENANCE_NSETTINGS + 2*MAX_PEAKS];
+    gint nparams;
+    gchar provenance[HCP_PROVENANCE_LENGTH];
+    GwyDataField *newDataField;
+    nparams = provenance_params(args, radius, params);
+    hcp_field_provenance(dfield, params, nparams, provenance);
+    if (args->in_place)
+    {
+        calibrate_in_place(data, dfield, id, args, provenance);
+        return id;
+    }
+    if (resonance_active(args))
+        newDataField = hcp_field_apply_resonant(dfield, &factors,
+                                                &args->resonance,
+                                                calibrate_interp(args));
+    else
+        newDataField = hcp_field_apply(dfield, &factors,
+                                       calibrate_interp(args));
+    if (args->zcal && args->Zscale != 1.0)
+        gwy_data_field_multiply(newDataField, args->Zscale);
+    return calibrate_create_output(data, newDataField, id, args, provenance);
+}
+
+/*
+ *  Only the physical dimensions change, so the channel keeps its pixels
+ *  and costs no memory; with the physical aspect ratio view the pixels
+ *  are stretched on screen and nothing is resampled until something asks
+ *  for square pixels.  Heights are still scaled in place.  The metadata
+ *  of the channel are kept, with the calibration added to them.
+ */
 static void
-calibrate_do(ThresholdControls *controls)
+calibrate_in_place(GwyContainer *data, GwyDataField *dfield, gint id,
+                   const ThresholdArgs *args, const gchar *provenance)
 {
-    gint oldXres = gwy_data_field_get_xres(controls->ofield);
-    gint oldYres = gwy_data_field_get_yres(controls->ofield);
-    gint newXres = GWY_ROUND(oldXres);
-    gint newYres = GWY_ROUND(oldYres *
-        controls->args->Yscale / controls->args->Xscale);
-    GwyDataField *newDataField = gwy_data_field_new_resampled
-        (controls->ofield, newXres, newYres, GWY_INTERPOLATION_LINEAR);
-    gdouble oldXreal = gwy_data_field_get_xreal(controls->ofield);
-    gdouble oldYreal = gwy_data_field_get_yreal(controls->ofield);
-    gdouble newXreal = oldXreal * controls->args->Xscale;
-    gdouble newYreal = oldYreal * controls->args->Yscale;
-    gwy_data_field_set_xreal(newDataField, newXreal);
-    gwy_data_field_set_yreal(newDataField, newYreal);
-    calibrate_create_output(controls->container, newDataField, controls);
+    GwyContainer *meta;
+    GQuark quarks[2];
+    gchar *meta_key;
+    meta_key = g_strdup_printf("/%i/meta", id);
+    quarks[0] = gwy_app_get_data_key_for_id(id);
+    quarks[1] = g_quark_from_string(meta_key);
+    g_free(meta_key);
+    gwy_app_undo_qcheckpointv(data, 2, quarks);
+    if (gwy_container_gis_object(data, quarks[1], &meta))
+        meta = gwy_container_duplicate(meta);
+    else
+        meta = gwy_container_new();
+    calibration_meta_add(meta, args);
+    gwy_container_set_string_by_name(meta, "Provenance",
+            (const guchar *)g_strdup(provenance));
+    gwy_container_set_object(data, quarks[1], meta);
+    g_object_unref(meta);
+    gwy_data_field_set_xreal(dfield,
+                             gwy_data_field_get_xreal(dfield)*args->Xscale);
+    gwy_data_field_set_yreal(dfield,
+                             gwy_data_field_get_yreal(dfield)*args->Yscale);
+    if (args->zcal && args->Zscale != 1.0)
+        gwy_data_field_multiply(dfield, args->Zscale);
+    gwy_data_field_data_changed(dfield);
+    gwy_app_channel_log_add(data, id, id, "proc::calibrate_hcp", NULL);
 }
 
 static void
-calibrate_create_output(GwyContainer *data,
-    GwyDataField *dfield, ThresholdControls *controls)
+calibrate_brick_do(GwyContainer *data, GwyBrick *brick, gint id,
+                   const ThresholdArgs *args)
+{
+    HcpFactors factors = { args->Xscale, args->Yscale, FALSE, FALSE };
+    GwyBrick *newBrick;
+    GwyDataField *preview;
+    GwyContainer *meta;
+    gchar *meta_key, *title_key;
+    gint newid;
+    newBrick = hcp_brick_apply(brick, &factors, calibrate_interp(args));
+    preview = gwy_data_field_new(1, 1, 1.0, 1.0, FALSE);
+    brick_plane(newBrick, -1, preview);
+    meta_key = g_strdup_printf("/brick/%i/meta", id);
+    title_key = g_strdup_printf("/brick/%i/title", id);
+    meta = calibrate_output_meta(data, meta_key, title_key, args);
+    g_free(meta_key);
+    g_free(title_key);
+    newid = gwy_app_data_browser_add_brick(newBrick, preview, data, TRUE);
+    meta_key = g_strdup_printf("/brick/%i/meta", newid);
+    gwy_container_set_object_by_name(data, meta_key, meta);
+    g_free(meta_key);
+    g_object_unref(meta);
+    gwy_app_set_brick_title(data, newid, _("Calibrated"));
+    gwy_app_volume_log_add(data, id, newid,
+                           "volume::calibrate_hcp_volume", NULL);
+    g_object_unref(preview);
+    g_object_unref(newBrick);
+}
+
+static void
+calibrate_surface_do(GwyContainer *data, GwySurface *surface, gint id,
+                     const ThresholdArgs *args)
 {
-    gint id, newid;
-    const guchar *title;
+    HcpFactors factors = { args->Xscale, args->Yscale, FALSE, FALSE };
+    GwySurface *newSurface;
     GwyContainer *meta;
-    gwy_app_data_browser_get_current(GWY_APP_DATA_FIELD_ID, &id, 0);
-    GQuark Qmeta = g_quark_from_string(g_strdup_printf("/%i/meta", id));
+    gchar *meta_key, *title_key;
+    gint newid;
+    newSurface = hcp_surface_apply(surface, &factors);
+    meta_key = g_strdup_printf("/xyz/%i/meta", id);
+    title_key = g_strdup_printf("/xyz/%i/title", id);
+    meta = calibrate_output_meta(data, meta_key, title_key, args);
+    g_free(meta_key);
+    g_free(title_key);
+    newid = gwy_app_data_browser_add_surface(newSurface, data, TRUE);
+    meta_key = g_strdup_printf("/xyz/%i/meta", newid);
+    gwy_container_set_object_by_name(data, meta_key, meta);
+    g_free(meta_key);
+    g_object_unref(meta);
+    gwy_app_set_surface_title(data, newid, _("Calibrated"));
+    gwy_app_xyz_log_add(data, id, newid, "xyz::calibrate_hcp_xyz", NULL);
+    g_object_unref(newSurface);
+}
+
+static GwyContainer*
+calibrate_output_meta(GwyContainer *data, const gchar *meta_key,
+                      const gchar *title_key, const ThresholdArgs *args)
+{
+    GwyContainer *meta;
+    const guchar *title = NULL;
+    GQuark Qmeta = g_quark_from_string(meta_key);
     if (gwy_container_contains(data, Qmeta))
         meta = gwy_container_duplicate(gwy_container_get_object(data, Qmeta));
     else
         meta = gwy_container_new();
-    title = gwy_container_get_string(data,
-            g_quark_try_string(g_strdup_printf("/%i/data/title", id)));
-    gwy_container_set_string_by_name(meta, "Source Title", title);
+    if (gwy_container_gis_string_by_name(data, title_key, &title))
+        gwy_container_set_string_by_name(meta, "Source Title",
+                (const guchar *)g_strdup((const gchar *)title));
+    calibration_meta_add(meta, args);
+    return meta;
+}
+
+static void
+calibration_meta_add(GwyContainer *meta, const ThresholdArgs *args)
+{
     gwy_container_set_string_by_name(meta, "X Scaling Factor",
-            (const guchar *)g_strdup_printf("%.5f", controls->args->Xscale));
+            (const guchar *)g_strdup_printf("%.5f", args->Xscale));
     gwy_container_set_string_by_name(meta, "Y Scaling Factor",
-            (const guchar *)g_strdup_printf("%.5f", controls->args->Yscale));
+            (const guchar *)g_strdup_printf("%.5f", args->Yscale));
+    if (args->zcal && args->Zscale != 1.0)
+        gwy_container_set_string_by_name(meta, "Z Scaling Factor",
+                (const guchar *)g_strdup_printf("%.5f", args->Zscale));
+}
+
+static gint
+calibrate_create_output(GwyContainer *data,
+    GwyDataField *dfield, gint id, const ThresholdArgs *args,
+    const gchar *provenance)
+{
+    gint newid;
+    GwyContainer *meta;
+    gchar *meta_key, *title_key;
+    meta_key = g_strdup_printf("/%i/meta", id);
+    title_key = g_strdup_printf("/%i/data/title", id);
+    meta = calibrate_output_meta(data, meta_key, title_key, args);
+    g_free(meta_key);
+    g_free(title_key);
+    gwy_container_set_string_by_name(meta, "Provenance",
+            (const guchar *)g_strdup(provenance));
     newid = gwy_app_data_browser_add_data_field(dfield, data, TRUE);
     gwy_container_set_object_by_name(data,
             g_strdup_printf("/%i/meta", newid), meta);
     gwy_app_set_data_field_title(data, newid, _("Calibrated"));
-    gwy_app_channel_log_add(data, controls->id,
+    gwy_app_channel_log_add(data, id,
             newid, "proc::calibrate_hcp", NULL);
     g_object_unref(dfield);
+    return newid;
+}
+
+/* Whether a channel of the file was already calibrated with the same data
+ * and parameters. */
+static gboolean
+provenance_exists(GwyContainer *data, const gchar *provenance)
+{
+    GwyContainer *meta;
+    const guchar *value;
+    gboolean found = FALSE;
+    gint *ids, i;
+    gchar *key;
+    ids = gwy_app_data_browser_get_data_ids(data);
+    for (i = 0; ids[i] != -1 && !found; i++)
+    {
+        key = g_strdup_printf("/%i/meta", ids[i]);
+        if (gwy_container_gis_object_by_name(data, key, &meta)
+            && gwy_container_gis_string_by_name(meta, "Provenance", &value))
+            found = !strcmp((const gchar*)value, provenance);
+        g_free(key);
+    }
+    g_free(ids);
+    return found;
 }
 
 static void
@@ -1102,6 +2469,14 @@ xscale_changed(ThresholdControls *controls)
         controls->args->Xscale = num;
     }
     gchar *s = g_strdup_printf("%0.1f", controls->args->Xscale);
+    if (controls->args->mode == MODE_MEASURE)
+    {
+        controls->args->known_Xscale = controls->args->Xscale;
+        g_free(s);
+        s = g_strdup_printf("%f", controls->args->Xscale);
+        measure_update(controls);
+        factors_changed(controls);
+    }
     gtk_entry_set_text(GTK_ENTRY(controls->xscale), s);
     g_free(s);
 }
@@ -1116,6 +2491,835 @@ yscale_changed(ThresholdControls *controls)
         controls->args->Yscale = num;
     }
     gchar *s = g_strdup_printf("%0.1f", controls->args->Yscale);
+    if (controls->args->mode == MODE_MEASURE)
+    {
+        controls->args->known_Yscale = controls->args->Yscale;
+        g_free(s);
+        s = g_strdup_printf("%f", controls->args->Yscale);
+        measure_update(controls);
+        factors_changed(controls);
+    }
+    gtk_entry_set_text(GTK_ENTRY(controls->yscale), s);
+    g_free(s);
+}
+
+static void
+sweep_clicked(ThresholdControls *controls)
+{
+    HcpPeak seeds[2];
+    HcpSweep *sweep;
+    const HcpSweepPoint *best;
+    gchar *s;
+    if (!peak_pair(controls, seeds, seeds + 1))
+    {
+        gtk_label_set_text(GTK_LABEL(controls->sweep),
+                           _("Select two peaks first."));
+        return;
+    }
+    gwy_app_wait_cursor_start(GTK_WINDOW(controls->dialog));
+    sweep = hcp_sweep(controls->ofield, seeds, controls->args->lattice);
+    gwy_app_wait_cursor_finish(GTK_WINDOW(controls->dialog));
+    if (sweep->best < 0)
+    {
+        gtk_label_set_text(GTK_LABEL(controls->sweep),
+                           _("No setting gave valid factors."));
+        hcp_sweep_free(sweep);
+        return;
+    }
+    best = sweep->points + sweep->best;
+    s = g_strdup_printf(_("%d of %d settings valid\n"
+                          "X: %.4f ± %.4f\n"
+                          "Y: %.4f ± %.4f\n"
+                          "Most stable: %s, radius %d px,\n"
+                          "padding ×%d, %.0f %% of image"),
+                        sweep->nvalid, sweep->npoints,
+                        sweep->Xmean, sweep->Xrms,
+                        sweep->Ymean, sweep->Yrms,
+                        gwy_enum_to_string(best->window,
+                                           gwy_windowing_type_get_enum(), -1),
+                        best->radius, best->padding, 100.0*best->roi);
+    gtk_label_set_text(GTK_LABEL(controls->sweep), s);
+    g_free(s);
+    hcp_sweep_free(sweep);
+}
+
+static void
+quality_update(ThresholdControls *controls)
+{
+    HcpQuality *quality = &controls->spectrum_quality;
+    gchar *s, *score;
+    hcp_field_quality(controls->offt, 1, quality);
+    if (quality->passed)
+        score = g_strdup_printf("%.2f", quality->score);
+    else
+        score = g_strdup_printf("<span foreground=\"red\">%.2f %s</span>",
+                                quality->score, _("(low)"));
+    s = g_strdup_printf(_("Spectrum quality: %s\n"
+                          "peak/background %.1f, sharpness %.1f, "
+                          "six-fold %.2f"),
+                        score,
+                        quality->peak_to_background, quality->sharpness,
+                        quality->sixfold);
+    gtk_label_set_markup(GTK_LABEL(controls->quality), s);
+    g_free(score);
+    g_free(s);
+}
+
+/*
+ *  Switching the level of a brick replaces the spectrum and the plane used
+ *  by the sweep; the selected peaks are refined on the new spectrum.
+ */
+static void
+level_changed(ThresholdControls *controls)
+{
+    GwyDataField *spectrum;
+    gint level = gwy_adjustment_get_int(controls->level);
+    if (level == controls->args->volume_level)
+        return;
+    controls->args->volume_level = level;
+    gwy_app_wait_cursor_start(GTK_WINDOW(controls->dialog));
+    spectrum = hcp_brick_spectrum(controls->brick, level, workspace);
+    brick_plane(controls->brick, level, controls->ofield);
+    gwy_app_wait_cursor_finish(GTK_WINDOW(controls->dialog));
+    g_object_unref(controls->calsource);
+    controls->calsource = hcp_field_downsample(controls->ofield,
+                                               CALIBRATED_PREVIEW_SIZE);
+    gwy_data_field_copy(spectrum, controls->offt, TRUE);
+    gwy_data_field_copy(spectrum, controls->dfield, TRUE);
+    g_object_unref(spectrum);
+    gwy_data_field_get_min_max(controls->offt, &controls->ranges->min,
+                               &controls->ranges->max);
+    quality_update(controls);
+    controls->resonance_xfreq = 0.0;
+    reFind_Peaks(controls);
+}
+
+/*
+ *  Quick estimate from row and column spectra.  The ring orientation is
+ *  taken from the first selected peak, otherwise a lattice row is assumed
+ *  to run along x.
+ */
+static void
+line_estimate_clicked(ThresholdControls *controls)
+{
+    HcpLineEstimate estimate;
+    gdouble angle = G_PI/6.0;
+    gint step;
+    gchar *s;
+    if (peaks_ready(controls))
+    {
+        HcpPeak peak;
+        peak_get(controls, 0, &peak);
+        angle = atan2(peak.y, peak.x);
+    }
+    /* Some 64 lines each way are enough for an estimate. */
+    step = MIN(gwy_data_field_get_xres(controls->ofield),
+               gwy_data_field_get_yres(controls->ofield))/64;
+    hcp_field_line_estimate(controls->ofield, controls->args->lattice,
+                            angle, MAX(step, 1), &estimate);
+    s = g_strdup_printf(_("Line spectra: X %.4f%s, Y %.4f%s"),
+                        estimate.factors.Xscale,
+                        estimate.factors.Xwarning ? _(" (weak)") : "",
+                        estimate.factors.Yscale,
+                        estimate.factors.Ywarning ? _(" (weak)") : "");
+    gtk_label_set_text(GTK_LABEL(controls->line_estimate), s);
+    g_free(s);
+}
+
+/*
+ *  In measure mode the scale factors are known, typically from an
+ *  earlier calibration of the scanner, and the selected peaks give the
+ *  lattice of the sample instead.
+ */
+static void
+measure_update(ThresholdControls *controls)
+{
+    HcpFactors factors = { controls->args->Xscale, controls->args->Yscale,
+                           FALSE, FALSE };
+    GwySIValueFormat *vf = controls->original_XY_Format;
+    gdouble xcorrection = resonance_xcorrection(controls->args);
+    HcpPeak p1, p2;
+    HcpLattice lattice;
+    gchar *s;
+    if (!peak_pair(controls, &p1, &p2))
+    {
+        gtk_label_set_text(GTK_LABEL(controls->measure),
+                           _("Select two peaks to measure the lattice."));
+        return;
+    }
+    /* Measured as the peaks will be once the sweep is linearised. */
+    p1.x *= xcorrection;
+    p2.x *= xcorrection;
+    /* The zoomed display only interpolates the spectrum, so the bins of
+     * the spectrum and not the display pixels set the uncertainty. */
+    if (!hcp_measure_lattice(&p1, &p2, &factors,
+                             xcorrection
+                             * gwy_data_field_get_xmeasure(controls->offt),
+                             gwy_data_field_get_ymeasure(controls->offt),
+                             &lattice))
+    {
+        gtk_label_set_text(GTK_LABEL(controls->measure),
+                           _("The peaks do not define a lattice."));
+        return;
+    }
+    s = g_strdup_printf(_("Lattice constant: %.*f ± %.*f %s\n"
+                          "(a₁ %.*f, a₂ %.*f %s)\n"
+                          "Orientation: %.2f ± %.2f°\n"
+                          "Shear: %.2f ± %.2f°"),
+                        vf->precision + 2, lattice.lattice/vf->magnitude,
+                        vf->precision + 2, lattice.lattice_err/vf->magnitude,
+                        vf->units,
+                        vf->precision + 2, lattice.a1/vf->magnitude,
+                        vf->precision + 2, lattice.a2/vf->magnitude,
+                        vf->units,
+                        lattice.angle*180.0/G_PI,
+                        lattice.angle_err*180.0/G_PI,
+                        lattice.shear*180.0/G_PI,
+                        lattice.shear_err*180.0/G_PI);
+    gtk_label_set_markup(GTK_LABEL(controls->measure), s);
+    g_free(s);
+}
+
+static void
+mode_changed(GtkToggleButton *button, ThresholdControls *controls)
+{
+    if (!gtk_toggle_button_get_active(button))
+        return;
+    controls->args->mode = gwy_radio_buttons_get_current(controls->mode_radios);
+    if (controls->args->mode == MODE_MEASURE)
+    {
+        controls->args->Xscale = controls->args->known_Xscale;
+        controls->args->Yscale = controls->args->known_Yscale;
+    }
+    mode_apply(controls);
+}
+
+static void
+mode_apply(ThresholdControls *controls)
+{
+    gboolean measure = (controls->args->mode == MODE_MEASURE);
+    gchar *s;
+    gtk_widget_set_sensitive(controls->lattice, !measure);
+    if (!measure)
+    {
+        gtk_label_set_text(GTK_LABEL(controls->measure), "");
+        if (peaks_ready(controls))
+            calibrate_update_scales(controls);
+        else
+            factors_changed(controls);
+        return;
+    }
+    controls->args->Xwarning = controls->args->Ywarning = FALSE;
+    check_warnings(controls);
+    s = g_strdup_printf("%f", controls->args->Xscale);
+    gtk_entry_set_text(GTK_ENTRY(controls->xscale), s);
+    g_free(s);
+    s = g_strdup_printf("%f", controls->args->Yscale);
     gtk_entry_set_text(GTK_ENTRY(controls->yscale), s);
     g_free(s);
+    measure_update(controls);
+    factors_changed(controls);
+}
+
+static void
+zcal_toggled(ThresholdControls *controls)
+{
+    controls->args->zcal
+        = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(controls->zcal));
+    zcal_update(controls);
+}
+
+static void
+step_changed(ThresholdControls *controls)
+{
+    const gchar *value = gtk_entry_get_text(GTK_ENTRY(controls->step));
+    gdouble num = g_strtod(value, NULL) * controls->step_format->magnitude;
+    if (num > 0 && num != controls->args->step)
+    {
+        controls->args->step = num;
+        zcal_update(controls);
+    }
+    step_format_value(controls);
+}
+
+static void
+step_format_value(ThresholdControls *controls)
+{
+    gchar *s = g_strdup_printf("%.4g",
+                    controls->args->step/controls->step_format->magnitude);
+    gtk_entry_set_text(GTK_ENTRY(controls->step), s);
+    g_free(s);
+}
+
+/*
+ *  The Z factor comes from the terraces of the image itself, not from
+ *  its spectrum, and is applied together with the lateral correction.
+ */
+static void
+zcal_update(ThresholdControls *controls)
+{
+    GwySIValueFormat *vf = controls->step_format;
+    HcpStepHeight result;
+    gchar *s;
+    controls->args->Zscale = 1.0;
+    if (!controls->args->zcal || !gtk_widget_get_sensitive(controls->zcal))
+    {
+        gtk_label_set_text(GTK_LABEL(controls->zresult), "");
+        return;
+    }
+    gwy_app_wait_cursor_start(GTK_WINDOW(controls->dialog));
+    hcp_field_step_height(controls->ofield, controls->args->step, &result);
+    gwy_app_wait_cursor_finish(GTK_WINDOW(controls->dialog));
+    if (!(result.step > 0.0))
+    {
+        s = g_strdup_printf("<span foreground=\"red\">%s</span>",
+                            result.nlevels < 2
+                            ? _("No terraces found.")
+                            : _("Terrace levels are not evenly spaced."));
+        gtk_label_set_markup(GTK_LABEL(controls->zresult), s);
+        g_free(s);
+        return;
+    }
+    controls->args->Zscale = result.Zscale;
+    s = g_strdup_printf(_("Z: %.4f%s\n"
+                          "step %.*f ± %.*f %s from %d terraces"),
+                        result.Zscale,
+                        result.warning ? _(" (weak)") : "",
+                        vf->precision + 2, result.step/vf->magnitude,
+                        vf->precision + 2, result.step_err/vf->magnitude,
+                        vf->units, result.nlevels);
+    gtk_label_set_markup(GTK_LABEL(controls->zresult), s);
+    g_free(s);
+}
+
+/* Everything peaks_save() writes under prefix/calibrate_hcp. */
+static const gchar *const peaks_keys[] = {
+    "peaks", "lattice", "radius", "xscale", "yscale",
+    "zoom", "lower", "upper", "level",
+};
+
+static gchar*
+peaks_key(const gchar *prefix, const gchar *name)
+{
+    return g_strconcat(prefix, "/calibrate_hcp/", name, NULL);
+}
+
+/*
+ *  The peaks, the fit and the settings of the spectrum they were picked
+ *  on are kept under prefix/calibrate_hcp: under the channel when a
+ *  calibration is applied, and under /module in the settings as the start
+ *  for the next image.  Peaks are stored as absolute spatial frequencies,
+ *  which do not depend on the zoom or the resolution of the spectrum.
+ *  Writing into a data file can be undone.
+ */
+static void
+peaks_save(ThresholdControls *controls, GwyContainer *container,
+           const gchar *prefix, gboolean undo)
+{
+    GString *str;
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE], *key;
+    guint i;
+    if (!peaks_ready(controls))
+        return;
+    if (undo)
+    {
+        GQuark quarks[G_N_ELEMENTS(peaks_keys)];
+        for (i = 0; i < G_N_ELEMENTS(peaks_keys); i++)
+        {
+            key = peaks_key(prefix, peaks_keys[i]);
+            quarks[i] = g_quark_from_string(key);
+            g_free(key);
+        }
+        gwy_app_undo_qcheckpointv(container, G_N_ELEMENTS(quarks), quarks);
+    }
+    str = g_string_new(NULL);
+    for (i = 0; i < controls->peaks->len; i++)
+    {
+        const HcpLatticePeak *peak
+            = &g_array_index(controls->peaks, HcpLatticePeak, i);
+        g_string_append(str, i ? " " : "");
+        g_string_append(str, g_ascii_dtostr(buf, sizeof(buf), peak->x));
+        g_string_append(str, " ");
+        g_string_append(str, g_ascii_dtostr(buf, sizeof(buf), peak->y));
+    }
+    key = peaks_key(prefix, "peaks");
+    gwy_container_set_string_by_name(container, key,
+                                     (const guchar *)g_string_free(str, FALSE));
+    g_free(key);
+    key = peaks_key(prefix, "lattice");
+    gwy_container_set_double_by_name(container, key, controls->args->lattice);
+    g_free(key);
+    key = peaks_key(prefix, "radius");
+    gwy_container_set_int32_by_name(container, key, controls->tool->rpx);
+    g_free(key);
+    key = peaks_key(prefix, "xscale");
+    gwy_container_set_double_by_name(container, key, controls->args->Xscale);
+    g_free(key);
+    key = peaks_key(prefix, "yscale");
+    gwy_container_set_double_by_name(container, key, controls->args->Yscale);
+    g_free(key);
+    key = peaks_key(prefix, "zoom");
+    gwy_container_set_enum_by_name(container, key, controls->args->zoom_mode);
+    g_free(key);
+    key = peaks_key(prefix, "lower");
+    gwy_container_set_double_by_name(container, key, controls->args->lower);
+    g_free(key);
+    key = peaks_key(prefix, "upper");
+    gwy_container_set_double_by_name(container, key, controls->args->upper);
+    g_free(key);
+    if (controls->brick)
+    {
+        key = peaks_key(prefix, "level");
+        gwy_container_set_int32_by_name(container, key,
+                                        controls->args->volume_level);
+        g_free(key);
+    }
+}
+
+/*
+ *  Puts the stored spectrum settings back first, as the peaks are placed
+ *  on the spectrum they give, then the peaks into the selection, where
+ *  they are refined within the search radius like any moved point instead
+ *  of detected again.  Peaks outside the displayed spectrum are dropped.
+ *  The stored factors are the known ones when measuring; when calibrating
+ *  they only stand in if none of the peaks could be placed.
+ */
+static gboolean
+peaks_restore(ThresholdControls *controls, GwyContainer *container,
+              const gchar *prefix)
+{
+    ThresholdArgs *args = controls->args;
+    GwyDataField *disp;
+    const guchar *peaks;
+    gchar *key, *s;
+    gdouble xoff, yoff, xreal, yreal, value, xscale = 0.0, yscale = 0.0;
+    gdouble *xy;
+    gint32 radius, level;
+    guint zoom;
+    gint i, npeaks, n = 0;
+    key = peaks_key(prefix, "peaks");
+    if (!gwy_container_gis_string_by_name(container, key, &peaks))
+    {
+        g_free(key);
+        return FALSE;
+    }
+    g_free(key);
+    key = peaks_key(prefix, "level");
+    if (controls->brick
+        && gwy_container_gis_int32_by_name(container, key, &level))
+        gtk_adjustment_set_value(GTK_ADJUSTMENT(controls->level), level);
+    g_free(key);
+    key = peaks_key(prefix, "zoom");
+    if (gwy_container_gis_enum_by_name(container, key, &zoom)
+        && (zoom == ZOOM_1 || zoom == ZOOM_2) && zoom != args->zoom_mode)
+        gwy_radio_buttons_set_current(controls->zoom_mode_radios, zoom);
+    g_free(key);
+    key = peaks_key(prefix, "lower");
+    if (gwy_container_gis_double_by_name(container, key, &value))
+        args->lower = CLAMP(value, controls->ranges->min,
+                             controls->ranges->max);
+    g_free(key);
+    key = peaks_key(prefix, "upper");
+    if (gwy_container_gis_double_by_name(container, key, &value))
+        args->upper = CLAMP(value, controls->ranges->min,
+                             controls->ranges->max);
+    g_free(key);
+    threshold_format_value(controls, GTK_ENTRY(controls->lower), args->lower);
+    threshold_format_value(controls, GTK_ENTRY(controls->upper), args->upper);
+    preview_range(controls);
+    key = peaks_key(prefix, "radius");
+    if (gwy_container_gis_int32_by_name(container, key, &radius)
+        && radius != controls->tool->rpx)
+        gtk_adjustment_set_value(GTK_ADJUSTMENT(controls->tool->radius),
+                                 CLAMP(radius, 0, 10));
+    g_free(key);
+    key = peaks_key(prefix, "lattice");
+    if (args->mode == MODE_CALIBRATE
+        && gwy_container_gis_double_by_name(container, key, &value)
+        && value > 0.0)
+    {
+        args->lattice = value;
+        threshold_format_value(controls, GTK_ENTRY(controls->lattice), value);
+    }
+    g_free(key);
+    key = peaks_key(prefix, "xscale");
+    gwy_container_gis_double_by_name(container, key, &xscale);
+    g_free(key);
+    key = peaks_key(prefix, "yscale");
+    gwy_container_gis_double_by_name(container, key, &yscale);
+    g_free(key);
+    disp = controls->disp_data;
+    xoff = gwy_data_field_get_xoffset(disp);
+    yoff = gwy_data_field_get_yoffset(disp);
+    xreal = gwy_data_field_get_xreal(disp);
+    yreal = gwy_data_field_get_yreal(disp);
+    xy = g_new(gdouble, 2*MAX_PEAKS);
+    npeaks = peaks_parse((const gchar*)peaks, xy, MAX_PEAKS);
+    for (i = 0; i < npeaks; i++)
+    {
+        gdouble x = xy[2*i] - xoff, y = xy[2*i + 1] - yoff;
+        if (x < 0.0 || x >= xreal || y < 0.0 || y >= yreal)
+            continue;
+        xy[2*n] = x;
+        xy[2*n + 1] = y;
+        n++;
+    }
+    if (n)
+        gwy_selection_set_data(controls->selection, n, xy);
+    g_free(xy);
+    if (xscale > 0.0 && yscale > 0.0
+        && (args->mode == MODE_MEASURE || !n))
+    {
+        args->Xscale = xscale;
+        args->Yscale = yscale;
+        if (args->mode == MODE_MEASURE)
+        {
+            args->known_Xscale = xscale;
+            args->known_Yscale = yscale;
+        }
+        s = g_strdup_printf("%f", xscale);
+        gtk_entry_set_text(GTK_ENTRY(controls->xscale), s);
+        g_free(s);
+        s = g_strdup_printf("%f", yscale);
+        gtk_entry_set_text(GTK_ENTRY(controls->yscale), s);
+        g_free(s);
+        if (args->mode == MODE_MEASURE)
+            measure_update(controls);
+        factors_changed(controls);
+    }
+    return n > 0;
+}
+
+/* Reads up to max (x, y) pairs stored by peaks_save(). */
+static gint
+peaks_parse(const gchar *str, gdouble *xy, gint max)
+{
+    gchar *end;
+    gint n = 0;
+    while (n < max)
+    {
+        xy[2*n] = g_ascii_strtod(str, &end);
+        if (end == str)
+            break;
+        str = end;
+        xy[2*n + 1] = g_ascii_strtod(str, &end);
+        if (end == str)
+            break;
+        str = end;
+        n++;
+    }
+    return n;
+}
+
+static void
+fourier_toggled(ThresholdControls *controls)
+{
+    controls->args->fourier = gtk_toggle_button_get_active(
+                                GTK_TOGGLE_BUTTON(controls->fourier));
+    calibrated_preview_update(controls);
+}
+
+static void
+in_place_toggled(ThresholdControls *controls)
+{
+    controls->args->in_place = gtk_toggle_button_get_active(
+                                GTK_TOGGLE_BUTTON(controls->in_place));
+    gtk_widget_set_sensitive(controls->fourier,
+                             !(controls->args->in_place
+                               && gtk_widget_get_sensitive(controls->in_place)));
+    calibrate_update_scales(controls);
+}
+
+static void
+resonant_toggled(ThresholdControls *controls)
+{
+    controls->args->resonant = gtk_toggle_button_get_active(
+                                GTK_TOGGLE_BUTTON(controls->resonant));
+    resonance_fit(controls);
+    calibrate_update_scales(controls);
+}
+
+/*
+ *  The sweep is followed through the selected peak reaching furthest
+ *  along x, which has the finest period in the row spectra.  The fit
+ *  depends on nothing else, so it is kept until that peak moves or the
+ *  image changes.
+ */
+static void
+resonance_fit(ThresholdControls *controls)
+{
+    ThresholdArgs *args = controls->args;
+    GArray *peaks = controls->peaks;
+    HcpResonance *resonance = &args->resonance;
+    gdouble xfreq = 0.0;
+    gchar *s;
+    guint i;
+    if (!args->resonant || !gtk_widget_get_sensitive(controls->resonant))
+    {
+        memset(resonance, 0, sizeof(HcpResonance));
+        controls->resonance_xfreq = 0.0;
+        gtk_label_set_text(GTK_LABEL(controls->resonance_result), "");
+        return;
+    }
+    for (i = 0; i < peaks->len; i++)
+        xfreq = MAX(xfreq, fabs(g_array_index(peaks, HcpLatticePeak, i).x));
+    if (xfreq > 0.0 && xfreq == controls->resonance_xfreq)
+        return;
+    memset(resonance, 0, sizeof(HcpResonance));
+    controls->resonance_xfreq = xfreq;
+    if (!(xfreq > 0.0))
+    {
+        gtk_label_set_text(GTK_LABEL(controls->resonance_result),
+                           _("Select a peak to fit the sweep."));
+        return;
+    }
+    if (!hcp_field_resonance_fit(controls->ofield, xfreq, resonance))
+    {
+        memset(resonance, 0, sizeof(HcpResonance));
+        gtk_label_set_text(GTK_LABEL(controls->resonance_result),
+                           _("The sweep could not be fitted."));
+        return;
+    }
+    s = g_strdup_printf(_("Sweep: span %.1f°, center %.1f°, "
+                          "misfit %.2f%% over %d bands"),
+                        resonance->span*180.0/G_PI,
+                        resonance->center*180.0/G_PI,
+                        100.0*resonance->residual, resonance->nbands);
+    gtk_label_set_text(GTK_LABEL(controls->resonance_result), s);
+    g_free(s);
+}
+
+static void
+all_channels_toggled(ThresholdControls *controls)
+{
+    gboolean sensitive;
+    controls->args->all_channels = gtk_toggle_button_get_active(
+                                GTK_TOGGLE_BUTTON(controls->all_channels));
+    sensitive = (controls->args->all_channels
+                 && gtk_widget_get_sensitive(controls->all_channels));
+    gtk_widget_set_sensitive(controls->write_files, sensitive);
+    gtk_widget_set_sensitive(controls->output_dir, sensitive);
+}
+
+static void
+write_files_toggled(ThresholdControls *controls)
+{
+    controls->args->write_files = gtk_toggle_button_get_active(
+                                GTK_TOGGLE_BUTTON(controls->write_files));
+}
+
+static void
+output_dir_changed(ThresholdControls *controls)
+{
+    gchar *dir = gtk_file_chooser_get_filename(
+                                GTK_FILE_CHOOSER(controls->output_dir));
+    if (dir)
+        gwy_container_set_string_by_name(gwy_app_settings_get(),
+                                         output_dir_key, (const guchar*)dir);
+}
+
+static const gchar*
+output_dir_get(void)
+{
+    const guchar *dir = NULL;
+    gwy_container_gis_string_by_name(gwy_app_settings_get(), output_dir_key,
+                                     &dir);
+    return (const gchar*)dir;
+}
+
+/*
+ *  The channels of file.ext go to dir/file-<id>.gsf.  Unsaved data have
+ *  no name to tell them apart, so the start of the provenance stands in
+ *  for it; a file of that name can then only hold the same result.
+ */
+static gchar*
+series_output_name(GwyContainer *data, const gchar *dir, gint id,
+                   const gchar *provenance)
+{
+    const gchar *source = gwy_file_get_filename_sys(data);
+    gchar *base, *dot, *name, *filename;
+    if (source)
+    {
+        base = g_path_get_basename(source);
+        if ((dot = strrchr(base, '.')) && dot != base)
+            *dot = '\0';
+    }
+    else
+        base = g_strdup_printf("calibrated-%.12s", provenance);
+    name = g_strdup_printf("%s-%d.gsf", base, id);
+    filename = g_build_filename(dir, name, NULL);
+    g_free(name);
+    g_free(base);
+    return filename;
+}
+
+/* Whether a GSF file was written from the same data and parameters. */
+static gboolean
+gsf_has_provenance(const gchar *filename, const gchar *provenance)
+{
+    gchar line[256], *expected;
+    gboolean found = FALSE;
+    FILE *fh;
+    if (!(fh = g_fopen(filename, "rb")))
+        return FALSE;
+    expected = g_strdup_printf("Provenance = %s\n", provenance);
+    while (!found && fgets(line, sizeof(line), fh) && line[0])
+        found = !strcmp(line, expected);
+    g_free(expected);
+    fclose(fh);
+    return found;
+}
+
+static gpointer
+series_thread(gpointer user_data)
+{
+    SeriesJob *job = (SeriesJob*)user_data;
+    hcp_batch_calibrate(job->items, job->nitems, job->seeds, job->nseeds,
+                        job->radius, job->lattice, job->interp,
+                        &job->progress);
+    g_atomic_int_set(&job->finished, 1);
+    return NULL;
+}
+
+/*
+ *  Calibrates the other channels of the file, e.g. repeated scans, each
+ *  with its own fit started from the peaks just chosen (as saved in the
+ *  settings).  The batch runs in a thread so that the wait dialog stays
+ *  live and can cancel it; finished images are added as they come, so an
+ *  interrupted run keeps them.  Channels that are calibration outputs or
+ *  whose provenance matches an existing output are skipped, which makes
+ *  repeating a run on a grown file only do the new channels.  With Write
+ *  to files the results are streamed to GSF files in the chosen folder
+ *  instead, skipping those whose file already has the same provenance.
+ *  The output of id itself is never taken as part of the series.  The
+ *  search radius is in spectrum pixels.
+ */
+static void
+calibrate_series_do(GwyContainer *data, gint id, gint output,
+                    const ThresholdArgs *args, gint radius)
+{
+    SeriesJob job;
+    ThresholdArgs seriesargs = *args;
+    GThread *thread;
+    const guchar *str;
+    const gchar *outdir = NULL, **metas;
+    gchar *digests;
+    gdouble xy[2*MAX_PEAKS], params[HCP_PROVENANCE_NSETTINGS + 2*MAX_PEAKS];
+    gint *ids, *itemids, i, n = 0, nparams;
+    gboolean *added, finished = FALSE;
+    if (!gwy_container_gis_string_by_name(gwy_app_settings_get(),
+                                          "/module/calibrate_hcp/peaks", &str))
+        return;
+    memset(&job, 0, sizeof(SeriesJob));
+    job.nseeds = peaks_parse((const gchar*)str, xy, MAX_PEAKS);
+    if (job.nseeds < 2)
+        return;
+    job.seeds = g_new0(HcpLatticePeak, job.nseeds);
+    for (i = 0; i < job.nseeds; i++)
+    {
+        job.seeds[i].x = xy[2*i];
+        job.seeds[i].y = xy[2*i + 1];
+    }
+    job.interp = calibrate_interp(args);
+    /* The series neither scales Z nor linearises the sweep. */
+    seriesargs.zcal = FALSE;
+    seriesargs.resonant = FALSE;
+    nparams = provenance_params(&seriesargs, radius, params);
+    ids = gwy_app_data_browser_get_data_ids(data);
+    while (ids[n] != -1)
+        n++;
+    job.items = g_new0(HcpBatchItem, n);
+    itemids = g_new(gint, n);
+    digests = g_new(gchar, n*HCP_PROVENANCE_LENGTH);
+    metas = g_new0(const gchar*, 5*n);
+    if (args->write_files && !args->in_place)
+        outdir = output_dir_get();
+    for (i = 0; ids[i] != -1; i++)
+    {
+        GwyDataField *dfield;
+        const gchar **itemmeta = metas + 5*job.nitems;
+        const guchar *title = NULL;
+        gchar *key, *digest, *filename = NULL;
+        if (ids[i] == id || ids[i] == output
+            || channel_is_output(data, ids[i]))
+            continue;
+        dfield = gwy_container_get_object(data, gwy_app_get_data_key_for_id(ids[i]));
+        digest = digests + job.nitems*HCP_PROVENANCE_LENGTH;
+        hcp_field_provenance(dfield, params, nparams, digest);
+        if (outdir)
+        {
+            filename = series_output_name(data, outdir, ids[i], digest);
+            if (gsf_has_provenance(filename, digest))
+            {
+                g_free(filename);
+                continue;
+            }
+            key = g_strdup_printf("/%i/data/title", ids[i]);
+            if (gwy_container_gis_string_by_name(data, key, &title))
+            {
+                *(itemmeta++) = "Title";
+                *(itemmeta++) = (const gchar*)title;
+            }
+            g_free(key);
+            itemmeta[0] = "Provenance";
+            itemmeta[1] = digest;
+            job.items[job.nitems].filename = filename;
+            job.items[job.nitems].meta = metas + 5*job.nitems;
+        }
+        else if (provenance_exists(data, digest))
+            continue;
+        job.items[job.nitems].fit_only = args->in_place;
+        itemids[job.nitems] = ids[i];
+        job.items[job.nitems++].field = dfield;
+    }
+    g_free(ids);
+    job.radius = radius;
+    job.lattice = args->lattice;
+    added = g_new0(gboolean, MAX(job.nitems, 1));
+    if (job.nitems)
+    {
+        gwy_app_wait_start(gwy_app_find_window_for_channel(data, id),
+                           _("Calibrating channels..."));
+        thread = g_thread_new("calibrate_hcp", series_thread, &job);
+        while (!finished)
+        {
+            finished = g_atomic_int_get(&job.finished);
+            for (i = 0; i < job.nitems; i++)
+            {
+                ThresholdArgs itemargs = *args;
+                HcpBatchItem *item = job.items + i;
+                GwyDataField *result = g_atomic_pointer_get(&item->result);
+                gboolean fitted = g_atomic_int_get(&item->fitted);
+                if (added[i] || !(result || (item->fit_only && fitted)))
+                    continue;
+                itemargs.Xscale = item->factors.Xscale;
+                itemargs.Yscale = item->factors.Yscale;
+                itemargs.zcal = FALSE;
+                if (item->fit_only)
+                    calibrate_in_place(data, item->field, itemids[i],
+                                       &itemargs,
+                                       digests + i*HCP_PROVENANCE_LENGTH);
+                else
+                    calibrate_create_output(data, result, itemids[i],
+                                            &itemargs,
+                                            digests + i*HCP_PROVENANCE_LENGTH);
+                added[i] = TRUE;
+            }
+            if (!gwy_app_wait_set_fraction(
+                                hcp_progress_get_fraction(&job.progress)))
+                hcp_progress_cancel(&job.progress);
+            if (!finished)
+                g_usleep(20000);
+        }
+        g_thread_join(thread);
+        gwy_app_wait_finish();
+    }
+    for (i = 0; i < job.nitems; i++)
+        g_free((gchar*)job.items[i].filename);
+    g_free(metas);
+    g_free(added);
+    g_free(digests);
+    g_free(itemids);
+    g_free(job.items);
+    g_free(job.seeds);
 }
@@ -0,0 +1,4059 @@
+/*
+ *  @(#) $Id: calibrate_hcp_core.c 2014-05-08 $
+ *  Copyright (C) 2014 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libprocess/stats.h>
+#include <libprocess/inttrans.h>
+#include <libprocess/datafield.h>
+#include <libprocess/brick.h>
+#include <libprocess/surface.h>
+#include <libgwyddion/gwymath.h>
+#include "calibrate_hcp_core.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef HAVE_FFTW3
+#include <fftw3.h>
+#endif
+
+/* Do not bother starting threads for loops over fewer items. */
+#define HCP_PARALLEL_MIN 4096
+
+/* Spectra below these are not worth refining peaks in. */
+#define HCP_QUALITY_MIN_PTB 4.0
+#define HCP_QUALITY_MIN_SIXFOLD 0.25
+#define HCP_QUALITY_ANGLES 72
+/* Radial bins of an unpadded spectrum taken by the window main lobe and
+ * the low frequency background; padding widens them proportionally. */
+#define HCP_QUALITY_EXCLUDE 4
+
+/* Levels of a brick transformed before their spectra are summed. */
+#define HCP_BRICK_BATCH 16
+
+/* Half width of the Gaussian gridding kernel, in points of the twice
+ * oversampled grid.  This keeps the relative error around 1e-6. */
+#define HCP_NUFFT_SPREAD 6
+
+/* Line spectra are searched this far (relative) around the expected
+ * frequency, and their peak must stand out this much. */
+#define HCP_LINE_TOLERANCE 0.3
+#define HCP_LINE_MIN_CONTRAST 3.0
+
+/* A resonant sweep is measured in this many overlapping column bands, each
+ * a quarter of the width, and the span is first searched on a grid of this
+ * many steps over (0, pi). */
+#define HCP_RESONANCE_BANDS 16
+#define HCP_RESONANCE_STEPS 180
+
+/* Height histograms have this many bins per known step, at most
+ * HCP_STEP_MAX_BINS in total.  A terrace must hold this fraction of the
+ * pixels within a quarter step of its level.  Level separations must be
+ * within HCP_STEP_SPACING_TOL of a whole number of steps, and the step at
+ * least HCP_STEP_MIN_UNIT of the known one.  The terrace slope is taken
+ * from a grid of about HCP_STEP_SLOPE_SAMPLES pixels. */
+#define HCP_STEP_BINS 32
+#define HCP_STEP_MAX_BINS 65536
+#define HCP_STEP_SLOPE_SAMPLES 65536
+#define HCP_STEP_MIN_FRACTION 0.01
+#define HCP_STEP_SPACING_TOL 0.25
+#define HCP_STEP_MIN_UNIT 0.5
+
+/* Batch resampling is split into tasks of about this many pixels; smaller
+ * images are one task.  Peaks are refined at most this many times. */
+#define HCP_TASK_PIXELS 262144
+#define HCP_BATCH_REFINE 8
+
+/* Streamed output is resampled and written in blocks of about this many
+ * pixels, two of which are in memory at a time. */
+#define HCP_GSF_BLOCK_PIXELS 262144
+
+/* Display refreshes are summed in blocks of this many values, in block
+ * order, and each block in this many interleaved lanes. */
+#define HCP_CLAMP_BLOCK 16384
+#define HCP_CLAMP_LANES 4
+
+/* Detected peaks must stand this many standard deviations above the mean
+ * of the spectrum, and outside this fraction of its half size. */
+#define HCP_DETECT_MIN_SNR 6.0
+#define HCP_DETECT_CENTRE 0.04
+
+/* Peaks up to this factor farther out than the nearest one are taken as
+ * first ring candidates, well inside the sqrt(3) of the second ring.
+ * Basis pairs may deviate this much (radians) from 60 or 120 degrees and
+ * indices this much from integers. */
+#define HCP_INDEX_RING 1.4
+#define HCP_INDEX_ANGLE 0.45
+#define HCP_INDEX_TOLERANCE 0.2
+
+struct _HcpWorkspace {
+    gint xres;
+    gint yres;
+    gint pxres;
+    gint pyres;
+    GwyWindowingType window;
+    gdouble *xwindow;
+    gdouble *ywindow;
+    gdouble *rowsums;
+    GwyDataField *rin;
+    GwyDataField *raout;
+    GwyDataField *ipout;
+#ifdef HAVE_FFTW3
+    fftw_complex *fout;
+    fftw_plan plan;
+#endif
+};
+
+static void     workspace_ensure           (HcpWorkspace *ws,
+                                                gint xres, gint yres,
+                                                gint pxres, gint pyres,
+                                                GwyWindowingType window);
+static void     workspace_clear            (HcpWorkspace *ws);
+static void     windowed_spectrum          (HcpWorkspace *ws,
+                                                const gdouble *src,
+                                                gint rowstride,
+                                                gint xres, gint yres,
+                                                GwyWindowingType window,
+                                                GwyDataField *target);
+#ifdef HAVE_FFTW3
+static void     set_half_modulus           (const fftw_complex *out,
+                                                gint pxres, gint pyres,
+                                                GwyDataField *target);
+#else
+static void     set_dfield_modulus         (GwyDataField *re, GwyDataField *im,
+                                                GwyDataField *target);
+#endif
+static void     fft_postprocess            (GwyDataField *dfield);
+static gboolean peak_search                (const gdouble *data,
+                                                gint xres, gint yres,
+                                                gint rowstride, gint radius,
+                                                gint *col, gint *row,
+                                                gdouble *value);
+typedef gdouble (*WindowMaxFunc)(const gdouble *data, gint rowstride);
+
+/* Output row k is (1 - w)*row i0 + w*row i1 of the source. */
+typedef struct {
+    gint i0;
+    gint i1;
+    gdouble w;
+} ResampleWeight;
+
+typedef void (*ResampleRowsFunc)(const gdouble *src, gint rowstride,
+                                 gint xres, const ResampleWeight *weights,
+                                 gdouble *dst, gint newyres);
+
+static ResampleWeight* resample_weights    (gint yres, gint newyres);
+static void     resample_rows_round        (const gdouble *src,
+                                                gint rowstride, gint xres,
+                                                const ResampleWeight *weights,
+                                                gdouble *dst, gint newyres);
+static void     resample_rows_linear       (const gdouble *src,
+                                                gint rowstride, gint xres,
+                                                const ResampleWeight *weights,
+                                                gdouble *dst, gint newyres);
+static ResampleWeight* resonance_weights   (gint xres,
+                                                const HcpResonance *resonance);
+static void     resample_remap_linear      (const gdouble *src,
+                                                gint rowstride, gint xres,
+                                                const ResampleWeight *weights,
+                                                const ResampleWeight *columns,
+                                                gdouble *dst, gint newyres);
+static void     remap_columns              (const gdouble *src,
+                                                gint rowstride, gint xres,
+                                                gint yres,
+                                                const ResampleWeight *columns,
+                                                gdouble *dst);
+static gdouble  resonance_misfit           (const gdouble *u,
+                                                const gdouble *f, gint n,
+                                                gdouble span,
+                                                gdouble *a, gdouble *b);
+
+static const struct {
+    GwyInterpolationType interp;
+    ResampleRowsFunc func;
+}
+resample_kernels[] = {
+    { GWY_INTERPOLATION_ROUND,  resample_rows_round,  },
+    { GWY_INTERPOLATION_LINEAR, resample_rows_linear, },
+};
+
+static void     spectrum_quality           (const gdouble *data,
+                                                gint xres, gint yres,
+                                                gint rowstride,
+                                                gdouble dx, gdouble dy,
+                                                gint padding,
+                                                HcpQuality *quality);
+static void     radial_trend               (const gdouble *mean, gint from,
+                                                gint nbins, gdouble *trend);
+static void     line_power_sum             (const gdouble *src, gint n,
+                                                gint nlines, gint pitch,
+                                                gint stride, gdouble *power);
+static gboolean line_peak                  (const gdouble *power, gint n,
+                                                gdouble real, gdouble expected,
+                                                gdouble *freq,
+                                                gdouble *contrast);
+static gdouble  median_slope               (const gdouble *data,
+                                                gint xres, gint yres,
+                                                gint rowstride,
+                                                gboolean vertical,
+                                                gdouble step);
+static GwyDataField* brick_spectrum_target (GwyBrick *brick);
+static void     brick_copy_units           (GwyBrick *source,
+                                                GwyBrick *target);
+static void     nufft_spread               (const gdouble *u,
+                                                const gdouble *v,
+                                                const gdouble *c, guint n,
+                                                gint mr, gdouble tau,
+                                                gdouble *grid);
+static void     nufft_deconvolve           (const gdouble *re,
+                                                const gdouble *im,
+                                                gint mr, gint res, gdouble tau,
+                                                gdouble *modulus);
+static void     clamp_copy_block           (const gdouble *src, gint n,
+                                                gdouble lower, gdouble upper,
+                                                gdouble *dst,
+                                                gdouble *partial);
+static gint     compare_peaks_by_height    (gconstpointer a,
+                                                gconstpointer b);
+static gint     batch_blocks               (GwyDataField *field);
+static gboolean batch_fit                  (HcpBatchItem *item,
+                                                HcpWorkspace *ws,
+                                                const HcpLatticePeak *seeds,
+                                                gint nseeds, gint radius,
+                                                gdouble lattice);
+static gint     refine_seeds               (GwyDataField *field,
+                                                HcpWorkspace *ws,
+                                                const HcpLatticePeak *seeds,
+                                                gint nseeds, gint radius,
+                                                HcpLatticePeak *peaks);
+static gboolean joint_solve                (const gdouble *a,
+                                                const gdouble *b,
+                                                gint np,
+                                                gdouble *x,
+                                                gdouble *cov);
+static void     batch_run_item             (HcpBatchItem *item,
+                                                HcpWorkspace *ws,
+                                                const HcpLatticePeak *seeds,
+                                                gint nseeds, gint radius,
+                                                gdouble lattice,
+                                                GwyInterpolationType interp,
+                                                ResampleRowsFunc func,
+                                                HcpProgress *progress);
+static FILE*    gsf_open                   (const gchar *filename,
+                                                gint xres, gint yres,
+                                                gdouble xreal, gdouble yreal,
+                                                gdouble xoffset,
+                                                gdouble yoffset,
+                                                const gchar *const *meta);
+static gboolean gsf_write_rows             (FILE *fh,
+                                                const gdouble *src,
+                                                gint xres, gint rowstride,
+                                                const ResampleWeight *weights,
+                                                gint newyres,
+                                                ResampleRowsFunc func,
+                                                HcpProgress *progress);
+static gboolean gsf_write                  (const gchar *filename,
+                                                const gdouble *src,
+                                                gint xres, gint rowstride,
+                                                const ResampleWeight *weights,
+                                                gint newyres,
+                                                ResampleRowsFunc func,
+                                                const gdouble *geometry,
+                                                const gchar *xyunit,
+                                                const gchar *zunit,
+                                                const HcpFactors *factors,
+                                                const gchar *const *meta,
+                                                HcpProgress *progress);
+static gboolean field_write_gsf            (GwyDataField *dfield,
+                                                const HcpFactors *factors,
+                                                GwyInterpolationType interp,
+                                                const gchar *filename,
+                                                const gchar *const *meta,
+                                                HcpProgress *progress);
+static void     fourier_resize_columns     (const gdouble *re,
+                                                const gdouble *im,
+                                                gint xres, gint yres,
+                                                gint newyres,
+                                                gdouble *newre,
+                                                gdouble *newim);
+static GwyDataField* field_apply_fourier   (GwyDataField *dfield,
+                                                gint newyres);
+static GwyDataField* field_from_buffer     (const gdouble *data,
+                                                gint xres, gint yres,
+                                                gint rowstride,
+                                                gdouble xreal, gdouble yreal);
+
+static gint n_threads = 0;
+
+void
+hcp_set_n_threads(gint n)
+{
+    n_threads = MAX(n, 0);
+}
+
+/*
+ *  The thread count is taken from CALIBRATE_HCP_THREADS if it is set,
+ *  otherwise from hcp_set_n_threads(); zero leaves it to OpenMP.  The
+ *  results do not depend on it: the parallel loops only split the work,
+ *  sums in floating point are kept per row, block or level and added up
+ *  afterwards in that order, and histograms count in integers.
+ */
+gint
+hcp_get_n_threads(void)
+{
+#ifdef _OPENMP
+    const gchar *env = g_getenv("CALIBRATE_HCP_THREADS");
+    gint n = n_threads;
+    if (env && *env)
+        n = MAX(atoi(env), 0);
+    return n ? n : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+HcpWorkspace*
+hcp_workspace_new(void)
+{
+    return g_new0(HcpWorkspace, 1);
+}
+
+void
+hcp_workspace_free(HcpWorkspace *ws)
+{
+    if (!ws)
+        return;
+    workspace_clear(ws);
+    g_free(ws);
+}
+
+static void
+workspace_clear(HcpWorkspace *ws)
+{
+    g_free(ws->xwindow);
+    g_free(ws->ywindow);
+    g_free(ws->rowsums);
+    if (ws->rin)
+        g_object_unref(ws->rin);
+    if (ws->raout)
+        g_object_unref(ws->raout);
+    if (ws->ipout)
+        g_object_unref(ws->ipout);
+#ifdef HAVE_FFTW3
+    if (ws->plan)
+    {
+#ifdef _OPENMP
+#pragma omp critical (hcp_fft)
+#endif
+        fftw_destroy_plan(ws->plan);
+    }
+    fftw_free(ws->fout);
+#endif
+    memset(ws, 0, sizeof(HcpWorkspace));
+}
+
+static void
+workspace_ensure(HcpWorkspace *ws, gint xres, gint yres,
+                 gint pxres, gint pyres, GwyWindowingType window)
+{
+    gint i;
+    if (ws->xres == xres && ws->yres == yres
+        && ws->pxres == pxres && ws->pyres == pyres && ws->window == window)
+        return;
+    workspace_clear(ws);
+    ws->xres = xres;
+    ws->yres = yres;
+    ws->pxres = pxres;
+    ws->pyres = pyres;
+    ws->window = window;
+    ws->xwindow = g_new(gdouble, xres);
+    ws->ywindow = g_new(gdouble, yres);
+    ws->rowsums = g_new(gdouble, yres);
+    for (i = 0; i < xres; i++)
+        ws->xwindow[i] = 1.0;
+    for (i = 0; i < yres; i++)
+        ws->ywindow[i] = 1.0;
+    gwy_fft_window(xres, ws->xwindow, window);
+    gwy_fft_window(yres, ws->ywindow, window);
+    ws->rin = gwy_data_field_new(pxres, pyres, pxres, pyres, TRUE);
+    ws->raout = gwy_data_field_new_alike(ws->rin, FALSE);
+    ws->ipout = gwy_data_field_new_alike(ws->rin, FALSE);
+#ifdef HAVE_FFTW3
+    /* The plan is made once per workspace and size and then executed for
+     * every spectrum; FFTW_ESTIMATE leaves the zeroed input untouched. */
+    ws->fout = fftw_malloc(pyres*(pxres/2 + 1)*sizeof(fftw_complex));
+#ifdef _OPENMP
+#pragma omp critical (hcp_fft)
+#endif
+    ws->plan = fftw_plan_dft_r2c_2d(pyres, pxres,
+                                    gwy_data_field_get_data(ws->rin),
+                                    ws->fout, FFTW_ESTIMATE);
+#endif
+}
+
+/*
+ *  Same as gwy_data_field_2dfft() with mean levelling and windowing,
+ *  except the window tables and the transform, including its FFTW plan
+ *  when the module is built against FFTW, come from the workspace
+ *  instead of being set up anew for each spectrum.  The xres
+ *  x yres rows are read through rowstride so that src can be a part of
+ *  a larger image.  If target is larger than that, the data are padded
+ *  with zeros.
+ */
+static void
+windowed_spectrum(HcpWorkspace *ws, const gdouble *src, gint rowstride,
+                  gint xres, gint yres, GwyWindowingType window,
+                  GwyDataField *target)
+{
+    gdouble *dst, *rowsums;
+    gdouble avg = 0.0;
+    gint pxres, pyres, i, j;
+    pxres = gwy_data_field_get_xres(target);
+    pyres = gwy_data_field_get_yres(target);
+    workspace_ensure(ws, xres, yres, pxres, pyres, window);
+    rowsums = ws->rowsums;
+#ifdef _OPENMP
+#pragma omp parallel for private(i, j) num_threads(hcp_get_n_threads()) \
+            if (xres*yres > HCP_PARALLEL_MIN)
+#endif
+    for (i = 0; i < yres; i++)
+    {
+        gdouble s = 0.0;
+        for (j = 0; j < xres; j++)
+            s += src[i*rowstride + j];
+        rowsums[i] = s;
+    }
+    for (i = 0; i < yres; i++)
+        avg += rowsums[i];
+    avg /= xres*yres;
+    /* The padding is zero from the workspace setup and never written. */
+    dst = gwy_data_field_get_data(ws->rin);
+#ifdef _OPENMP
+#pragma omp parallel for private(i, j) num_threads(hcp_get_n_threads()) \
+            if (xres*yres > HCP_PARALLEL_MIN)
+#endif
+    for (i = 0; i < yres; i++)
+    {
+        for (j = 0; j < xres; j++)
+            dst[i*pxres + j] = (src[i*rowstride + j] - avg)
+                               * ws->xwindow[j] * ws->ywindow[i];
+    }
+    gwy_data_field_invalidate(ws->rin);
+#ifdef HAVE_FFTW3
+    /* Executing a plan is thread-safe, only making one is not. */
+    fftw_execute(ws->plan);
+    set_half_modulus(ws->fout, pxres, pyres, target);
+#else
+    /* FFTW planning is not reentrant; spectra of several images may be
+     * computed in parallel. */
+#ifdef _OPENMP
+#pragma omp critical (hcp_fft)
+#endif
+    gwy_data_field_2dfft_raw(ws->rin, NULL, ws->raout, ws->ipout,
+                             GWY_TRANSFORM_DIRECTION_FORWARD);
+    set_dfield_modulus(ws->raout, ws->ipout, target);
+#endif
+    gwy_data_field_invalidate(target);
+    fft_postprocess(target);
+}
+
+void
+hcp_field_spectrum(GwyDataField *dfield, HcpWorkspace *ws)
+{
+    HcpWorkspace *tmp = NULL;
+    if (!ws)
+        ws = tmp = hcp_workspace_new();
+    windowed_spectrum(ws, gwy_data_field_get_data_const(dfield),
+                      gwy_data_field_get_xres(dfield),
+                      gwy_data_field_get_xres(dfield),
+                      gwy_data_field_get_yres(dfield),
+                      GWY_WINDOWING_HANN, dfield);
+    hcp_workspace_free(tmp);
+}
+
+#ifdef HAVE_FFTW3
+/*
+ *  Fills target with the modulus of a real-to-complex transform, using
+ *  the Hermitian symmetry for the columns FFTW does not store, and with
+ *  the same 1/sqrt(N) normalisation as gwy_data_field_2dfft_raw().
+ */
+static void
+set_half_modulus(const fftw_complex *out, gint pxres, gint pyres,
+                 GwyDataField *target)
+{
+    gdouble *data;
+    gdouble q;
+    gint hxres, i, j;
+    hxres = pxres/2 + 1;
+    q = 1.0/sqrt(pxres*pyres);
+    data = gwy_data_field_get_data(target);
+#ifdef _OPENMP
+#pragma omp parallel for private(i, j) num_threads(hcp_get_n_threads()) \
+            if (pxres*pyres > HCP_PARALLEL_MIN)
+#endif
+    for (i = 0; i < pyres; i++)
+    {
+        gint ci = (pyres - i) % pyres;
+        for (j = 0; j < pxres; j++)
+        {
+            const gdouble *c = (j < hxres ? out[i*hxres + j]
+                                : out[ci*hxres + pxres - j]);
+            data[i*pxres + j] = q*hypot(c[0], c[1]);
+        }
+    }
+}
+#else
+static void
+set_dfield_modulus(GwyDataField *re, GwyDataField *im, GwyDataField *target)
+{
+    const gdouble *datare, *dataim;
+    gdouble *data;
+    gint n, i;
+    n = gwy_data_field_get_xres(re)*gwy_data_field_get_yres(re);
+    datare = gwy_data_field_get_data_const(re);
+    dataim = gwy_data_field_get_data_const(im);
+    data = gwy_data_field_get_data(target);
+#ifdef _OPENMP
+#pragma omp parallel for private(i) num_threads(hcp_get_n_threads()) \
+            if (n > HCP_PARALLEL_MIN)
+#endif
+    for (i = 0; i < n; i++)
+        data[i] = hypot(datare[i], dataim[i]);
+}
+#endif
+
+static void
+fft_postprocess(GwyDataField *dfield)
+{
+    gint res;
+    gdouble r;
+    gwy_data_field_2dfft_humanize(dfield);
+    GwySIUnit *xyunit;
+    xyunit = gwy_data_field_get_si_unit_xy(dfield);
+    gwy_si_unit_power(xyunit, -1, xyunit);
+    gwy_data_field_set_xreal(dfield, 1.0/gwy_data_field_get_xmeasure(dfield));
+    gwy_data_field_set_yreal(dfield, 1.0/gwy_data_field_get_ymeasure(dfield));
+    res = gwy_data_field_get_xres(dfield);
+    r = res / 2.0;
+    gwy_data_field_set_xoffset(dfield, -gwy_data_field_jtor(dfield, r));
+    res = gwy_data_field_get_yres(dfield);
+    r = res / 2.0;
+    gwy_data_field_set_yoffset(dfield, -gwy_data_field_itor(dfield, r));
+    gdouble dmin, dmax;
+    gwy_data_field_get_min_max(dfield, &dmin, &dmax);
+    gwy_data_field_add(dfield, -dmin);
+}
+
+/*
+ *  Maximum of a w x h window.  Called with constant sizes from the
+ *  kernels below, so that the compiler can unroll and vectorise the rows.
+ */
+static inline gdouble
+window_max(const gdouble *data, gint rowstride, gint w, gint h)
+{
+    gdouble m = data[0];
+    gint i, j;
+    for (j = 0; j < h; j++)
+    {
+        const gdouble *d = data + j*rowstride;
+        for (i = 0; i < w; i++)
+            m = (d[i] > m) ? d[i] : m;
+    }
+    return m;
+}
+
+#define WINDOW_MAX_KERNEL(r) \
+    static gdouble \
+    window_max_##r(const gdouble *data, gint rowstride) \
+    { \
+        return window_max(data, rowstride, 2*(r), 2*(r)); \
+    }
+
+WINDOW_MAX_KERNEL(1)
+WINDOW_MAX_KERNEL(2)
+WINDOW_MAX_KERNEL(3)
+WINDOW_MAX_KERNEL(4)
+WINDOW_MAX_KERNEL(5)
+
+/* Indexed by the search radius, for windows entirely inside the data. */
+static const WindowMaxFunc window_max_kernels[] = {
+    NULL, window_max_1, window_max_2, window_max_3, window_max_4, window_max_5,
+};
+
+static gboolean
+peak_search(const gdouble *data, gint xres, gint yres, gint rowstride,
+            gint radius, gint *col, gint *row, gdouble *value)
+{
+    gint i, j, low_i, high_i, low_j, high_j;
+    gdouble centre, m;
+    const gdouble *origin;
+    centre = data[*row*rowstride + *col];
+    *value = centre;
+    low_i = MAX(*col - radius, 0);
+    high_i = MIN(*col + radius, xres);
+    low_j = MAX(*row - radius, 0);
+    high_j = MIN(*row + radius, yres);
+    if (low_i >= high_i || low_j >= high_j)
+        return FALSE;
+    origin = data + low_j*rowstride + low_i;
+    if (radius < (gint)G_N_ELEMENTS(window_max_kernels)
+        && high_i - low_i == 2*radius && high_j - low_j == 2*radius)
+        m = window_max_kernels[radius](origin, rowstride);
+    else
+        m = window_max(origin, rowstride, high_i - low_i, high_j - low_j);
+    if (!(m > centre))
+        return FALSE;
+    /* Pick the same pixel as a column by column scan keeping the first
+     * maximum would. */
+    for (i = low_i; i < high_i; i++)
+    {
+        for (j = low_j; j < high_j; j++)
+        {
+            if (data[j*rowstride + i] == m)
+            {
+                *col = i;
+                *row = j;
+                *value = m;
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/*
+ *  Moves (col, row) to the maximum of the spectrum within the search
+ *  radius.  Returns TRUE if the peak is somewhere else than the
+ *  starting pixel.
+ */
+gboolean
+hcp_field_peak_find(GwyDataField *spectrum, gint radius,
+                    gint *col, gint *row, gdouble *value)
+{
+    gint xres = gwy_data_field_get_xres(spectrum);
+    return peak_search(gwy_data_field_get_data_const(spectrum),
+                       xres, gwy_data_field_get_yres(spectrum), xres,
+                       radius, col, row, value);
+}
+
+/*
+ *  Solves for the X and Y correction which puts both peaks on the first
+ *  ring of a hexagonal lattice with the given lattice constant.
+ */
+void
+hcp_get_factors(const HcpPeak *p1, const HcpPeak *p2,
+                gdouble lattice, HcpFactors *factors)
+{
+    gdouble x1, x2, y1, y2, R, xcorr, ycorr;
+    gdouble x1_2, x2_2, y1_2, y2_2;
+    x1 = p1->x;
+    y1 = p1->y;
+    x2 = p2->x;
+    y2 = p2->y;
+    R = 2 / (sqrt(3) * lattice);
+    x1_2 = x1 * x1;
+    y1_2 = y1 * y1;
+    x2_2 = x2 * x2;
+    y2_2 = y2 * y2;
+    ycorr = R * sqrt((x1_2 - x2_2) / (x1_2 * y2_2 - x2_2 * y1_2));
+    xcorr = sqrt((R * R - (ycorr * ycorr * y1_2)) / x1_2);
+    factors->Xscale = 1 / xcorr;
+    factors->Yscale = 1 / ycorr;
+    factors->Xwarning = FALSE;
+    factors->Ywarning = FALSE;
+    if (x1_2 == x2_2)
+        factors->Xwarning = TRUE;
+    if (y1_2 == y2_2)
+        factors->Ywarning = TRUE;
+    if (x1_2 == 0)
+        factors->Xwarning = TRUE;
+    if (factors->Xscale != factors->Xscale)
+        factors->Xwarning = TRUE;
+    if (factors->Yscale != factors->Yscale)
+        factors->Ywarning = TRUE;
+    if (x1_2 * y2_2 == x2_2 * y1_2)
+    {
+        factors->Xwarning = TRUE;
+        factors->Ywarning = TRUE;
+    }
+}
+
+/*
+ *  Real space lattice of two reciprocal vectors q = (x1, y1, x2, y2):
+ *  out = (mean length, orientation of a1, shear, |a1|, |a2|).  The shear
+ *  is the deviation of the angle between a1 and a2 from the nearer of
+ *  60 and 120 degrees.
+ */
+static gboolean
+lattice_from_peaks(const gdouble *q, gdouble *out)
+{
+    gdouble det = q[0]*q[3] - q[1]*q[2];
+    gdouble a1x, a1y, a2x, a2y, l1, l2, gamma;
+    if (!(fabs(det) > 0.0))
+        return FALSE;
+    a1x = q[3]/det;
+    a1y = -q[2]/det;
+    a2x = -q[1]/det;
+    a2y = q[0]/det;
+    l1 = hypot(a1x, a1y);
+    l2 = hypot(a2x, a2y);
+    gamma = acos(CLAMP((a1x*a2x + a1y*a2y)/(l1*l2), -1.0, 1.0));
+    out[0] = sqrt(l1*l2);
+    out[1] = atan2(a1y, a1x);
+    out[2] = gamma - ((gamma < G_PI/2.0) ? G_PI/3.0 : 2.0*G_PI/3.0);
+    out[3] = l1;
+    out[4] = l2;
+    return TRUE;
+}
+
+/*
+ *  The reverse of hcp_get_factors(): with the factors known, measures
+ *  the lattice from two first ring peaks.  Peak positions are taken as
+ *  uncertain by a uniformly distributed fraction of the spectrum pixel
+ *  (dx, dy), which is propagated to the results through the numerical
+ *  Jacobian.
+ */
+gboolean
+hcp_measure_lattice(const HcpPeak *p1, const HcpPeak *p2,
+                    const HcpFactors *factors, gdouble dx, gdouble dy,
+                    HcpLattice *lattice)
+{
+    gdouble q[4], sigma[4], out[5], plus[5], minus[5], var[3] = { 0, 0, 0 };
+    gint i, k;
+    g_return_val_if_fail(p1 && p2 && factors && lattice, FALSE);
+    g_return_val_if_fail(factors->Xscale > 0.0 && factors->Yscale > 0.0,
+                         FALSE);
+    memset(lattice, 0, sizeof(HcpLattice));
+    q[0] = p1->x/factors->Xscale;
+    q[1] = p1->y/factors->Yscale;
+    q[2] = p2->x/factors->Xscale;
+    q[3] = p2->y/factors->Yscale;
+    sigma[0] = sigma[2] = dx/factors->Xscale/sqrt(12.0);
+    sigma[1] = sigma[3] = dy/factors->Yscale/sqrt(12.0);
+    if (!lattice_from_peaks(q, out))
+        return FALSE;
+    for (i = 0; i < 4; i++)
+    {
+        gdouble qq[4], h = 1e-6*hypot(q[2*(i/2)], q[2*(i/2) + 1]);
+        memcpy(qq, q, sizeof(qq));
+        qq[i] = q[i] + h;
+        if (!lattice_from_peaks(qq, plus))
+            return FALSE;
+        qq[i] = q[i] - h;
+        if (!lattice_from_peaks(qq, minus))
+            return FALSE;
+        for (k = 0; k < 3; k++)
+        {
+            gdouble d = plus[k] - minus[k];
+            if (k == 1)
+                d = remainder(d, 2.0*G_PI);
+            d *= sigma[i]/(2.0*h);
+            var[k] += d*d;
+        }
+    }
+    lattice->lattice = out[0];
+    lattice->angle = out[1];
+    lattice->shear = out[2];
+    lattice->a1 = out[3];
+    lattice->a2 = out[4];
+    lattice->lattice_err = sqrt(var[0]);
+    lattice->angle_err = sqrt(var[1]);
+    lattice->shear_err = sqrt(var[2]);
+    return TRUE;
+}
+
+/*
+ *  One block of hcp_clamp_copy().  The lanes have no dependencies between
+ *  them, so the compiler can keep them in vector registers.  Sums are of
+ *  the differences from the first value, which keeps the variance from
+ *  cancelling.  partial = (mean, sum of squared deviations, min, max).
+ */
+static void
+clamp_copy_block(const gdouble *src, gint n, gdouble lower, gdouble upper,
+                 gdouble *dst, gdouble *partial)
+{
+    gdouble s[HCP_CLAMP_LANES], s2[HCP_CLAMP_LANES];
+    gdouble lo[HCP_CLAMP_LANES], hi[HCP_CLAMP_LANES];
+    gdouble shift = src[0];
+    gint i, l, m = n - n % HCP_CLAMP_LANES;
+    for (l = 0; l < HCP_CLAMP_LANES; l++)
+    {
+        s[l] = s2[l] = 0.0;
+        lo[l] = G_MAXDOUBLE;
+        hi[l] = -G_MAXDOUBLE;
+    }
+    for (i = 0; i < m; i += HCP_CLAMP_LANES)
+    {
+        for (l = 0; l < HCP_CLAMP_LANES; l++)
+        {
+            gdouble v = src[i + l], d = v - shift;
+            v = (v < lower) ? lower : v;
+            v = (v > upper) ? upper : v;
+            dst[i + l] = v;
+            s[l] += d;
+            s2[l] += d*d;
+            lo[l] = (v < lo[l]) ? v : lo[l];
+            hi[l] = (v > hi[l]) ? v : hi[l];
+        }
+    }
+    for (i = m; i < n; i++)
+    {
+        gdouble v = src[i], d = v - shift;
+        v = CLAMP(v, lower, upper);
+        dst[i] = v;
+        s[0] += d;
+        s2[0] += d*d;
+        lo[0] = MIN(v, lo[0]);
+        hi[0] = MAX(v, hi[0]);
+    }
+    s[0] = (s[0] + s[1]) + (s[2] + s[3]);
+    s2[0] = (s2[0] + s2[1]) + (s2[2] + s2[3]);
+    partial[0] = shift + s[0]/n;
+    partial[1] = MAX(s2[0] - s[0]*s[0]/n, 0.0);
+    partial[2] = MIN(MIN(lo[0], lo[1]), MIN(lo[2], lo[3]));
+    partial[3] = MAX(MAX(hi[0], hi[1]), MAX(hi[2], hi[3]));
+}
+
+/*
+ *  Copies n values clamped to [lower, upper] and gathers the mean and rms
+ *  of the source and the range of the result in the same pass.  Meant for
+ *  display refreshes, which otherwise copy, clamp and scan separately.
+ */
+void
+hcp_clamp_copy(const gdouble *src, gint n, gdouble lower, gdouble upper,
+               gdouble *dst, HcpRangeStats *stats)
+{
+    gint nblocks = (n + HCP_CLAMP_BLOCK - 1)/HCP_CLAMP_BLOCK, b;
+    gdouble *partial, mean = 0.0, m2 = 0.0;
+    g_return_if_fail(src && dst && stats);
+    memset(stats, 0, sizeof(HcpRangeStats));
+    if (n <= 0)
+        return;
+    partial = g_new(gdouble, 4*nblocks);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(hcp_get_n_threads()) \
+            if (n > HCP_PARALLEL_MIN) schedule(static)
+#endif
+    for (b = 0; b < nblocks; b++)
+    {
+        gint from = b*HCP_CLAMP_BLOCK;
+        clamp_copy_block(src + from, MIN(HCP_CLAMP_BLOCK, n - from),
+                         lower, upper, dst + from, partial + 4*b);
+    }
+    stats->min = partial[2];
+    stats->max = partial[3];
+    for (b = 0; b < nblocks; b++)
+    {
+        gint done = b*HCP_CLAMP_BLOCK, nb = MIN(HCP_CLAMP_BLOCK, n - done);
+        gdouble delta = partial[4*b] - mean;
+        mean += delta*nb/(done + nb);
+        m2 += partial[4*b + 1] + delta*delta*done*nb/(done + nb);
+        stats->min = MIN(stats->min, partial[4*b + 2]);
+        stats->max = MAX(stats->max, partial[4*b + 3]);
+    }
+    g_free(partial);
+    stats->avg = mean;
+    stats->rms = sqrt(m2/n);
+}
+
+static gint
+compare_peaks_by_height(gconstpointer a, gconstpointer b)
+{
+    gdouble za = ((const HcpLatticePeak*)a)->z;
+    gdouble zb = ((const HcpLatticePeak*)b)->z;
+    if (za > zb)
+        return -1;
+    return (za < zb) ? 1 : 0;
+}
+
+/*
+ *  Local maxima of the spectrum within the search radius, strongest
+ *  first.  The modulus is centrosymmetric, so only the peaks with
+ *  negative y (and those on the positive x axis) are reported.  Returns
+ *  the number of peaks stored, at most maxpeaks.
+ */
+gint
+hcp_field_detect_peaks(GwyDataField *spectrum, gint radius, gint maxpeaks,
+                       HcpLatticePeak *peaks)
+{
+    gint xres, yres, i, j, n = 0, nalloc = 64;
+    gdouble avg, rms, threshold, dx, dy, xoff, yoff, centre;
+    const gdouble *data;
+    HcpLatticePeak *found;
+    g_return_val_if_fail(GWY_IS_DATA_FIELD(spectrum), 0);
+    g_return_val_if_fail(peaks || !maxpeaks, 0);
+    xres = gwy_data_field_get_xres(spectrum);
+    yres = gwy_data_field_get_yres(spectrum);
+    data = gwy_data_field_get_data_const(spectrum);
+    dx = gwy_data_field_get_xmeasure(spectrum);
+    dy = gwy_data_field_get_ymeasure(spectrum);
+    xoff = gwy_data_field_get_xoffset(spectrum);
+    yoff = gwy_data_field_get_yoffset(spectrum);
+    avg = gwy_data_field_get_avg(spectrum);
+    rms = gwy_data_field_get_rms(spectrum);
+    if (!(rms > 0.0) || maxpeaks <= 0)
+        return 0;
+    radius = MAX(radius, 1);
+    threshold = avg + HCP_DETECT_MIN_SNR*rms;
+    centre = HCP_DETECT_CENTRE*0.5*MIN(xres*dx, yres*dy);
+    found = g_new(HcpLatticePeak, nalloc);
+    for (i = 0; i < yres; i++)
+    {
+        gdouble y = gwy_data_field_itor(spectrum, i) + yoff;
+        if (y > 0.5*dy)
+            break;
+        for (j = 0; j < xres; j++)
+        {
+            gdouble x = gwy_data_field_jtor(spectrum, j) + xoff;
+            gdouble v = data[i*xres + j];
+            gint col = j, row = i;
+            if (v < threshold
+                || (fabs(y) <= 0.5*dy && x <= 0.0)
+                || hypot(x, y) < centre)
+                continue;
+            if (peak_search(data, xres, yres, xres, radius, &col, &row, &v))
+                continue;
+            if (n == nalloc)
+            {
+                nalloc *= 2;
+                found = g_renew(HcpLatticePeak, found, nalloc);
+            }
+            found[n].x = x;
+            found[n].y = y;
+            found[n].z = v;
+            found[n].h = found[n].k = 0;
+            found[n].snr = (v - avg)/rms;
+            found[n].residual = NAN;
+            n++;
+        }
+    }
+    qsort(found, n, sizeof(HcpLatticePeak), compare_peaks_by_height);
+    n = MIN(n, maxpeaks);
+    memcpy(peaks, found, n*sizeof(HcpLatticePeak));
+    g_free(found);
+    return n;
+}
+
+/*
+ *  Assigns Miller indices (h, k) to the peaks in the basis of two first
+ *  ring peaks 60 degrees apart.  The strongest peak of the innermost ring
+ *  is the first basis vector and its nearest neighbour on the ring the
+ *  second.  The scanner distortion is linear, so the indices do not
+ *  depend on it.  Two peaks are always taken as first ring neighbours, as
+ *  the user selected them.  Peaks off the lattice get (0, 0).  Returns the
+ *  number of indexed peaks.
+ */
+gint
+hcp_index_peaks(HcpLatticePeak *peaks, gint npeaks)
+{
+    gdouble rmin = G_MAXDOUBLE, best = G_MAXDOUBLE, e1x, e1y, e2x, e2y, det;
+    gint i, b1 = -1, b2 = -1, nindexed = 0;
+    gboolean obtuse = FALSE;
+    for (i = 0; i < npeaks; i++)
+    {
+        gdouble r = hypot(peaks[i].x, peaks[i].y);
+        peaks[i].h = peaks[i].k = 0;
+        if (r > 0.0)
+            rmin = MIN(rmin, r);
+    }
+    if (npeaks < 2)
+        return 0;
+    for (i = 0; i < npeaks; i++)
+    {
+        gdouble r = hypot(peaks[i].x, peaks[i].y);
+        if (!(r > 0.0) || (npeaks > 2 && r > HCP_INDEX_RING*rmin))
+            continue;
+        if (b1 < 0 || peaks[i].z > peaks[b1].z)
+            b1 = i;
+    }
+    if (b1 < 0)
+        return 0;
+    for (i = 0; i < npeaks; i++)
+    {
+        gdouble r = hypot(peaks[i].x, peaks[i].y), gamma, d;
+        if (i == b1 || !(r > 0.0) || (npeaks > 2 && r > HCP_INDEX_RING*rmin))
+            continue;
+        gamma = acos(CLAMP((peaks[i].x*peaks[b1].x + peaks[i].y*peaks[b1].y)
+                           /(r*hypot(peaks[b1].x, peaks[b1].y)), -1.0, 1.0));
+        d = MIN(fabs(gamma - G_PI/3.0), fabs(gamma - 2.0*G_PI/3.0));
+        if (npeaks > 2 && d > HCP_INDEX_ANGLE)
+            continue;
+        if (d < best)
+        {
+            best = d;
+            b2 = i;
+            obtuse = (gamma > G_PI/2.0);
+        }
+    }
+    if (b2 < 0)
+        return 0;
+    e1x = peaks[b1].x;
+    e1y = peaks[b1].y;
+    e2x = peaks[b2].x;
+    e2y = peaks[b2].y;
+    /* Keep the basis at 60 degrees, the norm below relies on it. */
+    if (obtuse)
+    {
+        e2x += e1x;
+        e2y += e1y;
+    }
+    det = e1x*e2y - e1y*e2x;
+    if (!(fabs(det) > 0.0))
+        return 0;
+    for (i = 0; i < npeaks; i++)
+    {
+        gdouble h = (peaks[i].x*e2y - peaks[i].y*e2x)/det;
+        gdouble k = (e1x*peaks[i].y - e1y*peaks[i].x)/det;
+        gdouble rh = floor(h + 0.5), rk = floor(k + 0.5);
+        if (fabs(h - rh) > HCP_INDEX_TOLERANCE
+            || fabs(k - rk) > HCP_INDEX_TOLERANCE
+            || (rh == 0.0 && rk == 0.0))
+            continue;
+        peaks[i].h = (gint)rh;
+        peaks[i].k = (gint)rk;
+        nindexed++;
+    }
+    return nindexed;
+}
+
+/*
+ *  Adds (sign 1) or removes (sign -1) the ring equation of one peak.  With
+ *  u = 1/Xscale^2 and v = 1/Yscale^2 every indexed peak gives the linear
+ *  equation x^2 u + y^2 v = R^2 (h^2 + k^2 + hk), divided by the ring
+ *  index so that all rings weigh alike.
+ */
+void
+hcp_fit_sums_add(HcpFitSums *sums, const HcpLatticePeak *peak,
+                 gdouble lattice, gint sign)
+{
+    gdouble R2 = 4.0/(3.0*lattice*lattice), n, x2, y2;
+    n = peak->h*peak->h + peak->k*peak->k + peak->h*peak->k;
+    if (!(n > 0.0))
+        return;
+    x2 = peak->x*peak->x/n;
+    y2 = peak->y*peak->y/n;
+    sums->sxx += sign*x2*x2;
+    sums->sxy += sign*x2*y2;
+    sums->syy += sign*y2*y2;
+    sums->bx += sign*x2*R2;
+    sums->by += sign*y2*R2;
+    sums->count += sign;
+}
+
+gboolean
+hcp_fit_sums_solve(const HcpFitSums *sums, HcpFactors *factors)
+{
+    gdouble det = sums->sxx*sums->syy - sums->sxy*sums->sxy, u, v;
+    factors->Xwarning = factors->Ywarning = FALSE;
+    if (sums->count < 2 || !(fabs(det) > 1e-12*sums->sxx*sums->syy))
+    {
+        factors->Xscale = factors->Yscale = NAN;
+        factors->Xwarning = factors->Ywarning = TRUE;
+        return FALSE;
+    }
+    u = (sums->bx*sums->syy - sums->by*sums->sxy)/det;
+    v = (sums->sxx*sums->by - sums->sxy*sums->bx)/det;
+    factors->Xscale = 1.0/sqrt(u);
+    factors->Yscale = 1.0/sqrt(v);
+    factors->Xwarning = !(u > 0.0);
+    factors->Ywarning = !(v > 0.0);
+    return !(factors->Xwarning || factors->Ywarning);
+}
+
+/* Corrected distance of a peak from its ring, NaN if not indexed. */
+gdouble
+hcp_fit_residual(const HcpLatticePeak *peak, const HcpFactors *factors,
+                 gdouble lattice)
+{
+    gdouble R2 = 4.0/(3.0*lattice*lattice), x, y, n;
+    n = peak->h*peak->h + peak->k*peak->k + peak->h*peak->k;
+    if (!(n > 0.0))
+        return NAN;
+    x = peak->x/factors->Xscale;
+    y = peak->y/factors->Yscale;
+    return sqrt(x*x + y*y) - sqrt(R2*n);
+}
+
+/*
+ *  Basis of the reciprocal lattice the factors predict: the hexagonal
+ *  lattice of the given constant in corrected coordinates, turned to
+ *  match the indexed peaks best in the least squares sense and mapped back
+ *  to measured frequencies.  Either handedness of the indexing is tried.
+ *  The second vector is at 60 degrees to the first in corrected space.
+ */
+gboolean
+hcp_predict_basis(const HcpLatticePeak *peaks, gint npeaks, gdouble lattice,
+                  const HcpFactors *factors, gdouble *basis)
+{
+    gdouble r = 2.0/(sqrt(3.0)*lattice), best = 0.0, c = 0.0, s = 0.0;
+    gdouble theta, sigma = 1.0, g1x, g1y, g2x, g2y;
+    gint i, j;
+    if (!(factors->Xscale > 0.0) || !(factors->Yscale > 0.0)
+        || !isfinite(factors->Xscale) || !isfinite(factors->Yscale)
+        || !(r > 0.0))
+        return FALSE;
+    for (j = 0; j < 2; j++)
+    {
+        gdouble sg = j ? -1.0 : 1.0, cj = 0.0, sj = 0.0;
+        for (i = 0; i < npeaks; i++)
+        {
+            gdouble qx, qy, px, py;
+            if (!peaks[i].h && !peaks[i].k)
+                continue;
+            qx = r*(peaks[i].h + 0.5*peaks[i].k);
+            qy = sg*r*0.5*sqrt(3.0)*peaks[i].k;
+            px = peaks[i].x/factors->Xscale;
+            py = peaks[i].y/factors->Yscale;
+            cj += qx*px + qy*py;
+            sj += qx*py - qy*px;
+        }
+        if (cj*cj + sj*sj > best)
+        {
+            best = cj*cj + sj*sj;
+            c = cj;
+            s = sj;
+            sigma = sg;
+        }
+    }
+    if (!(best > 0.0))
+        return FALSE;
+    theta = atan2(s, c);
+    g1x = r*cos(theta);
+    g1y = r*sin(theta);
+    g2x = 0.5*g1x - sigma*0.5*sqrt(3.0)*g1y;
+    g2y = 0.5*g1y + sigma*0.5*sqrt(3.0)*g1x;
+    basis[0] = factors->Xscale*g1x;
+    basis[1] = factors->Yscale*g1y;
+    basis[2] = factors->Xscale*g2x;
+    basis[3] = factors->Yscale*g2y;
+    return TRUE;
+}
+
+/*
+ *  Least squares X and Y correction putting all indexed peaks on their
+ *  rings, see hcp_fit_sums_add().  For two first ring peaks this is the
+ *  system hcp_get_factors() solves.  The residual of each peak is its
+ *  corrected distance from its ring, NaN if not indexed.
+ */
+gboolean
+hcp_fit_peaks(HcpLatticePeak *peaks, gint npeaks, gdouble lattice,
+              HcpFactors *factors)
+{
+    HcpFitSums sums;
+    gint i;
+    g_return_val_if_fail(factors, FALSE);
+    memset(&sums, 0, sizeof(HcpFitSums));
+    for (i = 0; i < npeaks; i++)
+    {
+        peaks[i].residual = NAN;
+        hcp_fit_sums_add(&sums, peaks + i, lattice, 1);
+    }
+    if (!hcp_fit_sums_solve(&sums, factors))
+        return FALSE;
+    for (i = 0; i < npeaks; i++)
+        peaks[i].residual = hcp_fit_residual(peaks + i, factors, lattice);
+    return TRUE;
+}
+
+/*
+ *  Solves the np x np normal equations a x = b by Gauss-Jordan
+ *  elimination, giving the inverse of a in cov.  Fails when a pivot
+ *  vanishes against the diagonal, i.e. a parameter is not determined.
+ */
+static gboolean
+joint_solve(const gdouble *a, const gdouble *b, gint np, gdouble *x,
+            gdouble *cov)
+{
+    gdouble m[3][6], scale = 0.0;
+    gint i, j, k;
+    for (i = 0; i < np; i++)
+    {
+        for (j = 0; j < np; j++)
+        {
+            m[i][j] = a[i*np + j];
+            m[i][np + j] = (i == j);
+        }
+        scale = MAX(scale, fabs(a[i*np + i]));
+    }
+    for (k = 0; k < np; k++)
+    {
+        gint best = k;
+        gdouble pivot;
+        for (i = k + 1; i < np; i++)
+        {
+            if (fabs(m[i][k]) > fabs(m[best][k]))
+                best = i;
+        }
+        for (j = 0; j < 2*np; j++)
+        {
+            gdouble t = m[k][j];
+            m[k][j] = m[best][j];
+            m[best][j] = t;
+        }
+        pivot = m[k][k];
+        if (!(fabs(pivot) > 1e-12*scale))
+            return FALSE;
+        for (j = 0; j < 2*np; j++)
+            m[k][j] /= pivot;
+        for (i = 0; i < np; i++)
+        {
+            gdouble f = m[i][k];
+            if (i == k || f == 0.0)
+                continue;
+            for (j = 0; j < 2*np; j++)
+                m[i][j] -= f*m[k][j];
+        }
+    }
+    for (i = 0; i < np; i++)
+    {
+        x[i] = 0.0;
+        for (j = 0; j < np; j++)
+        {
+            cov[i*np + j] = m[i][np + j];
+            x[i] += m[i][np + j]*b[j];
+        }
+    }
+    return TRUE;
+}
+
+/*
+ *  Joint fit of the peaks of several images of one scanner setting.  The
+ *  ring equations of hcp_fit_peaks() do not depend on the orientation of
+ *  the lattice, so the images share the metric x^2 u + y^2 v + xy w and
+ *  their rotations drop out; all peaks enter one least squares problem.
+ *  The shear term w is only fitted when the peaks determine it, i.e. they
+ *  lie in three or more directions.  Each rotation is afterwards the
+ *  six-fold mean angle of the corrected peaks from their ideal directions.
+ */
+gboolean
+hcp_fit_joint(HcpLatticePeak *peaks, const gint *npeaks, gint nimages,
+              gdouble lattice, HcpJointFit *fit, gdouble *rotations)
+{
+    gdouble R2 = 4.0/(3.0*lattice*lattice);
+    gdouble ata[9] = { 0.0 }, atb[3] = { 0.0 }, a2[4], b2[2];
+    gdouble p[3] = { 0.0, 0.0, 0.0 }, cov[9], ssr = 0.0, s2, u, v, w, su, sv;
+    gint np = 3, count = 0, total = 0, i, j, k, m;
+    g_return_val_if_fail(peaks && npeaks && fit, FALSE);
+    for (m = 0; m < nimages; m++)
+        total += npeaks[m];
+    for (i = 0; i < total; i++)
+    {
+        const HcpLatticePeak *peak = peaks + i;
+        gdouble n = peak->h*peak->h + peak->k*peak->k + peak->h*peak->k, r[3];
+        peaks[i].residual = NAN;
+        if (!(n > 0.0))
+            continue;
+        r[0] = peak->x*peak->x/n;
+        r[1] = peak->y*peak->y/n;
+        r[2] = peak->x*peak->y/n;
+        for (j = 0; j < 3; j++)
+        {
+            for (k = 0; k < 3; k++)
+                ata[3*j + k] += r[j]*r[k];
+            atb[j] += r[j]*R2;
+        }
+        count++;
+    }
+    memset(fit, 0, sizeof(HcpJointFit));
+    fit->npeaks = count;
+    fit->shear_err = NAN;
+    if (count < 4 || !joint_solve(ata, atb, 3, p, cov))
+    {
+        np = 2;
+        a2[0] = ata[0];
+        a2[1] = ata[1];
+        a2[2] = ata[3];
+        a2[3] = ata[4];
+        b2[0] = atb[0];
+        b2[1] = atb[1];
+        p[2] = 0.0;
+        if (count < 2 || !joint_solve(a2, b2, 2, p, cov))
+        {
+            fit->factors.Xscale = fit->factors.Yscale = NAN;
+            fit->factors.Xwarning = fit->factors.Ywarning = TRUE;
+            return FALSE;
+        }
+    }
+    u = p[0];
+    v = p[1];
+    w = p[2];
+    fit->factors.Xwarning = !(u > 0.0);
+    fit->factors.Ywarning = !(v > 0.0);
+    fit->factors.Xscale = 1.0/sqrt(u);
+    fit->factors.Yscale = 1.0/sqrt(v);
+    if (fit->factors.Xwarning || fit->factors.Ywarning
+        || !(4.0*u*v > w*w))
+        return FALSE;
+    for (i = 0; i < total; i++)
+    {
+        const HcpLatticePeak *peak = peaks + i;
+        gdouble n = peak->h*peak->h + peak->k*peak->k + peak->h*peak->k, d;
+        if (!(n > 0.0))
+            continue;
+        d = (peak->x*peak->x*u + peak->y*peak->y*v + peak->x*peak->y*w)/n - R2;
+        ssr += d*d;
+        peaks[i].residual = sqrt(MAX(n*(d + R2), 0.0)) - sqrt(R2*n);
+    }
+    s2 = (count > np) ? ssr/(count - np) : NAN;
+    fit->Xscale_err = 0.5*pow(u, -1.5)*sqrt(s2*cov[0]);
+    fit->Yscale_err = 0.5*pow(v, -1.5)*sqrt(s2*cov[np + 1]);
+    su = sqrt(u);
+    sv = sqrt(v);
+    fit->shear = w/(2.0*su*sv);
+    if (np == 3)
+    {
+        /* Gradient of w/(2 sqrt(uv)) propagated through the covariance. */
+        gdouble g[3] = { -0.5*fit->shear/u, -0.5*fit->shear/v,
+                         0.5/(su*sv) }, var = 0.0;
+        for (j = 0; j < 3; j++)
+        {
+            for (k = 0; k < 3; k++)
+                var += g[j]*cov[3*j + k]*g[k];
+        }
+        fit->shear_err = sqrt(s2*var);
+    }
+    for (m = 0, i = 0; m < nimages && rotations; i += npeaks[m], m++)
+    {
+        gdouble c = 0.0, s = 0.0, qv = sqrt(v - w*w/(4.0*u));
+        for (j = i; j < i + npeaks[m]; j++)
+        {
+            const HcpLatticePeak *peak = peaks + j;
+            gdouble qx, qy, d;
+            if (!(peak->h*peak->h + peak->k*peak->k + peak->h*peak->k > 0))
+                continue;
+            qx = su*peak->x + 0.5*w/su*peak->y;
+            qy = qv*peak->y;
+            d = atan2(qy, qx) - atan2(0.5*sqrt(3.0)*peak->k,
+                                      peak->h + 0.5*peak->k);
+            c += cos(6.0*d);
+            s += sin(6.0*d);
+        }
+        rotations[m] = (c || s) ? atan2(s, c)/6.0 : NAN;
+    }
+    return TRUE;
+}
+
+gint
+hcp_calibrated_yres(gint yres, const HcpFactors *factors)
+{
+    return GWY_ROUND(yres * factors->Yscale / factors->Xscale);
+}
+
+/*
+ *  Source row position of each output row, with the pixel centres of
+ *  both grids aligned as in gwy_data_field_resample().  Clamping to the
+ *  first and last row reproduces its mirrored boundary for linear
+ *  interpolation; it is the only place where the edges are handled.
+ */
+static inline gdouble
+resample_row_position(gint k, gint yres, gint newyres)
+{
+    gdouble x = (k + 0.5)*yres/newyres - 0.5;
+    return CLAMP(x, 0.0, yres - 1.0);
+}
+
+/*
+ *  The weights depend only on the two resolutions, so they are computed
+ *  once and shared by all planes resampled the same way.
+ */
+static ResampleWeight*
+resample_weights(gint yres, gint newyres)
+{
+    ResampleWeight *weights = g_new(ResampleWeight, newyres);
+    gint k;
+    for (k = 0; k < newyres; k++)
+    {
+        gdouble x = resample_row_position(k, yres, newyres);
+        weights[k].i0 = MIN((gint)x, MAX(yres - 2, 0));
+        weights[k].i1 = MIN(weights[k].i0 + 1, yres - 1);
+        weights[k].w = x - weights[k].i0;
+    }
+    return weights;
+}
+
+static void
+resample_rows_round(const gdouble *src, gint rowstride, gint xres,
+                    const ResampleWeight *weights, gdouble *dst, gint newyres)
+{
+    gint k;
+#ifdef _OPENMP
+#pragma omp parallel for private(k) num_threads(hcp_get_n_threads()) \
+            if (xres*newyres > HCP_PARALLEL_MIN)
+#endif
+    for (k = 0; k < newyres; k++)
+    {
+        gint i = (weights[k].w < 0.5) ? weights[k].i0 : weights[k].i1;
+        memcpy(dst + k*xres, src + i*rowstride, xres*sizeof(gdouble));
+    }
+}
+
+static void
+resample_rows_linear(const gdouble *src, gint rowstride, gint xres,
+                     const ResampleWeight *weights, gdouble *dst, gint newyres)
+{
+    gint k;
+#ifdef _OPENMP
+#pragma omp parallel for private(k) num_threads(hcp_get_n_threads()) \
+            if (xres*newyres > HCP_PARALLEL_MIN)
+#endif
+    for (k = 0; k < newyres; k++)
+    {
+        gdouble w = weights[k].w;
+        const gdouble *s0 = src + weights[k].i0*rowstride;
+        const gdouble *s1 = src + weights[k].i1*rowstride;
+        gdouble *d = dst + k*xres;
+        gint j;
+        for (j = 0; j < xres; j++)
+            d[j] = (1.0 - w)*s0[j] + w*s1[j];
+    }
+}
+
+/*
+ *  Source column of each column of a linearised resonant sweep.  The
+ *  output columns are equally spaced in tip position between the first
+ *  and the last source column, so the width of the image is kept.
+ */
+static ResampleWeight*
+resonance_weights(gint xres, const HcpResonance *resonance)
+{
+    ResampleWeight *columns = g_new(ResampleWeight, xres);
+    gdouble center = resonance->center, span = resonance->span;
+    gdouble pa = sin(center + span*(0.5/xres - 0.5));
+    gdouble pb = sin(center + span*(0.5 - 0.5/xres));
+    gint k;
+    for (k = 0; k < xres; k++)
+    {
+        gdouble x = k;
+        if (span > 1e-9 && xres > 1)
+        {
+            gdouble p = pa + (pb - pa)*k/(xres - 1.0);
+            x = ((asin(CLAMP(p, -1.0, 1.0)) - center)/span + 0.5)*xres - 0.5;
+        }
+        x = CLAMP(x, 0.0, xres - 1.0);
+        columns[k].i0 = MIN((gint)x, MAX(xres - 2, 0));
+        columns[k].i1 = MIN(columns[k].i0 + 1, xres - 1);
+        columns[k].w = x - columns[k].i0;
+    }
+    return columns;
+}
+
+/* Linear row resampling and the column remap in one bilinear pass. */
+static void
+resample_remap_linear(const gdouble *src, gint rowstride, gint xres,
+                      const ResampleWeight *weights,
+                      const ResampleWeight *columns,
+                      gdouble *dst, gint newyres)
+{
+    gint k;
+#ifdef _OPENMP
+#pragma omp parallel for private(k) num_threads(hcp_get_n_threads()) \
+            if (xres*newyres > HCP_PARALLEL_MIN)
+#endif
+    for (k = 0; k < newyres; k++)
+    {
+        gdouble w = weights[k].w;
+        const gdouble *s0 = src + weights[k].i0*rowstride;
+        const gdouble *s1 = src + weights[k].i1*rowstride;
+        gdouble *d = dst + k*xres;
+        gint j;
+        for (j = 0; j < xres; j++)
+        {
+            gint j0 = columns[j].i0, j1 = columns[j].i1;
+            gdouble v = columns[j].w;
+            d[j] = (1.0 - w)*((1.0 - v)*s0[j0] + v*s0[j1])
+                   + w*((1.0 - v)*s1[j0] + v*s1[j1]);
+        }
+    }
+}
+
+/* Column remap alone, for interpolations that resample rows otherwise. */
+static void
+remap_columns(const gdouble *src, gint rowstride, gint xres, gint yres,
+              const ResampleWeight *columns, gdouble *dst)
+{
+    gint i;
+#ifdef _OPENMP
+#pragma omp parallel for private(i) num_threads(hcp_get_n_threads()) \
+            if (xres*yres > HCP_PARALLEL_MIN)
+#endif
+    for (i = 0; i < yres; i++)
+    {
+        const gdouble *s = src + i*rowstride;
+        gdouble *d = dst + i*xres;
+        gint j;
+        for (j = 0; j < xres; j++)
+            d[j] = (1.0 - columns[j].w)*s[columns[j].i0]
+                   + columns[j].w*s[columns[j].i1];
+    }
+}
+
+static ResampleRowsFunc
+find_resample_kernel(GwyInterpolationType interp)
+{
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS(resample_kernels); i++)
+    {
+        if (resample_kernels[i].interp == interp)
+            return resample_kernels[i].func;
+    }
+    return NULL;
+}
+
+/*
+ *  Moves the column spectra of length yres to length newyres: the band
+ *  both share is copied, the rest is cut off or left zero.  A Nyquist
+ *  coefficient is split in half between the two halves when padding; when
+ *  cropping, the two halves both alias onto it and are summed.  The phase
+ *  shift aligns the pixel centres of both grids as resample_row_position()
+ *  does, and the scale makes up for the unitary transforms of different
+ *  lengths.
+ */
+static void
+fourier_resize_columns(const gdouble *re, const gdouble *im,
+                       gint xres, gint yres, gint newyres,
+                       gdouble *newre, gdouble *newim)
+{
+    gint m = MIN(yres, newyres), f, j;
+    gdouble scale = sqrt((gdouble)newyres/yres);
+    gdouble shift = 2.0*G_PI*(0.5*yres/newyres - 0.5)/yres;
+    memset(newre, 0, xres*newyres*sizeof(gdouble));
+    memset(newim, 0, xres*newyres*sizeof(gdouble));
+#ifdef _OPENMP
+#pragma omp parallel for private(f, j) num_threads(hcp_get_n_threads()) \
+            if (xres*m > HCP_PARALLEL_MIN)
+#endif
+    for (f = -((m - 1)/2); f <= m/2; f++)
+    {
+        gint from = (f < 0) ? yres + f : f, to = (f < 0) ? newyres + f : f;
+        gdouble c = cos(shift*f), s = sin(shift*f), w = scale;
+        gboolean nyquist = (2*f == m && yres != newyres);
+        if (nyquist && newyres > yres)
+            w *= 0.5;
+        for (j = 0; j < xres; j++)
+        {
+            gdouble a = re[from*xres + j], b = im[from*xres + j];
+            if (nyquist && newyres < yres)
+            {
+                /* Both halves of the cropped band land on the bin. */
+                gint mirror = (yres - f)*xres + j;
+                gdouble ma = re[mirror], mb = im[mirror];
+                gdouble mc = cos(-shift*f), ms = sin(-shift*f);
+                newre[to*xres + j] = w*((a*c - b*s) + (ma*mc - mb*ms));
+                newim[to*xres + j] = w*((a*s + b*c) + (ma*ms + mb*mc));
+                continue;
+            }
+            newre[to*xres + j] = w*(a*c - b*s);
+            newim[to*xres + j] = w*(a*s + b*c);
+            if (nyquist)
+            {
+                gint mirror = (newyres - f)*xres + j;
+                newre[mirror] = w*(a*c + b*s);
+                newim[mirror] = w*(-a*s + b*c);
+            }
+        }
+    }
+}
+
+/*
+ *  Band limited resampling of the columns: zero padding or cropping their
+ *  spectra and transforming back interpolates exactly for a band limited
+ *  image, with no blur of the corrugation.  The spectra are periodic, so
+ *  the ramp from the first to the last row of each column is taken out
+ *  first and added back at the new positions, avoiding ringing at the top
+ *  and bottom edges.
+ */
+static GwyDataField*
+field_apply_fourier(GwyDataField *dfield, gint newyres)
+{
+    gint xres = gwy_data_field_get_xres(dfield);
+    gint yres = gwy_data_field_get_yres(dfield);
+    GwyDataField *source, *re, *im, *newre, *newim, *result, *resultim;
+    gdouble *d, *slope;
+    gint i, j;
+    source = gwy_data_field_duplicate(dfield);
+    d = gwy_data_field_get_data(source);
+    slope = g_new(gdouble, xres);
+    for (j = 0; j < xres; j++)
+        slope[j] = (yres > 1) ? (d[(yres - 1)*xres + j] - d[j])/(yres - 1) : 0.0;
+#ifdef _OPENMP
+#pragma omp parallel for private(i, j) num_threads(hcp_get_n_threads()) \
+            if (xres*yres > HCP_PARALLEL_MIN)
+#endif
+    for (i = 0; i < yres; i++)
+    {
+        for (j = 0; j < xres; j++)
+            d[i*xres + j] -= slope[j]*i;
+    }
+    gwy_data_field_invalidate(source);
+    re = gwy_data_field_new_alike(source, FALSE);
+    im = gwy_data_field_new_alike(source, FALSE);
+    result = gwy_data_field_new(xres, newyres,
+                                gwy_data_field_get_xreal(dfield),
+                                gwy_data_field_get_yreal(dfield), FALSE);
+    newre = gwy_data_field_new_alike(result, FALSE);
+    newim = gwy_data_field_new_alike(result, FALSE);
+    resultim = gwy_data_field_new_alike(result, FALSE);
+#ifdef _OPENMP
+#pragma omp critical (hcp_fft)
+#endif
+    gwy_data_field_1dfft_raw(source, NULL, re, im,
+                             GWY_ORIENTATION_VERTICAL,
+                             GWY_TRANSFORM_DIRECTION_FORWARD);
+    fourier_resize_columns(gwy_data_field_get_data_const(re),
+                           gwy_data_field_get_data_const(im), xres, yres,
+                           newyres, gwy_data_field_get_data(newre),
+                           gwy_data_field_get_data(newim));
+#ifdef _OPENMP
+#pragma omp critical (hcp_fft)
+#endif
+    gwy_data_field_1dfft_raw(newre, newim, result, resultim,
+                             GWY_ORIENTATION_VERTICAL,
+                             GWY_TRANSFORM_DIRECTION_BACKWARD);
+    d = gwy_data_field_get_data(result);
+#ifdef _OPENMP
+#pragma omp parallel for private(i, j) num_threads(hcp_get_n_threads()) \
+            if (xres*newyres > HCP_PARALLEL_MIN)
+#endif
+    for (i = 0; i < newyres; i++)
+    {
+        gdouble y = (i + 0.5)*yres/newyres - 0.5;
+        for (j = 0; j < xres; j++)
+            d[i*xres + j] += slope[j]*y;
+    }
+    gwy_data_field_invalidate(result);
+    gwy_data_field_copy_units(dfield, result);
+    gwy_data_field_set_xoffset(result, gwy_data_field_get_xoffset(dfield));
+    gwy_data_field_set_yoffset(result, gwy_data_field_get_yoffset(dfield));
+    g_free(slope);
+    g_object_unref(resultim);
+    g_object_unref(newim);
+    g_object_unref(newre);
+    g_object_unref(im);
+    g_object_unref(re);
+    g_object_unref(source);
+    return result;
+}
+
+/*
+ *  Averages square blocks of pixels so that neither resolution exceeds
+ *  maxres.  A box filter is a poor low-pass: it only damps the atomic
+ *  rows above the new Nyquist frequency, so a weak false lattice may
+ *  still alias into the result, but far weaker than with point sampling.
+ *  Leftover rows and columns are dropped.
+ */
+GwyDataField*
+hcp_field_downsample(GwyDataField *dfield, gint maxres)
+{
+    gint xres = gwy_data_field_get_xres(dfield);
+    gint yres = gwy_data_field_get_yres(dfield);
+    gint bin = MAX((MAX(xres, yres) + maxres - 1)/maxres, 1);
+    gint newxres = MAX(xres/bin, 1), newyres = MAX(yres/bin, 1), i, j, k, l;
+    const gdouble *src = gwy_data_field_get_data_const(dfield);
+    GwyDataField *result;
+    gdouble *dst;
+    if (bin == 1)
+        return gwy_data_field_duplicate(dfield);
+    result = gwy_data_field_new(newxres, newyres,
+                                gwy_data_field_get_xmeasure(dfield)*bin*newxres,
+                                gwy_data_field_get_ymeasure(dfield)*bin*newyres,
+                                TRUE);
+    gwy_data_field_copy_units(dfield, result);
+    gwy_data_field_set_xoffset(result, gwy_data_field_get_xoffset(dfield));
+    gwy_data_field_set_yoffset(result, gwy_data_field_get_yoffset(dfield));
+    dst = gwy_data_field_get_data(result);
+    for (i = 0; i < newyres*bin && i < yres; i++)
+    {
+        for (j = 0, k = 0; k < newxres; k++)
+        {
+            gdouble sum = 0.0;
+            for (l = 0; l < bin; l++, j++)
+                sum += src[i*xres + j];
+            dst[(i/bin)*newxres + k] += sum;
+        }
+    }
+    gwy_data_field_multiply(result, 1.0/(bin*bin));
+    return result;
+}
+
+/*
+ *  Like hcp_field_downsample(), but takes the maximum of each block, so
+ *  that peaks one spectrum bin wide stay visible in a display of the
+ *  spectrum.
+ */
+GwyDataField*
+hcp_field_downsample_max(GwyDataField *dfield, gint maxres)
+{
+    gint xres = gwy_data_field_get_xres(dfield);
+    gint yres = gwy_data_field_get_yres(dfield);
+    gint bin = MAX((MAX(xres, yres) + maxres - 1)/maxres, 1);
+    gint newxres = MAX(xres/bin, 1), newyres = MAX(yres/bin, 1), i, j, k, l;
+    const gdouble *src = gwy_data_field_get_data_const(dfield);
+    GwyDataField *result;
+    gdouble *dst;
+    if (bin == 1)
+        return gwy_data_field_duplicate(dfield);
+    result = gwy_data_field_new(newxres, newyres,
+                                gwy_data_field_get_xmeasure(dfield)*bin*newxres,
+                                gwy_data_field_get_ymeasure(dfield)*bin*newyres,
+                                FALSE);
+    gwy_data_field_copy_units(dfield, result);
+    gwy_data_field_set_xoffset(result, gwy_data_field_get_xoffset(dfield));
+    gwy_data_field_set_yoffset(result, gwy_data_field_get_yoffset(dfield));
+    dst = gwy_data_field_get_data(result);
+    for (k = 0; k < newxres*newyres; k++)
+        dst[k] = -G_MAXDOUBLE;
+    for (i = 0; i < newyres*bin && i < yres; i++)
+    {
+        for (j = 0, k = 0; k < newxres; k++)
+        {
+            gdouble *d = dst + (i/bin)*newxres + k;
+            for (l = 0; l < bin; l++, j++)
+                *d = MAX(*d, src[i*xres + j]);
+        }
+    }
+    return result;
+}
+
+/*
+ *  The X resolution is kept, so calibration only ever resamples rows.
+ *  Interpolations without a row kernel go through Gwyddion.
+ */
+GwyDataField*
+hcp_field_apply(GwyDataField *dfield, const HcpFactors *factors,
+                GwyInterpolationType interp)
+{
+    ResampleRowsFunc func = find_resample_kernel(interp);
+    gint oldXres = gwy_data_field_get_xres(dfield);
+    gint oldYres = gwy_data_field_get_yres(dfield);
+    gint newYres = hcp_calibrated_yres(oldYres, factors);
+    gdouble oldXreal = gwy_data_field_get_xreal(dfield);
+    gdouble oldYreal = gwy_data_field_get_yreal(dfield);
+    GwyDataField *newDataField;
+    if (interp == HCP_INTERPOLATION_FOURIER)
+        newDataField = field_apply_fourier(dfield, newYres);
+    else if (func)
+    {
+        newDataField = gwy_data_field_new(oldXres, newYres,
+                                          oldXreal, oldYreal, FALSE);
+        gwy_data_field_copy_units(dfield, newDataField);
+        gwy_data_field_set_xoffset(newDataField,
+                                   gwy_data_field_get_xoffset(dfield));
+        gwy_data_field_set_yoffset(newDataField,
+                                   gwy_data_field_get_yoffset(dfield));
+        ResampleWeight *weights = resample_weights(oldYres, newYres);
+        func(gwy_data_field_get_data_const(dfield), oldXres, oldXres, weights,
+             gwy_data_field_get_data(newDataField), newYres);
+        g_free(weights);
+    }
+    else
+        newDataField = gwy_data_field_new_resampled(dfield, oldXres, newYres,
+                                                    interp);
+    gwy_data_field_set_xreal(newDataField, oldXreal * factors->Xscale);
+    gwy_data_field_set_yreal(newDataField, oldYreal * factors->Yscale);
+    return newDataField;
+}
+
+/*
+ *  hcp_field_apply() with the columns of a resonant sweep linearised.
+ *  Linear interpolation does both in a single pass; the others get the
+ *  column remap first.
+ */
+GwyDataField*
+hcp_field_apply_resonant(GwyDataField *dfield, const HcpFactors *factors,
+                         const HcpResonance *resonance,
+                         GwyInterpolationType interp)
+{
+    gint xres = gwy_data_field_get_xres(dfield);
+    gint yres = gwy_data_field_get_yres(dfield);
+    ResampleWeight *columns = resonance_weights(xres, resonance);
+    GwyDataField *newDataField;
+    if (interp == GWY_INTERPOLATION_LINEAR)
+    {
+        gint newYres = hcp_calibrated_yres(yres, factors);
+        ResampleWeight *weights = resample_weights(yres, newYres);
+        newDataField = gwy_data_field_new(xres, newYres,
+                            gwy_data_field_get_xreal(dfield)*factors->Xscale,
+                            gwy_data_field_get_yreal(dfield)*factors->Yscale,
+                            FALSE);
+        gwy_data_field_copy_units(dfield, newDataField);
+        gwy_data_field_set_xoffset(newDataField,
+                                   gwy_data_field_get_xoffset(dfield));
+        gwy_data_field_set_yoffset(newDataField,
+                                   gwy_data_field_get_yoffset(dfield));
+        resample_remap_linear(gwy_data_field_get_data_const(dfield), xres,
+                              xres, weights, columns,
+                              gwy_data_field_get_data(newDataField), newYres);
+        g_free(weights);
+    }
+    else
+    {
+        GwyDataField *remapped = gwy_data_field_new_alike(dfield, FALSE);
+        remap_columns(gwy_data_field_get_data_const(dfield), xres, xres, yres,
+                      columns, gwy_data_field_get_data(remapped));
+        newDataField = hcp_field_apply(remapped, factors, interp);
+        g_object_unref(remapped);
+    }
+    g_free(columns);
+    return newDataField;
+}
+
+/*
+ *  One pass builds the radial mean and maximum profiles.  The maxima are
+ *  divided by a power law fitted to the mean profile, so that the falling
+ *  1/f background does not make the lowest frequencies look like a ring,
+ *  and the strongest relative maximum outside the excluded centre is taken
+ *  as the first ring.  A second pass over the ring annulus only builds
+ *  the angular profile for the six-fold contrast, i.e. the relative
+ *  magnitude of its sixth Fourier coefficient.
+ */
+static void
+spectrum_quality(const gdouble *data, gint xres, gint yres, gint rowstride,
+                 gdouble dx, gdouble dy, gint padding, HcpQuality *quality)
+{
+    gint nbins = MIN(xres, yres)/2, ring = -1, lo, hi, b, i, j, halfwidth;
+    gint from = HCP_QUALITY_EXCLUDE*MAX(padding, 1);
+    gdouble h = MAX(dx, dy), cx = xres/2, cy = yres/2;
+    gdouble *sum, *maxima, *trend, angular[HCP_QUALITY_ANGLES];
+    gdouble half, re = 0.0, im = 0.0, total = 0.0;
+    gint *count;
+    memset(quality, 0, sizeof(HcpQuality));
+    if (nbins < from + 4)
+        return;
+    sum = g_new0(gdouble, nbins);
+    maxima = g_new0(gdouble, nbins);
+    trend = g_new0(gdouble, nbins);
+    count = g_new0(gint, nbins);
+    for (i = 0; i < yres; i++)
+    {
+        for (j = 0; j < xres; j++)
+        {
+            b = (gint)(hypot((j - cx)*dx, (i - cy)*dy)/h);
+            if (b >= nbins)
+                continue;
+            sum[b] += data[i*rowstride + j];
+            maxima[b] = MAX(maxima[b], data[i*rowstride + j]);
+            count[b]++;
+        }
+    }
+    for (b = 0; b < nbins; b++)
+        sum[b] = count[b] ? sum[b]/count[b] : 0.0;
+    radial_trend(sum, from, nbins, trend);
+    for (b = from; b < nbins; b++)
+    {
+        maxima[b] = trend[b] > 0.0 ? maxima[b]/trend[b] : 0.0;
+        if (ring < 0 || maxima[b] > maxima[ring])
+            ring = b;
+    }
+    quality->radius = (ring + 0.5)*h;
+    quality->peak_to_background = maxima[ring];
+    half = 0.5*(maxima[ring] + 1.0);
+    for (lo = ring; lo > from && maxima[lo-1] >= half; lo--)
+        ;
+    for (hi = ring; hi < nbins-1 && maxima[hi+1] >= half; hi++)
+        ;
+    quality->sharpness = (ring + 0.5)/(hi - lo + 1);
+
+    for (b = 0; b < HCP_QUALITY_ANGLES; b++)
+        angular[b] = 0.0;
+    halfwidth = MAX(1, ring/10);
+    for (i = MAX(0, (gint)(cy - (ring + halfwidth + 1)*h/dy));
+         i < MIN(yres, (gint)(cy + (ring + halfwidth + 1)*h/dy) + 1); i++)
+    {
+        for (j = 0; j < xres; j++)
+        {
+            gdouble x = (j - cx)*dx, y = (i - cy)*dy, v;
+            b = (gint)(hypot(x, y)/h);
+            if (ABS(b - ring) > halfwidth || b < from || b >= nbins)
+                continue;
+            v = data[i*rowstride + j] - trend[b];
+            b = (gint)floor((atan2(y, x) + G_PI)/(2.0*G_PI)*HCP_QUALITY_ANGLES);
+            b = CLAMP(b, 0, HCP_QUALITY_ANGLES-1);
+            angular[b] = MAX(angular[b], v);
+        }
+    }
+    for (b = 0; b < HCP_QUALITY_ANGLES; b++)
+    {
+        gdouble phi = 6.0*2.0*G_PI*(b + 0.5)/HCP_QUALITY_ANGLES;
+        re += angular[b]*cos(phi);
+        im += angular[b]*sin(phi);
+        total += angular[b];
+    }
+    quality->sixfold = total > 0.0 ? hypot(re, im)/total : 0.0;
+    if (quality->peak_to_background > 1.0)
+        quality->score = quality->sixfold
+                         * (1.0 - 1.0/quality->peak_to_background);
+    quality->passed = (quality->peak_to_background >= HCP_QUALITY_MIN_PTB
+                       && quality->sixfold >= HCP_QUALITY_MIN_SIXFOLD);
+    g_free(sum);
+    g_free(maxima);
+    g_free(trend);
+    g_free(count);
+}
+
+/*
+ *  Least squares fit of log mean = a + s log r over the bins from on, i.e.
+ *  the power law background of the spectrum.  Empty bins are skipped.
+ */
+static void
+radial_trend(const gdouble *mean, gint from, gint nbins, gdouble *trend)
+{
+    gdouble sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0, a, slope = 0.0, det;
+    gint b, n = 0;
+    for (b = from; b < nbins; b++)
+    {
+        gdouble x, y;
+        if (mean[b] <= 0.0)
+            continue;
+        x = log(b + 0.5);
+        y = log(mean[b]);
+        sx += x;
+        sy += y;
+        sxx += x*x;
+        sxy += x*y;
+        n++;
+    }
+    if (!n)
+        return;
+    det = n*sxx - sx*sx;
+    if (det > 0.0)
+        slope = (n*sxy - sx*sy)/det;
+    a = (sy - slope*sx)/n;
+    for (b = from; b < nbins; b++)
+        trend[b] = exp(a + slope*log(b + 0.5));
+}
+
+void
+hcp_field_quality(GwyDataField *spectrum, gint padding, HcpQuality *quality)
+{
+    gint xres = gwy_data_field_get_xres(spectrum);
+    spectrum_quality(gwy_data_field_get_data_const(spectrum),
+                     xres, gwy_data_field_get_yres(spectrum), xres,
+                     gwy_data_field_get_xmeasure(spectrum),
+                     gwy_data_field_get_ymeasure(spectrum), padding,
+                     quality);
+}
+
+/*
+ *  Adds the power spectra of nlines lines of n values to power.  Values
+ *  of a line are pitch apart and lines start stride apart, so the same
+ *  code reads rows and columns.  All lines go through one batched
+ *  transform.  Only the shape of the sum matters to line_peak().
+ */
+static void
+line_power_sum(const gdouble *src, gint n, gint nlines, gint pitch,
+               gint stride, gdouble *power)
+{
+    GwyDataField *rin, *rout, *iout;
+    const gdouble *re, *im;
+    gdouble *window, *d;
+    gint i, j, k;
+    window = g_new(gdouble, n);
+    for (j = 0; j < n; j++)
+        window[j] = 1.0;
+    gwy_fft_window(n, window, GWY_WINDOWING_HANN);
+    rin = gwy_data_field_new(n, nlines, n, nlines, FALSE);
+    rout = gwy_data_field_new_alike(rin, FALSE);
+    iout = gwy_data_field_new_alike(rin, FALSE);
+    d = gwy_data_field_get_data(rin);
+#ifdef _OPENMP
+#pragma omp parallel for private(i, j) num_threads(hcp_get_n_threads()) \
+            if (n*nlines > HCP_PARALLEL_MIN)
+#endif
+    for (i = 0; i < nlines; i++)
+    {
+        const gdouble *line = src + i*stride;
+        gdouble avg = 0.0;
+        for (j = 0; j < n; j++)
+            avg += line[j*pitch];
+        avg /= n;
+        for (j = 0; j < n; j++)
+            d[i*n + j] = (line[j*pitch] - avg)*window[j];
+    }
+    gwy_data_field_invalidate(rin);
+#ifdef _OPENMP
+#pragma omp critical (hcp_fft)
+#endif
+    gwy_data_field_1dfft_raw(rin, NULL, rout, iout,
+                             GWY_ORIENTATION_HORIZONTAL,
+                             GWY_TRANSFORM_DIRECTION_FORWARD);
+    re = gwy_data_field_get_data_const(rout);
+    im = gwy_data_field_get_data_const(iout);
+#ifdef _OPENMP
+#pragma omp parallel for private(i, k) num_threads(hcp_get_n_threads()) \
+            if (n*nlines > HCP_PARALLEL_MIN)
+#endif
+    for (k = 0; k <= n/2; k++)
+    {
+        gdouble s = 0.0;
+        for (i = 0; i < nlines; i++)
+            s += re[i*n + k]*re[i*n + k] + im[i*n + k]*im[i*n + k];
+        power[k] += s;
+    }
+    g_object_unref(rin);
+    g_object_unref(rout);
+    g_object_unref(iout);
+    g_free(window);
+}
+
+/*
+ *  Strongest bin within the tolerance around the expected frequency,
+ *  refined by a parabola through its neighbours.
+ */
+static gboolean
+line_peak(const gdouble *power, gint n, gdouble real, gdouble expected,
+          gdouble *freq, gdouble *contrast)
+{
+    gint lo = MAX((gint)floor(expected*real/(1.0 + HCP_LINE_TOLERANCE)), 2);
+    gint hi = MIN((gint)ceil(expected*real*(1.0 + HCP_LINE_TOLERANCE)),
+                  n/2 - 1);
+    gdouble bg = 0.0, a, b, c, delta = 0.0;
+    gint k, best = lo;
+    *freq = *contrast = 0.0;
+    if (lo > hi)
+        return FALSE;
+    for (k = lo; k <= hi; k++)
+    {
+        bg += power[k];
+        if (power[k] > power[best])
+            best = k;
+    }
+    bg /= hi - lo + 1;
+    a = power[best - 1];
+    b = power[best];
+    c = power[best + 1];
+    if (a - 2.0*b + c < 0.0)
+        delta = 0.5*(a - c)/(a - 2.0*b + c);
+    *freq = (best + delta)/real;
+    *contrast = (bg > 0.0) ? b/bg : 0.0;
+    return *contrast >= HCP_LINE_MIN_CONTRAST;
+}
+
+/* Largest projection of the first ring onto the x (or y) axis when one
+ * of its peaks points in the direction angle. */
+static gdouble
+ring_projection(gdouble angle, gboolean vertical)
+{
+    gdouble m = 0.0;
+    gint i;
+    for (i = 0; i < 3; i++)
+    {
+        gdouble phi = angle + i*G_PI/3.0;
+        m = MAX(m, fabs(vertical ? sin(phi) : cos(phi)));
+    }
+    return m;
+}
+
+/*
+ *  Estimates the factors from the mean power spectrum of rows and of
+ *  columns instead of the 2D spectrum.  The row spectrum is the 2D power
+ *  spectrum projected onto the x axis, so the first ring shows up where
+ *  its outermost peak projects; likewise for columns.  Only every step-th
+ *  row and column is used, which makes this cheap enough to run while
+ *  the image is being acquired.  Angle is the direction of one first
+ *  ring peak; pi/6 corresponds to a lattice row along x.
+ */
+gboolean
+hcp_line_estimate(const gdouble *data, gint xres, gint yres, gint rowstride,
+                  gdouble xreal, gdouble yreal, gdouble lattice,
+                  gdouble angle, gint step, HcpLineEstimate *estimate)
+{
+    gdouble R, *power;
+    gboolean xok, yok;
+    g_return_val_if_fail(data && estimate, FALSE);
+    g_return_val_if_fail(xres > 7 && yres > 7 && rowstride >= xres, FALSE);
+    g_return_val_if_fail(xreal > 0.0 && yreal > 0.0 && lattice > 0.0, FALSE);
+    step = MAX(step, 1);
+    R = 2.0/(sqrt(3.0)*lattice);
+    power = g_new0(gdouble, MAX(xres, yres)/2 + 1);
+    line_power_sum(data, xres, (yres + step - 1)/step, 1, step*rowstride,
+                   power);
+    estimate->xexpected = R*ring_projection(angle, FALSE);
+    xok = line_peak(power, xres, xreal, estimate->xexpected,
+                    &estimate->xfreq, &estimate->xcontrast);
+    memset(power, 0, (MAX(xres, yres)/2 + 1)*sizeof(gdouble));
+    line_power_sum(data, yres, (xres + step - 1)/step, rowstride, step,
+                   power);
+    estimate->yexpected = R*ring_projection(angle, TRUE);
+    yok = line_peak(power, yres, yreal, estimate->yexpected,
+                    &estimate->yfreq, &estimate->ycontrast);
+    g_free(power);
+    estimate->factors.Xscale = estimate->xfreq/estimate->xexpected;
+    estimate->factors.Yscale = estimate->yfreq/estimate->yexpected;
+    estimate->factors.Xwarning = !xok;
+    estimate->factors.Ywarning = !yok;
+    return TRUE;
+}
+
+gboolean
+hcp_field_line_estimate(GwyDataField *dfield, gdouble lattice, gdouble angle,
+                        gint step, HcpLineEstimate *estimate)
+{
+    gint xres = gwy_data_field_get_xres(dfield);
+    return hcp_line_estimate(gwy_data_field_get_data_const(dfield),
+                             xres, gwy_data_field_get_yres(dfield), xres,
+                             gwy_data_field_get_xreal(dfield),
+                             gwy_data_field_get_yreal(dfield),
+                             lattice, angle, step, estimate);
+}
+
+/*
+ *  Misfit of f = a cos(span u) + b sin(span u), with a and b solved by
+ *  least squares for the given span.
+ */
+static gdouble
+resonance_misfit(const gdouble *u, const gdouble *f, gint n, gdouble span,
+                 gdouble *a, gdouble *b)
+{
+    gdouble scc = 0.0, scs = 0.0, sss = 0.0, sfc = 0.0, sfs = 0.0, det, r;
+    gdouble chi2 = 0.0;
+    gint i;
+    for (i = 0; i < n; i++)
+    {
+        gdouble c = cos(span*u[i]), s = sin(span*u[i]);
+        scc += c*c;
+        scs += c*s;
+        sss += s*s;
+        sfc += f[i]*c;
+        sfs += f[i]*s;
+    }
+    det = scc*sss - scs*scs;
+    if (!(fabs(det) > 0.0))
+        return G_MAXDOUBLE;
+    *a = (sfc*sss - sfs*scs)/det;
+    *b = (scc*sfs - scs*sfc)/det;
+    for (i = 0; i < n; i++)
+    {
+        r = f[i] - *a*cos(span*u[i]) - *b*sin(span*u[i]);
+        chi2 += r*r;
+    }
+    return chi2;
+}
+
+/*
+ *  The local period of the lattice along x is inversely proportional to
+ *  the tip velocity, i.e. to the cosine of the sweep phase.  The mean row
+ *  spectrum of each column band, all rows going through one batched
+ *  transform, gives the local frequency of the lattice peak at xfreq;
+ *  bands are followed outwards from the middle so that the expected
+ *  frequency is always that of the neighbour.  A sinusoid in the column
+ *  position is then fitted to the band frequencies.  The phases must stay
+ *  within a quarter period of the turning points for the remap to exist.
+ */
+gboolean
+hcp_resonance_fit(const gdouble *data, gint xres, gint yres, gint rowstride,
+                  gdouble xreal, gdouble xfreq, HcpResonance *resonance)
+{
+    gdouble u[HCP_RESONANCE_BANDS], f[HCP_RESONANCE_BANDS];
+    gdouble found[HCP_RESONANCE_BANDS], *power, expected, mean = 0.0;
+    gdouble best = G_MAXDOUBLE, span = 0.0, a = 0.0, b = 0.0, lo, hi;
+    gboolean ok[HCP_RESONANCE_BANDS];
+    gint width, b0, step, n = 0, i, k;
+    g_return_val_if_fail(data && resonance, FALSE);
+    g_return_val_if_fail(xres > 0 && yres > 0 && rowstride >= xres, FALSE);
+    g_return_val_if_fail(xreal > 0.0 && xfreq != 0.0, FALSE);
+    memset(resonance, 0, sizeof(HcpResonance));
+    /* Too few columns for the bands; not an error, just no fit. */
+    if (xres < 32)
+        return FALSE;
+    width = xres/4;
+    power = g_new(gdouble, width/2 + 1);
+    b0 = HCP_RESONANCE_BANDS/2;
+    for (step = 0; step < HCP_RESONANCE_BANDS; step++)
+    {
+        /* Middle band, then alternately right and left of it. */
+        gint band = b0 + ((step & 1) ? -(step + 1)/2 : step/2);
+        gint start = band*(xres - width)/(HCP_RESONANCE_BANDS - 1);
+        gint next = band + ((band >= b0) ? -1 : 1);
+        gdouble contrast;
+        expected = (step && ok[next]) ? found[next] : fabs(xfreq)*xreal/xres;
+        memset(power, 0, (width/2 + 1)*sizeof(gdouble));
+        line_power_sum(data + start, width, yres, 1, rowstride, power);
+        ok[band] = line_peak(power, width, width, expected,
+                             &found[band], &contrast);
+        if (!ok[band])
+            found[band] = expected;
+        u[band] = (start + 0.5*width)/xres - 0.5;
+    }
+    g_free(power);
+    for (i = 0; i < HCP_RESONANCE_BANDS; i++)
+    {
+        if (!ok[i])
+            continue;
+        u[n] = u[i];
+        f[n] = found[i];
+        mean += f[n];
+        n++;
+    }
+    if (n < 4)
+        return FALSE;
+    mean /= n;
+    for (k = 1; k < HCP_RESONANCE_STEPS; k++)
+    {
+        gdouble s = k*G_PI/HCP_RESONANCE_STEPS, ak, bk;
+        gdouble chi2 = resonance_misfit(u, f, n, s, &ak, &bk);
+        if (chi2 < best)
+        {
+            best = chi2;
+            span = s;
+        }
+    }
+    /* Golden section between the neighbours of the best grid point. */
+    lo = MAX(span - G_PI/HCP_RESONANCE_STEPS, 1e-6);
+    hi = MIN(span + G_PI/HCP_RESONANCE_STEPS, G_PI);
+    for (k = 0; k < 60; k++)
+    {
+        gdouble m1 = hi - 0.618033988749895*(hi - lo);
+        gdouble m2 = lo + 0.618033988749895*(hi - lo);
+        if (resonance_misfit(u, f, n, m1, &a, &b)
+            < resonance_misfit(u, f, n, m2, &a, &b))
+            hi = m2;
+        else
+            lo = m1;
+    }
+    span = 0.5*(lo + hi);
+    best = resonance_misfit(u, f, n, span, &a, &b);
+    /* a cos(span u) + b sin(span u) = c cos(center + span u), whose mean
+     * over the image is c cos(center) sin(span/2)/(span/2). */
+    resonance->center = atan2(-b, a);
+    resonance->span = span;
+    resonance->xcorrection = hypot(a, b)*cos(resonance->center)
+                             * sin(0.5*span)/(0.5*span)
+                             / (fabs(xfreq)*xreal/xres);
+    resonance->residual = sqrt(best/n)/mean;
+    if (!(hypot(a, b) > 0.0)
+        || fabs(resonance->center) + 0.5*span >= 0.5*G_PI)
+        return FALSE;
+    resonance->nbands = n;
+    return TRUE;
+}
+
+gboolean
+hcp_field_resonance_fit(GwyDataField *dfield, gdouble xfreq,
+                        HcpResonance *resonance)
+{
+    gint xres = gwy_data_field_get_xres(dfield);
+    return hcp_resonance_fit(gwy_data_field_get_data_const(dfield),
+                             xres, gwy_data_field_get_yres(dfield), xres,
+                             gwy_data_field_get_xreal(dfield), xfreq,
+                             resonance);
+}
+
+struct _HcpStream {
+    gint xres;
+    gint yres;
+    gint block;
+    gdouble xreal;
+    gdouble yreal;
+    gint nrows;
+    gint pending;
+    gdouble *buffer;
+    gdouble *xpower;
+    gdouble *ypower;
+    HcpLineEstimate estimate;
+};
+
+/*
+ *  Incremental form of hcp_line_estimate() for images arriving line by
+ *  line.  Rows are collected into blocks of the given number of lines.
+ *  Each complete block adds its row spectra to the running x sum and the
+ *  spectra of its column segments to the running y sum (Welch's method,
+ *  so the y resolution is that of one block), and the estimate is
+ *  updated.  Nothing from earlier blocks is transformed again.
+ */
+HcpStream*
+hcp_stream_new(gint xres, gint yres, gdouble xreal, gdouble yreal,
+               gdouble lattice, gdouble angle, gint block)
+{
+    HcpStream *stream;
+    gdouble R;
+    g_return_val_if_fail(xres > 7 && yres > 7, NULL);
+    g_return_val_if_fail(xreal > 0.0 && yreal > 0.0 && lattice > 0.0, NULL);
+    stream = g_new0(HcpStream, 1);
+    stream->xres = xres;
+    stream->yres = yres;
+    stream->block = CLAMP(block, 8, yres);
+    stream->xreal = xreal;
+    stream->yreal = yreal;
+    stream->buffer = g_new(gdouble, stream->block*xres);
+    stream->xpower = g_new0(gdouble, xres/2 + 1);
+    stream->ypower = g_new0(gdouble, stream->block/2 + 1);
+    R = 2.0/(sqrt(3.0)*lattice);
+    stream->estimate.xexpected = R*ring_projection(angle, FALSE);
+    stream->estimate.yexpected = R*ring_projection(angle, TRUE);
+    stream->estimate.factors.Xwarning = TRUE;
+    stream->estimate.factors.Ywarning = TRUE;
+    return stream;
+}
+
+void
+hcp_stream_free(HcpStream *stream)
+{
+    if (!stream)
+        return;
+    g_free(stream->buffer);
+    g_free(stream->xpower);
+    g_free(stream->ypower);
+    g_free(stream);
+}
+
+static void
+stream_update(HcpStream *stream)
+{
+    HcpLineEstimate *estimate = &stream->estimate;
+    gint n = stream->block;
+    line_power_sum(stream->buffer, stream->xres, n, 1, stream->xres,
+                   stream->xpower);
+    line_power_sum(stream->buffer, n, stream->xres, stream->xres, 1,
+                   stream->ypower);
+    estimate->factors.Xwarning = !line_peak(stream->xpower, stream->xres,
+                                            stream->xreal,
+                                            estimate->xexpected,
+                                            &estimate->xfreq,
+                                            &estimate->xcontrast);
+    estimate->factors.Ywarning = !line_peak(stream->ypower, n,
+                                            stream->yreal*n/stream->yres,
+                                            estimate->yexpected,
+                                            &estimate->yfreq,
+                                            &estimate->ycontrast);
+    estimate->factors.Xscale = estimate->xfreq/estimate->xexpected;
+    estimate->factors.Yscale = estimate->yfreq/estimate->yexpected;
+}
+
+/*
+ *  Appends nrows rows, rowstride doubles apart.  Returns TRUE if this
+ *  completed at least one block, i.e. the estimate has changed.  Rows
+ *  past the height of the image are ignored.
+ */
+gboolean
+hcp_stream_add_rows(HcpStream *stream, const gdouble *rows, gint nrows,
+                    gint rowstride)
+{
+    gboolean updated = FALSE;
+    gint i;
+    g_return_val_if_fail(stream && (rows || !nrows), FALSE);
+    g_return_val_if_fail(rowstride >= stream->xres, FALSE);
+    nrows = MIN(nrows, stream->yres - stream->nrows);
+    for (i = 0; i < nrows; i++)
+    {
+        memcpy(stream->buffer + stream->pending*stream->xres,
+               rows + i*rowstride, stream->xres*sizeof(gdouble));
+        stream->nrows++;
+        if (++stream->pending == stream->block)
+        {
+            stream_update(stream);
+            stream->pending = 0;
+            updated = TRUE;
+        }
+    }
+    return updated;
+}
+
+gint
+hcp_stream_get_n_rows(HcpStream *stream)
+{
+    return stream->nrows;
+}
+
+/* The factors carry warnings until a block with clear peaks is in. */
+void
+hcp_stream_get_estimate(HcpStream *stream, HcpLineEstimate *estimate)
+{
+    *estimate = stream->estimate;
+}
+
+/*
+ *  Median difference between neighbour pixels along rows or columns.
+ *  Steps are a small fraction of the differences, so this is the slope
+ *  of the terraces, which a least squares plane through a staircase is
+ *  not.  They still pull the median a little towards their side, so it
+ *  is taken again without the differences half a step or more off.
+ *
+ *  Only the pixels on a regular grid of rows and columns are taken, so
+ *  that the scratch space and the two medians stay bounded by
+ *  HCP_STEP_SLOPE_SAMPLES whatever the image size.  Each difference spans
+ *  the grid spacing rather than one pixel, which keeps the slope about as
+ *  precise as from all the pixels.
+ */
+static gdouble
+median_slope(const gdouble *data, gint xres, gint yres, gint rowstride,
+             gboolean vertical, gdouble step)
+{
+    gint stride, gap, w, h, off, i, j, n = 0, k = 0;
+    gdouble m;
+    gdouble *d;
+    stride = MAX((gint)ceil(sqrt((gdouble)xres*yres/HCP_STEP_SLOPE_SAMPLES)),
+                 1);
+    gap = MIN(stride, (vertical ? yres : xres) - 1);
+    if (gap <= 0)
+        return 0.0;
+    w = vertical ? xres : xres - gap;
+    h = vertical ? yres - gap : yres;
+    off = vertical ? gap*rowstride : gap;
+    d = g_new(gdouble, ((w + stride - 1)/stride)*((h + stride - 1)/stride));
+    for (i = 0; i < h; i += stride)
+    {
+        const gdouble *row = data + i*rowstride;
+        for (j = 0; j < w; j += stride)
+            d[n++] = (row[j + off] - row[j])/gap;
+    }
+    m = gwy_math_median(n, d);
+    for (i = 0; i < n; i++)
+    {
+        if (fabs(d[i] - m) < 0.5*step/gap)
+            d[k++] = d[i];
+    }
+    if (k)
+        m = gwy_math_median(k, d);
+    g_free(d);
+    return m;
+}
+
+/*
+ *  Z calibration from the terraces of a stepped surface.  The image is
+ *  levelled by the median terrace slope.  One pass finds its range and a
+ *  second builds the histogram of heights, each thread filling its own.
+ *  Terrace levels are the local maxima of the smoothed histogram, refined
+ *  by a parabola through the logarithm (exact for Gaussian peaks).  Levels
+ *  are numbered in units of the smallest separation, or of the known step
+ *  if the smallest separation spans several, and the step is the least
+ *  squares slope of level against number.  Levels that are not a whole
+ *  number of units apart fail the calibration rather than being numbered
+ *  wrongly.
+ */
+gboolean
+hcp_step_height(const gdouble *data, gint xres, gint yres, gint rowstride,
+                gdouble known_step, HcpStepHeight *result)
+{
+    gdouble bx, by, zmin, zmax, lo, hi, w, *smooth, *levels;
+    gdouble s0, sm = 0.0, sl = 0.0, smm = 0.0, sml = 0.0, ss = 0.0, det;
+    gdouble norm = 0.0;
+    guint *counts;
+    gint nthreads, nbins, nlevels = 0, i, b, window;
+    gint *numbers;
+    g_return_val_if_fail(data && result, FALSE);
+    memset(result, 0, sizeof(HcpStepHeight));
+    result->Zscale = 1.0;
+    if (xres < 2 || yres < 2 || rowstride < xres || !(known_step > 0.0))
+        return FALSE;
+    zmin = G_MAXDOUBLE;
+    zmax = -G_MAXDOUBLE;
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(hcp_get_n_threads()) \
+            if (xres*yres > HCP_PARALLEL_MIN) \
+            reduction(min:zmin) reduction(max:zmax) schedule(static)
+#endif
+    for (i = 0; i < yres; i++)
+    {
+        const gdouble *row = data + i*rowstride;
+        gint j;
+        for (j = 0; j < xres; j++)
+        {
+            zmin = MIN(zmin, row[j]);
+            zmax = MAX(zmax, row[j]);
+        }
+    }
+    bx = median_slope(data, xres, yres, rowstride, FALSE, known_step);
+    by = median_slope(data, xres, yres, rowstride, TRUE, known_step);
+    lo = zmin - MAX(0.0, bx*(xres - 1)) - MAX(0.0, by*(yres - 1));
+    hi = zmax - MIN(0.0, bx*(xres - 1)) - MIN(0.0, by*(yres - 1));
+    w = known_step/HCP_STEP_BINS;
+    if ((hi - lo)/w >= HCP_STEP_MAX_BINS)
+        w = (hi - lo)/(HCP_STEP_MAX_BINS - 1);
+    nbins = (gint)((hi - lo)/w) + 1;
+    nthreads = hcp_get_n_threads();
+    counts = g_new0(guint, (gsize)nthreads*nbins);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads) if (xres*yres > HCP_PARALLEL_MIN)
+#endif
+    {
+        guint *mine = counts;
+        gint r;
+#ifdef _OPENMP
+        mine = counts + (gsize)omp_get_thread_num()*nbins;
+#pragma omp for schedule(static)
+#endif
+        for (r = 0; r < yres; r++)
+        {
+            const gdouble *row = data + r*rowstride;
+            gint j;
+            for (j = 0; j < xres; j++)
+            {
+                gint k = (gint)((row[j] - bx*j - by*r - lo)/w);
+                mine[CLAMP(k, 0, nbins - 1)]++;
+            }
+        }
+    }
+    for (i = 1; i < nthreads; i++)
+    {
+        for (b = 0; b < nbins; b++)
+            counts[b] += counts[(gsize)i*nbins + b];
+    }
+    for (i = -3; i <= 3; i++)
+        norm += exp(-i*i/4.5);
+    smooth = g_new0(gdouble, nbins);
+    for (b = 0; b < nbins; b++)
+    {
+        gint k;
+        for (k = -3; k <= 3; k++)
+        {
+            if (b + k >= 0 && b + k < nbins)
+                smooth[b] += counts[b + k]*exp(-k*k/4.5)/norm;
+        }
+    }
+    g_free(counts);
+    /* A quarter of the known step, in bins that may have been widened to
+     * keep their number bounded. */
+    window = MAX(GWY_ROUND(0.25*known_step/w), 1);
+    levels = g_new(gdouble, nbins/window + 2);
+    for (b = 1; b < nbins - 1; b++)
+    {
+        gdouble mass = 0.0, a, c;
+        gint k;
+        gboolean peak = TRUE;
+        for (k = MAX(b - window, 0); k <= MIN(b + window, nbins - 1); k++)
+        {
+            mass += smooth[k];
+            if (smooth[k] > smooth[b] || (smooth[k] == smooth[b] && k < b))
+                peak = FALSE;
+        }
+        if (!peak || mass < HCP_STEP_MIN_FRACTION*xres*yres
+            || !(smooth[b-1] > 0.0 && smooth[b+1] > 0.0))
+            continue;
+        a = log(smooth[b-1]) - 2.0*log(smooth[b]) + log(smooth[b+1]);
+        c = 0.5*(log(smooth[b-1]) - log(smooth[b+1]));
+        levels[nlevels++] = lo + w*(b + 0.5 + (a < 0.0 ? c/a : 0.0));
+    }
+    g_free(smooth);
+    result->nlevels = nlevels;
+    if (nlevels < 2)
+    {
+        g_free(levels);
+        return FALSE;
+    }
+    s0 = G_MAXDOUBLE;
+    for (i = 1; i < nlevels; i++)
+        s0 = MIN(s0, levels[i] - levels[i-1]);
+    if (GWY_ROUND(s0/known_step) > 1)
+        s0 /= GWY_ROUND(s0/known_step);
+    for (i = 1; i < nlevels && s0 >= HCP_STEP_MIN_UNIT*known_step; i++)
+    {
+        gdouble q = (levels[i] - levels[i-1])/s0;
+        if (fabs(q - GWY_ROUND(q)) > HCP_STEP_SPACING_TOL)
+            break;
+    }
+    if (i < nlevels)
+    {
+        result->warning = TRUE;
+        g_free(levels);
+        return FALSE;
+    }
+    numbers = g_new(gint, nlevels);
+    numbers[0] = 0;
+    for (i = 1; i < nlevels; i++)
+        numbers[i] = numbers[i-1]
+                     + MAX(GWY_ROUND((levels[i] - levels[i-1])/s0), 1);
+    for (i = 0; i < nlevels; i++)
+    {
+        sm += numbers[i];
+        sl += levels[i];
+        smm += numbers[i]*(gdouble)numbers[i];
+        sml += numbers[i]*levels[i];
+    }
+    det = nlevels*smm - sm*sm;
+    result->step = (nlevels*sml - sm*sl)/det;
+    for (i = 0; i < nlevels; i++)
+    {
+        gdouble r = levels[i] - (sl - result->step*sm)/nlevels
+                    - result->step*numbers[i];
+        ss += r*r;
+    }
+    if (nlevels > 2)
+        result->step_err = sqrt(ss/(nlevels - 2)*nlevels/det);
+    result->Zscale = known_step/result->step;
+    result->warning = (nlevels < 3);
+    g_free(numbers);
+    g_free(levels);
+    return result->step > 0.0;
+}
+
+gboolean
+hcp_field_step_height(GwyDataField *dfield, gdouble known_step,
+                      HcpStepHeight *result)
+{
+    gint xres;
+    g_return_val_if_fail(GWY_IS_DATA_FIELD(dfield), FALSE);
+    xres = gwy_data_field_get_xres(dfield);
+    return hcp_step_height(gwy_data_field_get_data_const(dfield),
+                           xres, gwy_data_field_get_yres(dfield), xres,
+                           known_step, result);
+}
+
+static const GwyWindowingType sweep_windows[] = {
+    GWY_WINDOWING_HANN, GWY_WINDOWING_HAMMING,
+    GWY_WINDOWING_BLACKMANN, GWY_WINDOWING_WELCH,
+};
+static const gint sweep_paddings[] = { 1, 2 };
+static const gdouble sweep_rois[] = { 1.0, 0.75 };
+static const gint sweep_radii[] = { 1, 2, 3, 4, 5 };
+
+enum {
+    SWEEP_NW = G_N_ELEMENTS(sweep_windows),
+    SWEEP_NP = G_N_ELEMENTS(sweep_paddings),
+    SWEEP_NROI = G_N_ELEMENTS(sweep_rois),
+    SWEEP_NR = G_N_ELEMENTS(sweep_radii),
+    SWEEP_NSPECTRA = SWEEP_NW*SWEEP_NP*SWEEP_NROI,
+    SWEEP_NPOINTS = SWEEP_NSPECTRA*SWEEP_NR,
+};
+
+/*
+ *  Spectrum of the centred roi fraction of dfield, zero padded to
+ *  padding times its size.
+ */
+static GwyDataField*
+sweep_spectrum(GwyDataField *dfield, HcpWorkspace *ws,
+               GwyWindowingType window, gint padding, gdouble roi)
+{
+    gint xres = gwy_data_field_get_xres(dfield);
+    gint yres = gwy_data_field_get_yres(dfield);
+    gint w = MAX(GWY_ROUND(roi*xres), 2);
+    gint h = MAX(GWY_ROUND(roi*yres), 2);
+    GwyDataField *spectrum;
+    spectrum = gwy_data_field_new(padding*w, padding*h,
+                                  padding*w*gwy_data_field_get_xmeasure(dfield),
+                                  padding*h*gwy_data_field_get_ymeasure(dfield),
+                                  FALSE);
+    gwy_data_field_copy_units(dfield, spectrum);
+    windowed_spectrum(ws, gwy_data_field_get_data_const(dfield)
+                          + (yres - h)/2*xres + (xres - w)/2,
+                      xres, w, h, window, spectrum);
+    return spectrum;
+}
+
+static void
+sweep_point_factors(GwyDataField *spectrum, const HcpPeak *seeds,
+                    gint radius, gdouble lattice, HcpFactors *factors)
+{
+    HcpPeak peaks[2];
+    gint xres = gwy_data_field_get_xres(spectrum);
+    gint yres = gwy_data_field_get_yres(spectrum);
+    gdouble dx = gwy_data_field_get_xmeasure(spectrum);
+    gdouble dy = gwy_data_field_get_ymeasure(spectrum);
+    gdouble xoff = gwy_data_field_get_xoffset(spectrum);
+    gdouble yoff = gwy_data_field_get_yoffset(spectrum);
+    gint k, col, row;
+    for (k = 0; k < 2; k++)
+    {
+        col = CLAMP((gint)((seeds[k].x - xoff)/dx), 0, xres - 1);
+        row = CLAMP((gint)((seeds[k].y - yoff)/dy), 0, yres - 1);
+        hcp_field_peak_find(spectrum, radius, &col, &row, &peaks[k].z);
+        peaks[k].x = col*dx + xoff;
+        peaks[k].y = row*dy + yoff;
+    }
+    hcp_get_factors(peaks, peaks + 1, lattice, factors);
+}
+
+static inline gboolean
+sweep_point_valid(const HcpSweepPoint *point)
+{
+    return !point->rejected
+           && !point->factors.Xwarning && !point->factors.Ywarning
+           && isfinite(point->factors.Xscale)
+           && isfinite(point->factors.Yscale);
+}
+
+/*
+ *  The deviation of a point is the RMS difference of its factors from
+ *  those of the points differing in exactly one parameter, i.e. how much
+ *  the result moves when any one setting is changed a little.
+ */
+static void
+sweep_statistics(HcpSweep *sweep)
+{
+    static const gint strides[4] = {
+        SWEEP_NP*SWEEP_NROI*SWEEP_NR, SWEEP_NROI*SWEEP_NR, SWEEP_NR, 1,
+    };
+    static const gint sizes[4] = { SWEEP_NW, SWEEP_NP, SWEEP_NROI, SWEEP_NR };
+    HcpSweepPoint *points = sweep->points;
+    gdouble sx = 0.0, sy = 0.0, sxx = 0.0, syy = 0.0, best = G_MAXDOUBLE;
+    gint n = 0, k, d;
+    for (k = 0; k < SWEEP_NPOINTS; k++)
+    {
+        if (!sweep_point_valid(points + k))
+            continue;
+        sx += points[k].factors.Xscale;
+        sy += points[k].factors.Yscale;
+        n++;
+    }
+    sweep->nvalid = n;
+    sweep->best = -1;
+    if (!n)
+        return;
+    sweep->Xmean = sx/n;
+    sweep->Ymean = sy/n;
+    for (k = 0; k < SWEEP_NPOINTS; k++)
+    {
+        gdouble dev = 0.0;
+        gint nn = 0;
+        if (!sweep_point_valid(points + k))
+            continue;
+        sxx += (points[k].factors.Xscale - sweep->Xmean)
+               * (points[k].factors.Xscale - sweep->Xmean);
+        syy += (points[k].factors.Yscale - sweep->Ymean)
+               * (points[k].factors.Yscale - sweep->Ymean);
+        for (d = 0; d < 4; d++)
+        {
+            gint idx = k/strides[d] % sizes[d], other;
+            for (other = 0; other < sizes[d]; other++)
+            {
+                const HcpSweepPoint *q = points + k
+                                         + (other - idx)*strides[d];
+                gdouble ddx, ddy;
+                if (other == idx || !sweep_point_valid(q))
+                    continue;
+                ddx = q->factors.Xscale - points[k].factors.Xscale;
+                ddy = q->factors.Yscale - points[k].factors.Yscale;
+                dev += ddx*ddx + ddy*ddy;
+                nn++;
+            }
+        }
+        points[k].deviation = nn ? sqrt(dev/nn) : G_MAXDOUBLE;
+        if (points[k].deviation < best)
+        {
+            best = points[k].deviation;
+            sweep->best = k;
+        }
+    }
+    sweep->Xrms = sqrt(sxx/n);
+    sweep->Yrms = sqrt(syy/n);
+}
+
+/*
+ *  Evaluates the factors over the grid of windows, paddings, regions and
+ *  search radii, starting from the given two peaks.  One spectrum is
+ *  computed per window, padding and region and shared by all radii.
+ */
+HcpSweep*
+hcp_sweep(GwyDataField *dfield, const HcpPeak *seeds, gdouble lattice)
+{
+    HcpSweep *sweep;
+    gint k;
+    g_return_val_if_fail(GWY_IS_DATA_FIELD(dfield) && seeds, NULL);
+    sweep = g_new0(HcpSweep, 1);
+    sweep->npoints = SWEEP_NPOINTS;
+    sweep->points = g_new0(HcpSweepPoint, SWEEP_NPOINTS);
+    for (k = 0; k < SWEEP_NPOINTS; k++)
+    {
+        HcpSweepPoint *point = sweep->points + k;
+        point->window = sweep_windows[k/(SWEEP_NP*SWEEP_NROI*SWEEP_NR)];
+        point->padding = sweep_paddings[k/(SWEEP_NROI*SWEEP_NR) % SWEEP_NP];
+        point->roi = sweep_rois[k/SWEEP_NR % SWEEP_NROI];
+        point->radius = sweep_radii[k % SWEEP_NR];
+    }
+#ifdef _OPENMP
+#pragma omp parallel num_threads(hcp_get_n_threads())
+#endif
+    {
+        HcpWorkspace *ws = hcp_workspace_new();
+        gint i, r;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (i = 0; i < SWEEP_NSPECTRA; i++)
+        {
+            HcpSweepPoint *first = sweep->points + i*SWEEP_NR;
+            GwyDataField *spectrum = sweep_spectrum(dfield, ws, first->window,
+                                                    first->padding,
+                                                    first->roi);
+            HcpQuality quality;
+            hcp_field_quality(spectrum, first->padding, &quality);
+            for (r = 0; r < SWEEP_NR; r++)
+            {
+                if (!quality.passed)
+                {
+                    first[r].rejected = TRUE;
+                    continue;
+                }
+                sweep_point_factors(spectrum, seeds,
+                                    first[r].radius*first[r].padding,
+                                    lattice, &first[r].factors);
+            }
+            g_object_unref(spectrum);
+        }
+        hcp_workspace_free(ws);
+    }
+    sweep_statistics(sweep);
+    return sweep;
+}
+
+void
+hcp_sweep_free(HcpSweep *sweep)
+{
+    if (!sweep)
+        return;
+    g_free(sweep->points);
+    g_free(sweep);
+}
+
+static GwyDataField*
+brick_spectrum_target(GwyBrick *brick)
+{
+    GwyDataField *target;
+    GwySIUnit *unit;
+    target = gwy_data_field_new(gwy_brick_get_xres(brick),
+                                gwy_brick_get_yres(brick),
+                                gwy_brick_get_xreal(brick),
+                                gwy_brick_get_yreal(brick), FALSE);
+    unit = gwy_si_unit_duplicate(gwy_brick_get_si_unit_x(brick));
+    gwy_data_field_set_si_unit_xy(target, unit);
+    g_object_unref(unit);
+    unit = gwy_si_unit_duplicate(gwy_brick_get_si_unit_w(brick));
+    gwy_data_field_set_si_unit_z(target, unit);
+    g_object_unref(unit);
+    return target;
+}
+
+/*
+ *  Spectrum of one level of the brick, or with a negative level the mean
+ *  of the spectra of all levels.  The levels are read in place.  Each
+ *  batch of levels is transformed in parallel and then added in level
+ *  order.
+ */
+GwyDataField*
+hcp_brick_spectrum(GwyBrick *brick, gint level, HcpWorkspace *ws)
+{
+    GwyDataField *result = NULL, *batch[HCP_BRICK_BATCH];
+    HcpWorkspace **wss, *tmp = NULL;
+    const gdouble *data;
+    gdouble *sum, *d;
+    gint xres, yres, zres, n, nthreads, first, l, k;
+    g_return_val_if_fail(GWY_IS_BRICK(brick), NULL);
+    xres = gwy_brick_get_xres(brick);
+    yres = gwy_brick_get_yres(brick);
+    zres = gwy_brick_get_zres(brick);
+    n = xres*yres;
+    data = gwy_brick_get_data_const(brick);
+    if (level >= 0 || zres == 1)
+    {
+        level = CLAMP(level, 0, zres - 1);
+        if (!ws)
+            ws = tmp = hcp_workspace_new();
+        result = brick_spectrum_target(brick);
+        windowed_spectrum(ws, data + level*n, xres, xres, yres,
+                          GWY_WINDOWING_HANN, result);
+        hcp_workspace_free(tmp);
+        return result;
+    }
+    nthreads = hcp_get_n_threads();
+    wss = g_new0(HcpWorkspace*, nthreads);
+    wss[0] = ws ? ws : (tmp = hcp_workspace_new());
+    sum = g_new0(gdouble, n);
+    for (first = 0; first < zres; first += HCP_BRICK_BATCH)
+    {
+        gint m = MIN(HCP_BRICK_BATCH, zres - first);
+#ifdef _OPENMP
+#pragma omp parallel private(l) num_threads(nthreads) if (m > 1)
+#endif
+        {
+            gint t = 0;
+#ifdef _OPENMP
+            t = omp_get_thread_num();
+#endif
+            if (!wss[t])
+                wss[t] = hcp_workspace_new();
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+            for (l = 0; l < m; l++)
+            {
+                batch[l] = brick_spectrum_target(brick);
+                windowed_spectrum(wss[t], data + (first + l)*n, xres,
+                                  xres, yres, GWY_WINDOWING_HANN, batch[l]);
+            }
+        }
+        for (l = 0; l < m; l++)
+        {
+            const gdouble *s = gwy_data_field_get_data_const(batch[l]);
+            for (k = 0; k < n; k++)
+                sum[k] += s[k];
+            if (!result)
+                result = batch[l];
+            else
+                g_object_unref(batch[l]);
+        }
+    }
+    d = gwy_data_field_get_data(result);
+    for (k = 0; k < n; k++)
+        d[k] = sum[k]/zres;
+    gwy_data_field_invalidate(result);
+    for (k = 1; k < nthreads; k++)
+        hcp_workspace_free(wss[k]);
+    hcp_workspace_free(tmp);
+    g_free(wss);
+    g_free(sum);
+    return result;
+}
+
+static void
+brick_copy_units(GwyBrick *source, GwyBrick *target)
+{
+    GwySIUnit *unit;
+    unit = gwy_si_unit_duplicate(gwy_brick_get_si_unit_x(source));
+    gwy_brick_set_si_unit_x(target, unit);
+    g_object_unref(unit);
+    unit = gwy_si_unit_duplicate(gwy_brick_get_si_unit_y(source));
+    gwy_brick_set_si_unit_y(target, unit);
+    g_object_unref(unit);
+    unit = gwy_si_unit_duplicate(gwy_brick_get_si_unit_z(source));
+    gwy_brick_set_si_unit_z(target, unit);
+    g_object_unref(unit);
+    unit = gwy_si_unit_duplicate(gwy_brick_get_si_unit_w(source));
+    gwy_brick_set_si_unit_w(target, unit);
+    g_object_unref(unit);
+}
+
+/*
+ *  Applies the XY correction to every level.  All levels share one row
+ *  weight table and are resampled in parallel; the z axis, including
+ *  any non-linear z calibration, is kept as it is.
+ */
+GwyBrick*
+hcp_brick_apply(GwyBrick *brick, const HcpFactors *factors,
+                GwyInterpolationType interp)
+{
+    ResampleRowsFunc func = find_resample_kernel(interp);
+    ResampleWeight *weights;
+    GwyDataLine *zcal;
+    GwyBrick *result;
+    const gdouble *src;
+    gdouble *dst;
+    gint xres, yres, zres, newyres, l;
+    g_return_val_if_fail(GWY_IS_BRICK(brick) && factors, NULL);
+    xres = gwy_brick_get_xres(brick);
+    yres = gwy_brick_get_yres(brick);
+    zres = gwy_brick_get_zres(brick);
+    newyres = hcp_calibrated_yres(yres, factors);
+    result = gwy_brick_new(xres, newyres, zres,
+                           gwy_brick_get_xreal(brick)*factors->Xscale,
+                           gwy_brick_get_yreal(brick)*factors->Yscale,
+                           gwy_brick_get_zreal(brick), FALSE);
+    brick_copy_units(brick, result);
+    gwy_brick_set_xoffset(result, gwy_brick_get_xoffset(brick));
+    gwy_brick_set_yoffset(result, gwy_brick_get_yoffset(brick));
+    gwy_brick_set_zoffset(result, gwy_brick_get_zoffset(brick));
+    if ((zcal = gwy_brick_get_zcalibration(brick)))
+    {
+        zcal = gwy_data_line_duplicate(zcal);
+        gwy_brick_set_zcalibration(result, zcal);
+        g_object_unref(zcal);
+    }
+    src = gwy_brick_get_data_const(brick);
+    dst = gwy_brick_get_data(result);
+    if (!func)
+    {
+        for (l = 0; l < zres; l++)
+        {
+            GwyDataField *plane, *resampled;
+            plane = field_from_buffer(src + l*xres*yres, xres, yres, xres,
+                                      xres, yres);
+            resampled = hcp_field_apply(plane, factors, interp);
+            memcpy(dst + l*xres*newyres,
+                   gwy_data_field_get_data_const(resampled),
+                   xres*newyres*sizeof(gdouble));
+            g_object_unref(resampled);
+            g_object_unref(plane);
+        }
+        return result;
+    }
+    weights = resample_weights(yres, newyres);
+#ifdef _OPENMP
+#pragma omp parallel for private(l) num_threads(hcp_get_n_threads()) \
+            if (zres > 1 && xres*newyres*zres > HCP_PARALLEL_MIN)
+#endif
+    for (l = 0; l < zres; l++)
+        func(src + l*xres*yres, xres, xres, weights,
+             dst + l*xres*newyres, newyres);
+    g_free(weights);
+    return result;
+}
+
+/*
+ *  Spreads the point values c at positions (u, v) in [0, 2pi) onto the
+ *  periodic mr x mr grid with a Gaussian of variance 2 tau.  Each grid
+ *  row gathers from the points whose kernel reaches it, taken in a fixed
+ *  order, so rows can be filled in parallel with identical results.
+ */
+static void
+nufft_spread(const gdouble *u, const gdouble *v, const gdouble *c, guint n,
+             gint mr, gdouble tau, gdouble *grid)
+{
+    enum { S = HCP_NUFFT_SPREAD };
+    gdouble h = 2.0*G_PI/mr, e3[2*S];
+    gdouble *ex0, *e2;
+    gint *start, *order, *ix0, *fill;
+    gint r, m;
+    guint k;
+    for (m = 1 - S; m <= S; m++)
+        e3[m + S - 1] = exp(-(m*h)*(m*h)/(4.0*tau));
+    ex0 = g_new(gdouble, n);
+    e2 = g_new(gdouble, n);
+    ix0 = g_new(gint, n);
+    order = g_new(gint, n);
+    start = g_new0(gint, mr + 1);
+    fill = g_new(gint, mr);
+    /* Sort the points into buckets by the grid row below them; the x
+     * kernel is factored as in fast Gaussian gridding so that each point
+     * needs only one exponential per row. */
+    for (k = 0; k < n; k++)
+    {
+        gint iy0 = MIN((gint)(v[k]/h), mr - 1);
+        gdouble fx;
+        ix0[k] = MIN((gint)(u[k]/h), mr - 1);
+        fx = u[k] - ix0[k]*h;
+        e2[k] = exp(fx*h/(2.0*tau));
+        ex0[k] = exp(-fx*fx/(4.0*tau))*pow(e2[k], 1 - S);
+        start[iy0 + 1]++;
+    }
+    for (r = 0; r < mr; r++)
+    {
+        start[r + 1] += start[r];
+        fill[r] = start[r];
+    }
+    for (k = 0; k < n; k++)
+        order[fill[MIN((gint)(v[k]/h), mr - 1)]++] = k;
+#ifdef _OPENMP
+#pragma omp parallel for private(r, m) num_threads(hcp_get_n_threads()) \
+            schedule(dynamic, 8) if (n > HCP_PARALLEL_MIN)
+#endif
+    for (r = 0; r < mr; r++)
+    {
+        gdouble *row = grid + r*mr;
+        gint l, q;
+        memset(row, 0, mr*sizeof(gdouble));
+        for (l = S; l > -S; l--)
+        {
+            gint b = ((r - l) % mr + mr) % mr;
+            for (q = start[b]; q < start[b + 1]; q++)
+            {
+                gint p = order[q];
+                gdouble dy = l*h - (v[p] - b*h);
+                gdouble w = c[p]*exp(-dy*dy/(4.0*tau))*ex0[p];
+                gint col = ix0[p] + 1 - S;
+                for (m = 0; m < 2*S; m++, col++)
+                {
+                    row[(col + mr) % mr] += w*e3[m];
+                    w *= e2[p];
+                }
+            }
+        }
+    }
+    g_free(ex0);
+    g_free(e2);
+    g_free(ix0);
+    g_free(order);
+    g_free(start);
+    g_free(fill);
+}
+
+/*
+ *  Divides the transform of the spread grid by that of the kernel and
+ *  keeps the res x res lowest frequencies, in the order of a raw FFT.
+ */
+static void
+nufft_deconvolve(const gdouble *re, const gdouble *im, gint mr, gint res,
+                 gdouble tau, gdouble *modulus)
+{
+    gint a, b;
+    for (a = 0; a < res; a++)
+    {
+        gint ky = (a < res/2) ? a : a - res;
+        gint gy = (ky + mr) % mr;
+        for (b = 0; b < res; b++)
+        {
+            gint kx = (b < res/2) ? b : b - res;
+            gint gx = (kx + mr) % mr;
+            modulus[a*res + b] = G_PI/tau*exp(tau*(kx*kx + ky*ky))
+                                 * hypot(re[gy*mr + gx], im[gy*mr + gx]);
+        }
+    }
+}
+
+/*
+ *  Spectrum of scattered XYZ data by a type 1 non-uniform FFT: the
+ *  points are spread onto an oversampled grid with a Gaussian kernel,
+ *  transformed, and the kernel is divided out again.  The points are
+ *  weighted by the inverse of their local density, so that unevenly
+ *  sampled scans (spirals, tip tracking) are not biased towards where
+ *  the tip lingered, then levelled and Hann windowed as for images.  A
+ *  res of zero picks a resolution matching the number of points.
+ */
+GwyDataField*
+hcp_surface_spectrum(GwySurface *surface, gint res, HcpWorkspace *ws)
+{
+    HcpWorkspace *tmp = NULL;
+    GwyDataField *target;
+    GwySIUnit *unit;
+    const GwyXYZ *xyz;
+    gdouble xmin, xmax, ymin, ymax, lx, ly, tau, avg = 0.0, wsum = 0.0;
+    gdouble *u, *v, *c;
+    gint *count;
+    gint mr;
+    guint n, k;
+    n = gwy_surface_get_npoints(surface);
+    g_return_val_if_fail(n > 1, NULL);
+    gwy_surface_get_xrange(surface, &xmin, &xmax);
+    gwy_surface_get_yrange(surface, &ymin, &ymax);
+    g_return_val_if_fail(xmax > xmin && ymax > ymin, NULL);
+    if (res <= 0)
+        res = CLAMP((gint)sqrt(n), 16, 2048);
+    res += res & 1;
+    mr = 2*res;
+    /* Extend the period by one mean spacing, as for a regular image. */
+    lx = (xmax - xmin)*(1.0 + 1.0/res);
+    ly = (ymax - ymin)*(1.0 + 1.0/res);
+    xyz = gwy_surface_get_data_const(surface);
+    u = g_new(gdouble, n);
+    v = g_new(gdouble, n);
+    c = g_new(gdouble, n);
+    count = g_new0(gint, res*res);
+    for (k = 0; k < n; k++)
+    {
+        u[k] = 2.0*G_PI*(xyz[k].x - xmin)/lx;
+        v[k] = 2.0*G_PI*(xyz[k].y - ymin)/ly;
+        count[MIN((gint)(u[k]/(2.0*G_PI)*res), res - 1)
+              + MIN((gint)(v[k]/(2.0*G_PI)*res), res - 1)*res]++;
+    }
+    for (k = 0; k < n; k++)
+    {
+        c[k] = 1.0/count[MIN((gint)(u[k]/(2.0*G_PI)*res), res - 1)
+                         + MIN((gint)(v[k]/(2.0*G_PI)*res), res - 1)*res];
+        avg += c[k]*xyz[k].z;
+        wsum += c[k];
+    }
+    avg /= wsum;
+    for (k = 0; k < n; k++)
+    {
+        gdouble tx = (xyz[k].x - xmin)/(xmax - xmin);
+        gdouble ty = (xyz[k].y - ymin)/(ymax - ymin);
+        c[k] *= (xyz[k].z - avg)*(0.5 - 0.5*cos(2.0*G_PI*tx))
+                * (0.5 - 0.5*cos(2.0*G_PI*ty));
+    }
+    g_free(count);
+    if (!ws)
+        ws = tmp = hcp_workspace_new();
+    workspace_ensure(ws, res, res, mr, mr, GWY_WINDOWING_NONE);
+    tau = G_PI*HCP_NUFFT_SPREAD/(res*res*3.0);
+    nufft_spread(u, v, c, n, mr, tau, gwy_data_field_get_data(ws->rin));
+    g_free(u);
+    g_free(v);
+    g_free(c);
+    gwy_data_field_invalidate(ws->rin);
+#ifdef _OPENMP
+#pragma omp critical (hcp_fft)
+#endif
+    gwy_data_field_2dfft_raw(ws->rin, NULL, ws->raout, ws->ipout,
+                             GWY_TRANSFORM_DIRECTION_FORWARD);
+    /* Other spectra rely on the grid being zero outside the data. */
+    gwy_data_field_clear(ws->rin);
+    target = gwy_data_field_new(res, res, lx, ly, FALSE);
+    unit = gwy_si_unit_duplicate(gwy_surface_get_si_unit_xy(surface));
+    gwy_data_field_set_si_unit_xy(target, unit);
+    g_object_unref(unit);
+    unit = gwy_si_unit_duplicate(gwy_surface_get_si_unit_z(surface));
+    gwy_data_field_set_si_unit_z(target, unit);
+    g_object_unref(unit);
+    nufft_deconvolve(gwy_data_field_get_data_const(ws->raout),
+                     gwy_data_field_get_data_const(ws->ipout), mr, res, tau,
+                     gwy_data_field_get_data(target));
+    hcp_workspace_free(tmp);
+    gwy_data_field_invalidate(target);
+    fft_postprocess(target);
+    return target;
+}
+
+/*
+ *  Scattered data need no resampling: the correction scales the point
+ *  coordinates about the corner of their bounding box, as the real size
+ *  of an image is scaled with its offset kept.
+ */
+GwySurface*
+hcp_surface_apply(GwySurface *surface, const HcpFactors *factors)
+{
+    GwySurface *result;
+    GwyXYZ *xyz;
+    gdouble xmin, xmax, ymin, ymax;
+    gint n, k;
+    g_return_val_if_fail(surface && factors, NULL);
+    gwy_surface_get_xrange(surface, &xmin, &xmax);
+    gwy_surface_get_yrange(surface, &ymin, &ymax);
+    result = gwy_surface_duplicate(surface);
+    xyz = gwy_surface_get_data(result);
+    n = gwy_surface_get_npoints(result);
+#ifdef _OPENMP
+#pragma omp parallel for private(k) num_threads(hcp_get_n_threads()) \
+            if (n > HCP_PARALLEL_MIN)
+#endif
+    for (k = 0; k < n; k++)
+    {
+        xyz[k].x = xmin + (xyz[k].x - xmin)*factors->Xscale;
+        xyz[k].y = ymin + (xyz[k].y - ymin)*factors->Yscale;
+    }
+    gwy_surface_invalidate(result);
+    return result;
+}
+
+/*
+ *  Progress of a batch is counted in tasks with atomic operations only, so
+ *  the GUI can poll it from another thread while the batch runs.
+ */
+gdouble
+hcp_progress_get_fraction(HcpProgress *progress)
+{
+    gint total = g_atomic_int_get(&progress->total);
+    return total ? (gdouble)g_atomic_int_get(&progress->done)/total : 0.0;
+}
+
+void
+hcp_progress_cancel(HcpProgress *progress)
+{
+    g_atomic_int_set(&progress->cancel, 1);
+}
+
+/*
+ *  Writes the GSF header, with the metadata as further key = value lines,
+ *  and the NUL padding to a multiple of four bytes the data start at.
+ *  Empty values are left out and of repeated keys the first one is kept.
+ */
+static FILE*
+gsf_open(const gchar *filename, gint xres, gint yres,
+         gdouble xreal, gdouble yreal, gdouble xoffset, gdouble yoffset,
+         const gchar *const *meta)
+{
+    static const gchar padding[4] = { 0, 0, 0, 0 };
+    static const gchar *const fixed[] = {
+        "XRes", "YRes", "XReal", "YReal", "XOffset", "YOffset",
+    };
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+    GString *header;
+    FILE *fh;
+    gboolean ok;
+    guint k;
+    gint i, j;
+    if (!(fh = g_fopen(filename, "wb")))
+        return NULL;
+    header = g_string_new("Gwyddion Simple Field 1.0\n");
+    g_string_append_printf(header, "XRes = %d\nYRes = %d\n", xres, yres);
+    g_string_append_printf(header, "XReal = %s\n",
+                           g_ascii_dtostr(buf, sizeof(buf), xreal));
+    g_string_append_printf(header, "YReal = %s\n",
+                           g_ascii_dtostr(buf, sizeof(buf), yreal));
+    g_string_append_printf(header, "XOffset = %s\n",
+                           g_ascii_dtostr(buf, sizeof(buf), xoffset));
+    g_string_append_printf(header, "YOffset = %s\n",
+                           g_ascii_dtostr(buf, sizeof(buf), yoffset));
+    for (i = 0; meta && meta[i] && meta[i+1]; i += 2)
+    {
+        gchar *value;
+        gboolean repeated = !*meta[i+1];
+        for (k = 0; k < G_N_ELEMENTS(fixed) && !repeated; k++)
+            repeated = !strcmp(meta[i], fixed[k]);
+        for (j = 0; j < i && !repeated; j += 2)
+            repeated = !strcmp(meta[i], meta[j]) && *meta[j+1];
+        if (repeated)
+            continue;
+        value = g_strdelimit(g_strdup(meta[i+1]), "\r\n", ' ');
+        g_string_append_printf(header, "%s = %s\n", meta[i], value);
+        g_free(value);
+    }
+    ok = (fwrite(header->str, 1, header->len, fh) == header->len
+          && fwrite(padding, 1, 4 - header->len % 4, fh)
+             == 4 - header->len % 4);
+    g_string_free(header, TRUE);
+    if (!ok)
+    {
+        fclose(fh);
+        return NULL;
+    }
+    return fh;
+}
+
+/*
+ *  Resamples rows into one block while the previous block is converted
+ *  to little endian floats and written, so the file is written at the
+ *  pace of the resampling.  Must be called from a single thread of a
+ *  parallel region, or a task, as it only queues tasks and waits for them.
+ */
+static gboolean
+gsf_write_rows(FILE *fh, const gdouble *src, gint xres, gint rowstride,
+               const ResampleWeight *weights, gint newyres,
+               ResampleRowsFunc func, HcpProgress *progress)
+{
+    gint rows = MAX(HCP_GSF_BLOCK_PIXELS/xres, 1);
+    gint nblocks = (newyres + rows - 1)/rows, nthreads = hcp_get_n_threads();
+    gdouble *blocks = g_new(gdouble, 2*rows*xres);
+    guint32 *out = g_new(guint32, rows*xres);
+    gboolean ok = TRUE;
+    gint b;
+    for (b = 0; b <= nblocks && ok; b++)
+    {
+        if (b < nblocks)
+        {
+            gint from = b*rows, n = MIN(rows, newyres - from);
+            gint step = MAX((n + nthreads - 1)/nthreads, 1), c;
+            gdouble *block = blocks + (b % 2)*rows*xres;
+            for (c = 0; c < n; c += step)
+            {
+#ifdef _OPENMP
+#pragma omp task firstprivate(c)
+#endif
+                func(src, rowstride, xres, weights + from + c,
+                     block + c*xres, MIN(step, n - c));
+            }
+        }
+        if (b > 0)
+        {
+#ifdef _OPENMP
+#pragma omp task shared(ok)
+#endif
+            {
+                gint n = MIN(rows, newyres - (b - 1)*rows), k;
+                const gdouble *block = blocks + ((b - 1) % 2)*rows*xres;
+                for (k = 0; k < n*xres; k++)
+                {
+                    gfloat v = block[k];
+                    memcpy(out + k, &v, sizeof(guint32));
+                    out[k] = GUINT32_TO_LE(out[k]);
+                }
+                if (fwrite(out, sizeof(guint32), n*xres, fh) != (gsize)n*xres)
+                    ok = FALSE;
+            }
+        }
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+        if (progress && g_atomic_int_get(&progress->cancel))
+            ok = FALSE;
+    }
+    g_free(out);
+    g_free(blocks);
+    return ok;
+}
+
+/*
+ *  Writes src resampled to newyres rows by func as a GSF file of the
+ *  calibrated geometry (source xreal, yreal, xoffset and yoffset).  The
+ *  units and the factors go first in the header, so they win over the
+ *  same keys in meta unless they are empty.  The file is written under a
+ *  .tmp name and renamed once closed, so an interrupted run never leaves
+ *  a truncated file under the final name; a failed one is removed.
+ */
+static gboolean
+gsf_write(const gchar *filename, const gdouble *src, gint xres,
+          gint rowstride, const ResampleWeight *weights, gint newyres,
+          ResampleRowsFunc func, const gdouble *geometry, const gchar *xyunit,
+          const gchar *zunit, const HcpFactors *factors,
+          const gchar *const *meta, HcpProgress *progress)
+{
+    const gchar **allmeta;
+    gchar xscale[G_ASCII_DTOSTR_BUF_SIZE], yscale[G_ASCII_DTOSTR_BUF_SIZE];
+    gchar *tmpname;
+    gint nmeta = 0, i;
+    gboolean ok;
+    FILE *fh;
+    while (meta && meta[nmeta])
+        nmeta++;
+    allmeta = g_new(const gchar*, nmeta + 9);
+    allmeta[0] = "XYUnits";
+    allmeta[1] = xyunit ? xyunit : "";
+    allmeta[2] = "ZUnits";
+    allmeta[3] = zunit ? zunit : "";
+    allmeta[4] = "XScalingFactor";
+    allmeta[5] = g_ascii_dtostr(xscale, sizeof(xscale), factors->Xscale);
+    allmeta[6] = "YScalingFactor";
+    allmeta[7] = g_ascii_dtostr(yscale, sizeof(yscale), factors->Yscale);
+    for (i = 0; i < nmeta; i++)
+        allmeta[8 + i] = meta[i];
+    allmeta[8 + nmeta] = NULL;
+    tmpname = g_strconcat(filename, ".tmp", NULL);
+    fh = gsf_open(tmpname, xres, newyres, geometry[0]*factors->Xscale,
+                  geometry[1]*factors->Yscale, geometry[2], geometry[3],
+                  allmeta);
+    g_free(allmeta);
+    if (!fh)
+    {
+        g_unlink(tmpname);
+        g_free(tmpname);
+        return FALSE;
+    }
+    ok = gsf_write_rows(fh, src, xres, rowstride, weights, newyres, func,
+                        progress);
+    if (fclose(fh) != 0)
+        ok = FALSE;
+    if (ok && g_rename(tmpname, filename) != 0)
+        ok = FALSE;
+    if (!ok)
+        g_unlink(tmpname);
+    g_free(tmpname);
+    return ok;
+}
+
+/*
+ *  Interpolations without a row kernel are resampled whole by Gwyddion
+ *  first and then written by blocks as they are.
+ */
+static gboolean
+field_write_gsf(GwyDataField *dfield, const HcpFactors *factors,
+                GwyInterpolationType interp, const gchar *filename,
+                const gchar *const *meta, HcpProgress *progress)
+{
+    ResampleRowsFunc func = find_resample_kernel(interp);
+    GwyDataField *source = dfield;
+    ResampleWeight *weights;
+    gdouble geometry[4];
+    gchar *xyunit, *zunit;
+    gint xres, yres, newyres, k;
+    gboolean ok;
+    xres = gwy_data_field_get_xres(dfield);
+    yres = gwy_data_field_get_yres(dfield);
+    newyres = hcp_calibrated_yres(yres, factors);
+    geometry[0] = gwy_data_field_get_xreal(dfield);
+    geometry[1] = gwy_data_field_get_yreal(dfield);
+    geometry[2] = gwy_data_field_get_xoffset(dfield);
+    geometry[3] = gwy_data_field_get_yoffset(dfield);
+    xyunit = gwy_si_unit_get_string(gwy_data_field_get_si_unit_xy(dfield),
+                                    GWY_SI_UNIT_FORMAT_PLAIN);
+    zunit = gwy_si_unit_get_string(gwy_data_field_get_si_unit_z(dfield),
+                                   GWY_SI_UNIT_FORMAT_PLAIN);
+    if (func)
+        weights = resample_weights(yres, newyres);
+    else
+    {
+        source = hcp_field_apply(dfield, factors, interp);
+        func = resample_rows_round;
+        weights = g_new(ResampleWeight, newyres);
+        for (k = 0; k < newyres; k++)
+        {
+            weights[k].i0 = weights[k].i1 = k;
+            weights[k].w = 0.0;
+        }
+    }
+    ok = gsf_write(filename, gwy_data_field_get_data_const(source), xres,
+                   xres, weights, newyres, func, geometry, xyunit, zunit,
+                   factors, meta, progress);
+    g_free(weights);
+    g_free(xyunit);
+    g_free(zunit);
+    if (source != dfield)
+        g_object_unref(source);
+    return ok;
+}
+
+/*
+ *  Writes the calibrated image straight to a Gwyddion Simple Field file
+ *  instead of creating a data field for it.  meta are further key, value
+ *  pairs for the header, ending with NULL.  A failed file is removed.
+ */
+gboolean
+hcp_field_write_gsf(GwyDataField *dfield, const HcpFactors *factors,
+                    GwyInterpolationType interp, const gchar *filename,
+                    const gchar *const *meta)
+{
+    gboolean ok = FALSE;
+    g_return_val_if_fail(GWY_IS_DATA_FIELD(dfield), FALSE);
+    g_return_val_if_fail(factors && filename, FALSE);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(hcp_get_n_threads())
+#pragma omp single
+#endif
+    ok = field_write_gsf(dfield, factors, interp, filename, meta, NULL);
+    return ok;
+}
+
+gboolean
+hcp_write_gsf(const gdouble *data, gint xres, gint yres, gint rowstride,
+              gdouble xreal, gdouble yreal, const HcpFactors *factors,
+              GwyInterpolationType interp, const gchar *filename,
+              const gchar *const *meta)
+{
+    ResampleRowsFunc func;
+    GwyDataField *dfield;
+    gboolean ok;
+    g_return_val_if_fail(data && factors && filename, FALSE);
+    g_return_val_if_fail(xres > 1 && yres > 1 && rowstride >= xres, FALSE);
+    g_return_val_if_fail(factors->Xscale > 0.0 && factors->Yscale > 0.0,
+                         FALSE);
+    if ((func = find_resample_kernel(interp)))
+    {
+        gdouble geometry[4] = { xreal, yreal, 0.0, 0.0 };
+        gint newyres = hcp_calibrated_yres(yres, factors);
+        ResampleWeight *weights = resample_weights(yres, newyres);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(hcp_get_n_threads())
+#pragma omp single
+#endif
+        ok = gsf_write(filename, data, xres, rowstride, weights, newyres,
+                       func, geometry, NULL, NULL, factors, meta, NULL);
+        g_free(weights);
+        return ok;
+    }
+    dfield = field_from_buffer(data, xres, yres, rowstride, xreal, yreal);
+    ok = hcp_field_write_gsf(dfield, factors, interp, filename, meta);
+    g_object_unref(dfield);
+    return ok;
+}
+
+/* Doubles are hashed little endian so that digests agree between
+ * machines. */
+static void
+checksum_doubles(GChecksum *checksum, const gdouble *values, gint n)
+{
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    g_checksum_update(checksum, (const guchar*)values, n*sizeof(gdouble));
+#else
+    guint64 buf[256];
+    gint i, k;
+    for (i = 0; i < n; i += k)
+    {
+        for (k = 0; k < (gint)G_N_ELEMENTS(buf) && i + k < n; k++)
+        {
+            memcpy(buf + k, values + i + k, sizeof(guint64));
+            buf[k] = GUINT64_TO_LE(buf[k]);
+        }
+        g_checksum_update(checksum, (const guchar*)buf, k*sizeof(guint64));
+    }
+#endif
+}
+
+/*
+ *  SHA-256 of an image, its size and the parameters that determine its
+ *  calibration, written as hex into digest of HCP_PROVENANCE_LENGTH
+ *  bytes.  The digest is tagged with HCP_PROVENANCE_TAG so that results
+ *  of an older version of the calibration never match.
+ */
+gboolean
+hcp_provenance(const gdouble *data, gint xres, gint yres, gint rowstride,
+               gdouble xreal, gdouble yreal, const gdouble *params,
+               gint nparams, gchar *digest)
+{
+    GChecksum *checksum;
+    gdouble geometry[4];
+    gint i;
+    g_return_val_if_fail(data && digest, FALSE);
+    g_return_val_if_fail(xres > 0 && yres > 0 && rowstride >= xres, FALSE);
+    g_return_val_if_fail(params || !nparams, FALSE);
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(checksum, (const guchar*)HCP_PROVENANCE_TAG,
+                      strlen(HCP_PROVENANCE_TAG));
+    geometry[0] = xres;
+    geometry[1] = yres;
+    geometry[2] = xreal;
+    geometry[3] = yreal;
+    checksum_doubles(checksum, geometry, 4);
+    if (nparams)
+        checksum_doubles(checksum, params, nparams);
+    for (i = 0; i < yres; i++)
+        checksum_doubles(checksum, data + (gsize)i*rowstride, xres);
+    g_strlcpy(digest, g_checksum_get_string(checksum),
+              HCP_PROVENANCE_LENGTH);
+    g_checksum_free(checksum);
+    return TRUE;
+}
+
+gboolean
+hcp_field_provenance(GwyDataField *dfield, const gdouble *params,
+                     gint nparams, gchar *digest)
+{
+    gint xres;
+    g_return_val_if_fail(GWY_IS_DATA_FIELD(dfield), FALSE);
+    xres = gwy_data_field_get_xres(dfield);
+    return hcp_provenance(gwy_data_field_get_data_const(dfield), xres,
+                          gwy_data_field_get_yres(dfield), xres,
+                          gwy_data_field_get_xreal(dfield),
+                          gwy_data_field_get_yreal(dfield),
+                          params, nparams, digest);
+}
+
+/*
+ *  The parameters of hcp_provenance() for a calibration: the settings in
+ *  a fixed order, then x and y of each seed peak (absolute spatial
+ *  frequencies).  Building them only here keeps the digest of the same
+ *  calibration equal whether it was run on one channel or on a series.
+ *  params must hold HCP_PROVENANCE_NSETTINGS + 2*nseeds values; returns
+ *  the number written.
+ */
+gint
+hcp_provenance_params(const HcpProvenanceSettings *settings,
+                      const gdouble *seeds, gint nseeds, gdouble *params)
+{
+    gint i;
+    g_return_val_if_fail(settings && params, 0);
+    g_return_val_if_fail(seeds || nseeds <= 0, 0);
+    params[0] = settings->Zscale;
+    params[1] = settings->interp;
+    params[2] = settings->lattice;
+    params[3] = settings->radius;
+    params[4] = settings->zoom;
+    params[5] = settings->level;
+    params[6] = settings->sweep_center;
+    params[7] = settings->sweep_span;
+    nseeds = MAX(nseeds, 0);
+    for (i = 0; i < 2*nseeds; i++)
+        params[HCP_PROVENANCE_NSETTINGS + i] = seeds[i];
+    return HCP_PROVENANCE_NSETTINGS + 2*nseeds;
+}
+
+static gint
+batch_blocks(GwyDataField *field)
+{
+    gint64 n = (gint64)gwy_data_field_get_xres(field)
+               * gwy_data_field_get_yres(field);
+    return (gint)MAX((n + HCP_TASK_PIXELS - 1)/HCP_TASK_PIXELS, 1);
+}
+
+/*
+ *  Computes the spectrum of an image and moves the seeds to the peaks of
+ *  it, refining each until it stops moving, then indexes them.  Peaks
+ *  are absolute spatial frequencies, as the seeds.  Returns the number of
+ *  seeds that fell in the spectrum.
+ */
+static gint
+refine_seeds(GwyDataField *field, HcpWorkspace *ws,
+             const HcpLatticePeak *seeds, gint nseeds, gint radius,
+             HcpLatticePeak *peaks)
+{
+    GwyDataField *spectrum = gwy_data_field_duplicate(field);
+    gdouble xoff, yoff;
+    gint xres, yres, i, k, n = 0;
+    hcp_field_spectrum(spectrum, ws);
+    xres = gwy_data_field_get_xres(spectrum);
+    yres = gwy_data_field_get_yres(spectrum);
+    xoff = gwy_data_field_get_xoffset(spectrum);
+    yoff = gwy_data_field_get_yoffset(spectrum);
+    for (i = 0; i < nseeds; i++)
+    {
+        gint col = gwy_data_field_rtoj(spectrum, seeds[i].x - xoff);
+        gint row = gwy_data_field_rtoi(spectrum, seeds[i].y - yoff);
+        gdouble z;
+        if (col < 0 || col >= xres || row < 0 || row >= yres)
+            continue;
+        for (k = 0; k < HCP_BATCH_REFINE; k++)
+        {
+            if (!hcp_field_peak_find(spectrum, radius, &col, &row, &z))
+                break;
+        }
+        peaks[n] = seeds[i];
+        peaks[n].x = gwy_data_field_jtor(spectrum, col) + xoff;
+        peaks[n].y = gwy_data_field_itor(spectrum, row) + yoff;
+        peaks[n].z = z;
+        n++;
+    }
+    hcp_index_peaks(peaks, n);
+    g_object_unref(spectrum);
+    return n;
+}
+
+/*
+ *  Spectrum of one image, the seed peaks refined on it until they stop
+ *  moving, and the factors fitted to them.
+ */
+static gboolean
+batch_fit(HcpBatchItem *item, HcpWorkspace *ws,
+          const HcpLatticePeak *seeds, gint nseeds, gint radius,
+          gdouble lattice)
+{
+    HcpLatticePeak *peaks = g_new(HcpLatticePeak, MAX(nseeds, 1));
+    gint n = refine_seeds(item->field, ws, seeds, nseeds, radius, peaks);
+    gboolean ok = hcp_fit_peaks(peaks, n, lattice, &item->factors);
+    g_free(peaks);
+    return ok;
+}
+
+/*
+ *  Refines the seeds in each image and fits them jointly.  The spectra
+ *  are computed as parallel tasks, each thread with its own workspace;
+ *  their transforms are still serialised by the critical section.
+ *  rotations, if not NULL, get one angle per image.
+ */
+gboolean
+hcp_field_fit_joint(GwyDataField **fields, gint nfields,
+                    const HcpLatticePeak *seeds, gint nseeds, gint radius,
+                    gdouble lattice, HcpJointFit *fit, gdouble *rotations)
+{
+    HcpLatticePeak *peaks;
+    HcpWorkspace **wss;
+    gint *npeaks, nthreads, i, total = 0;
+    gboolean ok;
+    g_return_val_if_fail(fields && seeds && fit, FALSE);
+    peaks = g_new(HcpLatticePeak, MAX(nfields*nseeds, 1));
+    npeaks = g_new(gint, MAX(nfields, 1));
+    nthreads = hcp_get_n_threads();
+    wss = g_new0(HcpWorkspace*, nthreads);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads) private(i)
+#pragma omp single
+#endif
+    for (i = 0; i < nfields; i++)
+    {
+#ifdef _OPENMP
+#pragma omp task firstprivate(i)
+#endif
+        {
+            gint t = 0;
+#ifdef _OPENMP
+            t = omp_get_thread_num();
+#endif
+            if (!wss[t])
+                wss[t] = hcp_workspace_new();
+            npeaks[i] = refine_seeds(fields[i], wss[t], seeds, nseeds,
+                                     radius, peaks + i*nseeds);
+        }
+    }
+    for (i = 0; i < nthreads; i++)
+        hcp_workspace_free(wss[i]);
+    g_free(wss);
+    /* Pack the images' peaks one after another. */
+    for (i = 0; i < nfields; i++)
+    {
+        memmove(peaks + total, peaks + i*nseeds,
+                npeaks[i]*sizeof(HcpLatticePeak));
+        total += npeaks[i];
+    }
+    ok = hcp_fit_joint(peaks, npeaks, nfields, lattice, fit, rotations);
+    g_free(npeaks);
+    g_free(peaks);
+    return ok;
+}
+
+/*
+ *  The task of one image.  Tasks are tied, so the workspace of the thread
+ *  stays its own while the fit uses it.
+ */
+static void
+batch_run_item(HcpBatchItem *item, HcpWorkspace *ws,
+               const HcpLatticePeak *seeds, gint nseeds, gint radius,
+               gdouble lattice, GwyInterpolationType interp,
+               ResampleRowsFunc func, HcpProgress *progress)
+{
+    gint nblocks = batch_blocks(item->field), xres, yres, newyres, rows, b;
+    const gdouble *src;
+    gdouble *dst;
+    GwyDataField *result;
+    ResampleWeight *weights;
+    if (g_atomic_int_get(&progress->cancel)
+        || !batch_fit(item, ws, seeds, nseeds, radius, lattice))
+    {
+        g_atomic_int_add(&progress->done, 1 + nblocks);
+        return;
+    }
+    if (item->fit_only)
+    {
+        g_atomic_int_add(&progress->done, 1 + nblocks);
+        g_atomic_int_set(&item->fitted, 1);
+        return;
+    }
+    g_atomic_int_set(&item->fitted, 1);
+    g_atomic_int_inc(&progress->done);
+    if (item->filename)
+    {
+        if (field_write_gsf(item->field, &item->factors, interp,
+                            item->filename, item->meta, progress))
+            g_atomic_int_set(&item->written, 1);
+        g_atomic_int_add(&progress->done, nblocks);
+        return;
+    }
+    if (!func)
+    {
+        g_atomic_int_add(&progress->done, nblocks);
+        g_atomic_pointer_set(&item->result,
+                             hcp_field_apply(item->field, &item->factors,
+                                             interp));
+        return;
+    }
+    xres = gwy_data_field_get_xres(item->field);
+    yres = gwy_data_field_get_yres(item->field);
+    newyres = hcp_calibrated_yres(yres, &item->factors);
+    result = gwy_data_field_new(xres, newyres,
+                                gwy_data_field_get_xreal(item->field)
+                                * item->factors.Xscale,
+                                gwy_data_field_get_yreal(item->field)
+                                * item->factors.Yscale, FALSE);
+    gwy_data_field_copy_units(item->field, result);
+    gwy_data_field_set_xoffset(result, gwy_data_field_get_xoffset(item->field));
+    gwy_data_field_set_yoffset(result, gwy_data_field_get_yoffset(item->field));
+    weights = resample_weights(yres, newyres);
+    src = gwy_data_field_get_data_const(item->field);
+    dst = gwy_data_field_get_data(result);
+    rows = (newyres + nblocks - 1)/nblocks;
+    for (b = 0; b < nblocks; b++)
+    {
+#ifdef _OPENMP
+#pragma omp task firstprivate(b)
+#endif
+        {
+            gint from = MIN(b*rows, newyres), to = MIN(from + rows, newyres);
+            if (!g_atomic_int_get(&progress->cancel) && to > from)
+                func(src, xres, xres, weights + from, dst + from*xres,
+                     to - from);
+            g_atomic_int_inc(&progress->done);
+        }
+    }
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+    g_free(weights);
+    if (g_atomic_int_get(&progress->cancel))
+        g_object_unref(result);
+    else
+        g_atomic_pointer_set(&item->result, result);
+}
+
+/*
+ *  Calibrates a series of images, e.g. repeated measurements, starting
+ *  from the peaks found on one of them.  Each image is a task computing
+ *  its spectrum and fit, which then queues its resampling as row block
+ *  tasks of HCP_TASK_PIXELS, so that a few large maps in a batch of small
+ *  scans are spread over all threads instead of holding up the one that
+ *  drew them.  Images are queued largest first and idle threads take
+ *  whatever task is queued next.  Setting progress->cancel stops the
+ *  batch before the next task; images not finished have no result.
+ *  Results are set atomically when complete, so other threads may take
+ *  them while the batch is still running.  Items with a file name are
+ *  streamed to it instead and flagged as written.  Returns the number of
+ *  images calibrated.
+ */
+gint
+hcp_batch_calibrate(HcpBatchItem *items, gint nitems,
+                    const HcpLatticePeak *seeds, gint nseeds, gint radius,
+                    gdouble lattice, GwyInterpolationType interp,
+                    HcpProgress *progress)
+{
+    ResampleRowsFunc func = find_resample_kernel(interp);
+    HcpProgress local = { 0, 0, 0 };
+    HcpWorkspace **wss;
+    gint *order, nthreads, ndone = 0, i, j, total = 0;
+    g_return_val_if_fail(items || !nitems, 0);
+    if (!progress)
+        progress = &local;
+    for (i = 0; i < nitems; i++)
+    {
+        items[i].result = NULL;
+        items[i].written = 0;
+        items[i].fitted = 0;
+        total += 1 + batch_blocks(items[i].field);
+    }
+    g_atomic_int_set(&progress->done, 0);
+    g_atomic_int_set(&progress->total, total);
+    order = g_new(gint, MAX(nitems, 1));
+    for (i = 0; i < nitems; i++)
+    {
+        gint64 n = (gint64)gwy_data_field_get_xres(items[i].field)
+                   * gwy_data_field_get_yres(items[i].field);
+        for (j = i; j > 0; j--)
+        {
+            const HcpBatchItem *prev = items + order[j-1];
+            if ((gint64)gwy_data_field_get_xres(prev->field)
+                * gwy_data_field_get_yres(prev->field) >= n)
+                break;
+            order[j] = order[j-1];
+        }
+        order[j] = i;
+    }
+    nthreads = hcp_get_n_threads();
+    wss = g_new0(HcpWorkspace*, nthreads);
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads) private(i)
+#pragma omp single
+#endif
+    for (i = 0; i < nitems; i++)
+    {
+        HcpBatchItem *item = items + order[i];
+#ifdef _OPENMP
+#pragma omp task firstprivate(item)
+#endif
+        {
+            gint t = 0;
+#ifdef _OPENMP
+            t = omp_get_thread_num();
+#endif
+            if (!wss[t])
+                wss[t] = hcp_workspace_new();
+            batch_run_item(item, wss[t], seeds, nseeds, radius, lattice,
+                           interp, func, progress);
+        }
+    }
+    for (i = 0; i < nthreads; i++)
+        hcp_workspace_free(wss[i]);
+    g_free(wss);
+    g_free(order);
+    for (i = 0; i < nitems; i++)
+        ndone += (items[i].result || items[i].written
+                  || (items[i].fit_only && items[i].fitted));
+    return ndone;
+}
+
+static GwyDataField*
+field_from_buffer(const gdouble *data, gint xres, gint yres, gint rowstride,
+                  gdouble xreal, gdouble yreal)
+{
+    GwyDataField *dfield;
+    gdouble *d;
+    gint i;
+    dfield = gwy_data_field_new(xres, yres, xreal, yreal, FALSE);
+    d = gwy_data_field_get_data(dfield);
+    for (i = 0; i < yres; i++)
+        memcpy(d + i*xres, data + i*rowstride, xres*sizeof(gdouble));
+    return dfield;
+}
+
+/*
+ *  The buffer entry points below mirror the hcp_field_* functions.  The
+ *  input is read in place through its row stride (in doubles) wherever
+ *  the core has its own kernel: the spectrum and linear or nearest row
+ *  resampling.  Fourier resampling and the other Gwyddion interpolations
+ *  still copy it into a data field first.  The output buffers are always
+ *  contiguous, xres doubles per row.
+ */
+gboolean
+hcp_spectrum(HcpWorkspace *ws,
+             const gdouble *data, gint xres, gint yres, gint rowstride,
+             gdouble xreal, gdouble yreal,
+             gdouble *spectrum, HcpSpectrumInfo *info)
+{
+    HcpWorkspace *tmp = NULL;
+    GwyDataField *dfield;
+    g_return_val_if_fail(data && spectrum, FALSE);
+    g_return_val_if_fail(xres > 1 && yres > 1 && rowstride >= xres, FALSE);
+    g_return_val_if_fail(xreal > 0.0 && yreal > 0.0, FALSE);
+    if (!ws)
+        ws = tmp = hcp_workspace_new();
+    dfield = gwy_data_field_new(xres, yres, xreal, yreal, FALSE);
+    windowed_spectrum(ws, data, rowstride, xres, yres, GWY_WINDOWING_HANN,
+                      dfield);
+    hcp_workspace_free(tmp);
+    memcpy(spectrum, gwy_data_field_get_data_const(dfield),
+           xres*yres*sizeof(gdouble));
+    if (info)
+    {
+        info->xoffset = gwy_data_field_get_xoffset(dfield);
+        info->yoffset = gwy_data_field_get_yoffset(dfield);
+        info->dx = gwy_data_field_get_xmeasure(dfield);
+        info->dy = gwy_data_field_get_ymeasure(dfield);
+    }
+    g_object_unref(dfield);
+    return TRUE;
+}
+
+gboolean
+hcp_peak_find(const gdouble *spectrum, gint xres, gint yres, gint rowstride,
+              const HcpSpectrumInfo *info, gint radius,
+              gdouble x, gdouble y, HcpPeak *peak)
+{
+    gint col, row;
+    g_return_val_if_fail(spectrum && info && peak, FALSE);
+    g_return_val_if_fail(xres > 1 && yres > 1 && rowstride >= xres, FALSE);
+    col = (gint)((x - info->xoffset)/info->dx);
+    row = (gint)((y - info->yoffset)/info->dy);
+    if (col < 0 || col >= xres || row < 0 || row >= yres)
+        return FALSE;
+    peak_search(spectrum, xres, yres, rowstride, radius, &col, &row, &peak->z);
+    peak->x = col*info->dx + info->xoffset;
+    peak->y = row*info->dy + info->yoffset;
+    return TRUE;
+}
+
+gboolean
+hcp_quality(const gdouble *spectrum, gint xres, gint yres, gint rowstride,
+            const HcpSpectrumInfo *info, gint padding, HcpQuality *quality)
+{
+    g_return_val_if_fail(spectrum && info && quality, FALSE);
+    g_return_val_if_fail(xres > 1 && yres > 1 && rowstride >= xres, FALSE);
+    g_return_val_if_fail(padding >= 1, FALSE);
+    spectrum_quality(spectrum, xres, yres, rowstride, info->dx, info->dy,
+                     padding, quality);
+    return TRUE;
+}
+
+gboolean
+hcp_apply(const gdouble *data, gint xres, gint yres, gint rowstride,
+          const HcpFactors *factors, GwyInterpolationType interp,
+          gdouble *out)
+{
+    ResampleRowsFunc func = find_resample_kernel(interp);
+    GwyDataField *dfield, *result;
+    gint newyres;
+    g_return_val_if_fail(data && factors && out, FALSE);
+    g_return_val_if_fail(xres > 1 && yres > 1 && rowstride >= xres, FALSE);
+    g_return_val_if_fail(factors->Xscale > 0.0 && factors->Yscale > 0.0,
+                         FALSE);
+    newyres = hcp_calibrated_yres(yres, factors);
+    if (func)
+    {
+        ResampleWeight *weights = resample_weights(yres, newyres);
+        func(data, rowstride, xres, weights, out, newyres);
+        g_free(weights);
+        return TRUE;
+    }
+    dfield = field_from_buffer(data, xres, yres, rowstride, xres, yres);
+    result = hcp_field_apply(dfield, factors, interp);
+    memcpy(out, gwy_data_field_get_data_const(result),
+           xres*newyres*sizeof(gdouble));
+    g_object_unref(result);
+    g_object_unref(dfield);
+    return TRUE;
+}
+
+gboolean
+hcp_apply_resonant(const gdouble *data, gint xres, gint yres, gint rowstride,
+                   const HcpFactors *factors, const HcpResonance *resonance,
+                   GwyInterpolationType interp, gdouble *out)
+{
+    ResampleWeight *columns, *weights;
+    GwyDataField *dfield, *result;
+    gint newyres;
+    g_return_val_if_fail(data && factors && resonance && out, FALSE);
+    g_return_val_if_fail(xres > 1 && yres > 1 && rowstride >= xres, FALSE);
+    g_return_val_if_fail(factors->Xscale > 0.0 && factors->Yscale > 0.0,
+                         FALSE);
+    newyres = hcp_calibrated_yres(yres, factors);
+    if (interp == GWY_INTERPOLATION_LINEAR)
+    {
+        columns = resonance_weights(xres, resonance);
+        weights = resample_weights(yres, newyres);
+        resample_remap_linear(data, rowstride, xres, weights, columns,
+                              out, newyres);
+        g_free(weights);
+        g_free(columns);
+        return TRUE;
+    }
+    dfield = field_from_buffer(data, xres, yres, rowstride, xres, yres);
+    result = hcp_field_apply_resonant(dfield, factors, resonance, interp);
+    memcpy(out, gwy_data_field_get_data_const(result),
+           xres*newyres*sizeof(gdouble));
+    g_object_unref(result);
+    g_object_unref(dfield);
+    return TRUE;
+}
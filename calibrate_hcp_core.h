@@ -0,0 +1,508 @@
+/*
+ *  @(#) $Id: calibrate_hcp_core.h 2014-05-08 $
+ *  Copyright (C) 2014 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ *  Headless calibration core: spectrum, peak detection, factor fit
+ *  and application, with no dependence on the dialog or the data
+ *  browser.  The hcp_field_* functions work on data fields and are
+ *  used by the module itself; the plain buffer functions take row
+ *  strided double arrays so that external callers (the Python
+ *  wrapper) can pass their memory in without copying it.
+ */
+
+#ifndef __CALIBRATE_HCP_CORE_H__
+#define __CALIBRATE_HCP_CORE_H__
+
+#include <glib.h>
+#include <libprocess/datafield.h>
+#include <libprocess/brick.h>
+#include <libprocess/surface.h>
+
+G_BEGIN_DECLS
+
+typedef struct {
+    gdouble x;
+    gdouble y;
+    gdouble z;
+} HcpPeak;
+
+typedef struct {
+    gdouble Xscale;
+    gdouble Yscale;
+    gboolean Xwarning;
+    gboolean Ywarning;
+} HcpFactors;
+
+/* Geometry of a humanized spectrum, i.e. the frequency of pixel (0, 0)
+ * and the frequency step between pixels. */
+typedef struct {
+    gdouble xoffset;
+    gdouble yoffset;
+    gdouble dx;
+    gdouble dy;
+} HcpSpectrumInfo;
+
+/* Scratch fields and window tables kept between spectra of the same
+ * size.  NULL can be passed wherever a workspace is taken. */
+typedef struct _HcpWorkspace HcpWorkspace;
+
+void        hcp_set_n_threads      (gint n);
+gint        hcp_get_n_threads      (void);
+
+HcpWorkspace* hcp_workspace_new    (void);
+void        hcp_workspace_free     (HcpWorkspace *ws);
+
+void        hcp_field_spectrum     (GwyDataField *dfield,
+                                    HcpWorkspace *ws);
+gboolean    hcp_field_peak_find    (GwyDataField *spectrum,
+                                    gint radius,
+                                    gint *col,
+                                    gint *row,
+                                    gdouble *value);
+void        hcp_get_factors        (const HcpPeak *p1,
+                                    const HcpPeak *p2,
+                                    gdouble lattice,
+                                    HcpFactors *factors);
+/* Mean and rms of the source of a clamped copy, and the range of the
+ * result. */
+typedef struct {
+    gdouble avg;
+    gdouble rms;
+    gdouble min;
+    gdouble max;
+} HcpRangeStats;
+
+void        hcp_clamp_copy         (const gdouble *src,
+                                    gint n,
+                                    gdouble lower,
+                                    gdouble upper,
+                                    gdouble *dst,
+                                    HcpRangeStats *stats);
+
+/* An entry of the peak table.  Positions are spatial frequencies, the
+ * SNR is relative to the mean and rms of the spectrum and the residual
+ * is the distance from the ring of (h, k) after the correction. */
+typedef struct {
+    gdouble x;
+    gdouble y;
+    gdouble z;
+    gint h;
+    gint k;
+    gdouble snr;
+    gdouble residual;
+} HcpLatticePeak;
+
+gint        hcp_field_detect_peaks (GwyDataField *spectrum,
+                                    gint radius,
+                                    gint maxpeaks,
+                                    HcpLatticePeak *peaks);
+gint        hcp_index_peaks        (HcpLatticePeak *peaks,
+                                    gint npeaks);
+gboolean    hcp_fit_peaks          (HcpLatticePeak *peaks,
+                                    gint npeaks,
+                                    gdouble lattice,
+                                    HcpFactors *factors);
+
+/* Sums of the normal equations of hcp_fit_peaks(); a peak can be taken
+ * out and put back moved, so the fit follows a dragged peak in constant
+ * time. */
+typedef struct {
+    gdouble sxx;
+    gdouble sxy;
+    gdouble syy;
+    gdouble bx;
+    gdouble by;
+    gint count;
+} HcpFitSums;
+
+void        hcp_fit_sums_add       (HcpFitSums *sums,
+                                    const HcpLatticePeak *peak,
+                                    gdouble lattice,
+                                    gint sign);
+gboolean    hcp_fit_sums_solve     (const HcpFitSums *sums,
+                                    HcpFactors *factors);
+gdouble     hcp_fit_residual       (const HcpLatticePeak *peak,
+                                    const HcpFactors *factors,
+                                    gdouble lattice);
+gboolean    hcp_predict_basis      (const HcpLatticePeak *peaks,
+                                    gint npeaks,
+                                    gdouble lattice,
+                                    const HcpFactors *factors,
+                                    gdouble *basis);
+
+/* Factors shared by several images, with their standard errors.  The
+ * shear is the sine of the angle by which the corrected axes depart from
+ * square; it is measured, not corrected.  Its error is NaN when the peaks
+ * lie in too few directions to determine it and it was not fitted. */
+typedef struct {
+    HcpFactors factors;
+    gdouble Xscale_err;
+    gdouble Yscale_err;
+    gdouble shear;
+    gdouble shear_err;
+    gint npeaks;
+} HcpJointFit;
+
+gboolean    hcp_fit_joint          (HcpLatticePeak *peaks,
+                                    const gint *npeaks,
+                                    gint nimages,
+                                    gdouble lattice,
+                                    HcpJointFit *fit,
+                                    gdouble *rotations);
+gboolean    hcp_field_fit_joint    (GwyDataField **fields,
+                                    gint nfields,
+                                    const HcpLatticePeak *seeds,
+                                    gint nseeds,
+                                    gint radius,
+                                    gdouble lattice,
+                                    HcpJointFit *fit,
+                                    gdouble *rotations);
+
+/* Lattice measured with known factors.  Lengths are in real units,
+ * angles in radians, errors are standard deviations. */
+typedef struct {
+    gdouble lattice;
+    gdouble lattice_err;
+    gdouble a1;
+    gdouble a2;
+    gdouble angle;
+    gdouble angle_err;
+    gdouble shear;
+    gdouble shear_err;
+} HcpLattice;
+
+gboolean    hcp_measure_lattice    (const HcpPeak *p1,
+                                    const HcpPeak *p2,
+                                    const HcpFactors *factors,
+                                    gdouble dx,
+                                    gdouble dy,
+                                    HcpLattice *lattice);
+/* Band limited resampling through the spectra of the columns, taken
+ * wherever an interpolation type is. */
+#define HCP_INTERPOLATION_FOURIER ((GwyInterpolationType)1024)
+
+gint        hcp_calibrated_yres    (gint yres,
+                                    const HcpFactors *factors);
+GwyDataField* hcp_field_apply      (GwyDataField *dfield,
+                                    const HcpFactors *factors,
+                                    GwyInterpolationType interp);
+GwyDataField* hcp_field_downsample (GwyDataField *dfield,
+                                    gint maxres);
+GwyDataField* hcp_field_downsample_max(GwyDataField *dfield,
+                                    gint maxres);
+
+/* Volume data share one XY geometry over all levels.  A negative level
+ * averages the spectra of all levels. */
+GwyDataField* hcp_brick_spectrum   (GwyBrick *brick,
+                                    gint level,
+                                    HcpWorkspace *ws);
+GwyBrick*   hcp_brick_apply        (GwyBrick *brick,
+                                    const HcpFactors *factors,
+                                    GwyInterpolationType interp);
+
+/* Scattered XYZ data are transformed without regridding; the spectrum
+ * is res x res, or sized from the number of points if res is zero. */
+GwyDataField* hcp_surface_spectrum (GwySurface *surface,
+                                    gint res,
+                                    HcpWorkspace *ws);
+GwySurface* hcp_surface_apply      (GwySurface *surface,
+                                    const HcpFactors *factors);
+
+/* How clearly a spectrum shows a hexagonal lattice, measured on its
+ * strongest ring above the 1/f background.  The radius is a spatial
+ * frequency.  Padding is the factor the data were zero padded by before
+ * the transform; it scales the excluded low frequency region. */
+typedef struct {
+    gdouble radius;
+    gdouble peak_to_background;
+    gdouble sharpness;
+    gdouble sixfold;
+    gdouble score;
+    gboolean passed;
+} HcpQuality;
+
+void        hcp_field_quality      (GwyDataField *spectrum,
+                                    gint padding,
+                                    HcpQuality *quality);
+
+/* Calibration from averaged 1D spectra of rows and columns.  The
+ * expected frequencies are where the first ring projects onto each
+ * axis; the measured ones are the peaks found near them. */
+typedef struct {
+    gdouble xexpected;
+    gdouble yexpected;
+    gdouble xfreq;
+    gdouble yfreq;
+    gdouble xcontrast;
+    gdouble ycontrast;
+    HcpFactors factors;
+} HcpLineEstimate;
+
+gboolean    hcp_field_line_estimate(GwyDataField *dfield,
+                                    gdouble lattice,
+                                    gdouble angle,
+                                    gint step,
+                                    HcpLineEstimate *estimate);
+
+/* Sweep of a resonant fast axis.  The tip follows a sine in time and the
+ * pixels are equally spaced in time, so column j is taken at the phase
+ * center + span*((j + 0.5)/xres - 0.5) and the tip is at its sine.
+ * Linearising moves x frequencies of the spectrum by xcorrection, the mean
+ * local frequency over the one the fit was seeded with, so peak x must be
+ * multiplied by it before the factors are fitted.  The residual is the rms
+ * relative misfit of the local x frequencies of the nbands column bands
+ * used; nbands is zero when the fit failed or the image is too narrow. */
+typedef struct {
+    gdouble center;
+    gdouble span;
+    gdouble xcorrection;
+    gdouble residual;
+    gint nbands;
+} HcpResonance;
+
+gboolean    hcp_field_resonance_fit(GwyDataField *dfield,
+                                    gdouble xfreq,
+                                    HcpResonance *resonance);
+GwyDataField* hcp_field_apply_resonant(GwyDataField *dfield,
+                                    const HcpFactors *factors,
+                                    const HcpResonance *resonance,
+                                    GwyInterpolationType interp);
+
+/* Terrace step height of a stepped surface in the units of the data, and
+ * the Z factor making it the known step.  When levels were found but are
+ * not evenly spaced, the step is zero and nlevels tells how many. */
+typedef struct {
+    gdouble step;
+    gdouble step_err;
+    gint nlevels;
+    gdouble Zscale;
+    gboolean warning;
+} HcpStepHeight;
+
+gboolean    hcp_field_step_height  (GwyDataField *dfield,
+                                    gdouble known_step,
+                                    HcpStepHeight *result);
+
+/* A batch of images calibrated from the same seed peaks.  The progress
+ * is in tasks; zero it before use and read it with the functions below
+ * from any thread. */
+typedef struct {
+    gint cancel;
+    gint done;
+    gint total;
+} HcpProgress;
+
+/* An item with a file name is written there as GSF, with meta (key, value
+ * pairs ending with NULL) in the header, and gets no result.  A fit only
+ * item is not resampled.  fitted is set once the factors are known. */
+typedef struct {
+    GwyDataField *field;
+    HcpFactors factors;
+    GwyDataField *result;
+    const gchar *filename;
+    const gchar *const *meta;
+    gint written;
+    gboolean fit_only;
+    gint fitted;
+} HcpBatchItem;
+
+gint        hcp_batch_calibrate    (HcpBatchItem *items,
+                                    gint nitems,
+                                    const HcpLatticePeak *seeds,
+                                    gint nseeds,
+                                    gint radius,
+                                    gdouble lattice,
+                                    GwyInterpolationType interp,
+                                    HcpProgress *progress);
+gdouble     hcp_progress_get_fraction(HcpProgress *progress);
+void        hcp_progress_cancel    (HcpProgress *progress);
+
+gboolean    hcp_field_write_gsf    (GwyDataField *dfield,
+                                    const HcpFactors *factors,
+                                    GwyInterpolationType interp,
+                                    const gchar *filename,
+                                    const gchar *const *meta);
+
+/* Digest of an image and the parameters of its calibration, recorded in
+ * the output so that repeated runs can tell what is already done. */
+#define HCP_PROVENANCE_TAG "calibrate_hcp/2"
+#define HCP_PROVENANCE_LENGTH 65
+
+/* The settings of a calibration that its provenance covers besides the
+ * seed peaks.  The radius is in spectrum pixels, interp is zero for a
+ * calibration in place and the sweep is zero unless it is linearised. */
+typedef struct {
+    gdouble Zscale;
+    gint interp;
+    gdouble lattice;
+    gint radius;
+    gint zoom;
+    gint level;
+    gdouble sweep_center;
+    gdouble sweep_span;
+} HcpProvenanceSettings;
+
+/* Parameters hcp_provenance_params() writes ahead of the seeds. */
+#define HCP_PROVENANCE_NSETTINGS 8
+
+gint        hcp_provenance_params  (const HcpProvenanceSettings *settings,
+                                    const gdouble *seeds,
+                                    gint nseeds,
+                                    gdouble *params);
+
+gboolean    hcp_field_provenance   (GwyDataField *dfield,
+                                    const gdouble *params,
+                                    gint nparams,
+                                    gchar *digest);
+
+/* Running line spectra of an image that is still being acquired. */
+typedef struct _HcpStream HcpStream;
+
+HcpStream*  hcp_stream_new         (gint xres,
+                                    gint yres,
+                                    gdouble xreal,
+                                    gdouble yreal,
+                                    gdouble lattice,
+                                    gdouble angle,
+                                    gint block);
+void        hcp_stream_free        (HcpStream *stream);
+gboolean    hcp_stream_add_rows    (HcpStream *stream,
+                                    const gdouble *rows,
+                                    gint nrows,
+                                    gint rowstride);
+gint        hcp_stream_get_n_rows  (HcpStream *stream);
+void        hcp_stream_get_estimate(HcpStream *stream,
+                                    HcpLineEstimate *estimate);
+
+/* One setting of the parameter sweep.  The radius is in pixels of the
+ * unpadded spectrum. */
+typedef struct {
+    GwyWindowingType window;
+    gint padding;
+    gdouble roi;
+    gint radius;
+    HcpFactors factors;
+    gdouble deviation;
+    gboolean rejected;
+} HcpSweepPoint;
+
+typedef struct {
+    HcpSweepPoint *points;
+    gint npoints;
+    gint nvalid;
+    gdouble Xmean;
+    gdouble Xrms;
+    gdouble Ymean;
+    gdouble Yrms;
+    gint best;
+} HcpSweep;
+
+HcpSweep*   hcp_sweep              (GwyDataField *dfield,
+                                    const HcpPeak *seeds,
+                                    gdouble lattice);
+void        hcp_sweep_free         (HcpSweep *sweep);
+
+gboolean    hcp_spectrum           (HcpWorkspace *ws,
+                                    const gdouble *data,
+                                    gint xres,
+                                    gint yres,
+                                    gint rowstride,
+                                    gdouble xreal,
+                                    gdouble yreal,
+                                    gdouble *spectrum,
+                                    HcpSpectrumInfo *info);
+gboolean    hcp_peak_find          (const gdouble *spectrum,
+                                    gint xres,
+                                    gint yres,
+                                    gint rowstride,
+                                    const HcpSpectrumInfo *info,
+                                    gint radius,
+                                    gdouble x,
+                                    gdouble y,
+                                    HcpPeak *peak);
+gboolean    hcp_quality            (const gdouble *spectrum,
+                                    gint xres,
+                                    gint yres,
+                                    gint rowstride,
+                                    const HcpSpectrumInfo *info,
+                                    gint padding,
+                                    HcpQuality *quality);
+gboolean    hcp_line_estimate      (const gdouble *data,
+                                    gint xres,
+                                    gint yres,
+                                    gint rowstride,
+                                    gdouble xreal,
+                                    gdouble yreal,
+                                    gdouble lattice,
+                                    gdouble angle,
+                                    gint step,
+                                    HcpLineEstimate *estimate);
+gboolean    hcp_resonance_fit      (const gdouble *data,
+                                    gint xres,
+                                    gint yres,
+                                    gint rowstride,
+                                    gdouble xreal,
+                                    gdouble xfreq,
+                                    HcpResonance *resonance);
+gboolean    hcp_step_height        (const gdouble *data,
+                                    gint xres,
+                                    gint yres,
+                                    gint rowstride,
+                                    gdouble known_step,
+                                    HcpStepHeight *result);
+gboolean    hcp_write_gsf          (const gdouble *data,
+                                    gint xres,
+                                    gint yres,
+                                    gint rowstride,
+                                    gdouble xreal,
+                                    gdouble yreal,
+                                    const HcpFactors *factors,
+                                    GwyInterpolationType interp,
+                                    const gchar *filename,
+                                    const gchar *const *meta);
+gboolean    hcp_provenance         (const gdouble *data,
+                                    gint xres,
+                                    gint yres,
+                                    gint rowstride,
+                                    gdouble xreal,
+                                    gdouble yreal,
+                                    const gdouble *params,
+                                    gint nparams,
+                                    gchar *digest);
+gboolean    hcp_apply              (const gdouble *data,
+                                    gint xres,
+                                    gint yres,
+                                    gint rowstride,
+                                    const HcpFactors *factors,
+                                    GwyInterpolationType interp,
+                                    gdouble *out);
+gboolean    hcp_apply_resonant     (const gdouble *data,
+                                    gint xres,
+                                    gint yres,
+                                    gint rowstride,
+                                    const HcpFactors *factors,
+                                    const HcpResonance *resonance,
+                                    GwyInterpolationType interp,
+                                    gdouble *out);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,505 @@
+#  Copyright (C) 2014 Jeffrey J. Schwartz.
+#  E-mail: schwartz@physics.ucla.edu
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+
+"""NumPy interface to the calibrate_hcp headless core.
+
+The functions call straight into the installed Gwyddion module, so the
+results are the same as in the dialog.  Any 2D float64 array whose rows
+are contiguous is accepted whatever its row stride; other arrays are
+converted first.  spectrum() and apply() with linear or nearest
+interpolation read it in place, the rest copy it inside the module.
+
+    spec, info = spectrum(image, xreal, yreal)
+    p1 = detect(spec, info, x1, y1)
+    p2 = detect(spec, info, x2, y2)
+    factors = fit(p1, p2, lattice)
+    calibrated, real = apply(image, xreal, yreal, factors)
+
+A long running process calibrating many frames of one size should keep
+a Workspace and pass it to spectrum(); the window tables and transform
+fields are then set up only once.
+
+Set CALIBRATE_HCP_LIBRARY to the path of calibrate_hcp.so if it is not
+installed in one of the usual module directories.
+"""
+
+import ctypes
+import math
+import os
+
+import numpy
+
+__all__ = ['Workspace', 'set_threads', 'spectrum', 'quality', 'detect', 'fit',
+           'line_estimate', 'resonance_fit', 'Stream', 'step_height',
+           'provenance_params', 'provenance', 'apply', 'write_gsf']
+
+
+class _Peak(ctypes.Structure):
+    _fields_ = [('x', ctypes.c_double),
+                ('y', ctypes.c_double),
+                ('z', ctypes.c_double)]
+
+
+class _Factors(ctypes.Structure):
+    _fields_ = [('Xscale', ctypes.c_double),
+                ('Yscale', ctypes.c_double),
+                ('Xwarning', ctypes.c_int),
+                ('Ywarning', ctypes.c_int)]
+
+
+class _SpectrumInfo(ctypes.Structure):
+    _fields_ = [('xoffset', ctypes.c_double),
+                ('yoffset', ctypes.c_double),
+                ('dx', ctypes.c_double),
+                ('dy', ctypes.c_double)]
+
+
+class _Quality(ctypes.Structure):
+    _fields_ = [('radius', ctypes.c_double),
+                ('peak_to_background', ctypes.c_double),
+                ('sharpness', ctypes.c_double),
+                ('sixfold', ctypes.c_double),
+                ('score', ctypes.c_double),
+                ('passed', ctypes.c_int)]
+
+
+class _LineEstimate(ctypes.Structure):
+    _fields_ = [('xexpected', ctypes.c_double),
+                ('yexpected', ctypes.c_double),
+                ('xfreq', ctypes.c_double),
+                ('yfreq', ctypes.c_double),
+                ('xcontrast', ctypes.c_double),
+                ('ycontrast', ctypes.c_double),
+                ('factors', _Factors)]
+
+
+class _Resonance(ctypes.Structure):
+    _fields_ = [('center', ctypes.c_double),
+                ('span', ctypes.c_double),
+                ('xcorrection', ctypes.c_double),
+                ('residual', ctypes.c_double),
+                ('nbands', ctypes.c_int)]
+
+
+class _StepHeight(ctypes.Structure):
+    _fields_ = [('step', ctypes.c_double),
+                ('step_err', ctypes.c_double),
+                ('nlevels', ctypes.c_int),
+                ('Zscale', ctypes.c_double),
+                ('warning', ctypes.c_int)]
+
+
+class _ProvenanceSettings(ctypes.Structure):
+    _fields_ = [('Zscale', ctypes.c_double),
+                ('interp', ctypes.c_int),
+                ('lattice', ctypes.c_double),
+                ('radius', ctypes.c_int),
+                ('zoom', ctypes.c_int),
+                ('level', ctypes.c_int),
+                ('sweep_center', ctypes.c_double),
+                ('sweep_span', ctypes.c_double)]
+
+
+_dptr = ctypes.POINTER(ctypes.c_double)
+
+# GwyInterpolationType values accepted by apply().
+INTERPOLATION_ROUND = 1
+INTERPOLATION_LINEAR = 2
+INTERPOLATION_FOURIER = 1024
+
+
+def _find_library():
+    path = os.environ.get('CALIBRATE_HCP_LIBRARY')
+    if path:
+        return path
+    candidates = [os.path.expanduser('~/.gwyddion/modules/process'),
+                  '/usr/local/lib/gwyddion/modules/process',
+                  '/usr/lib/gwyddion/modules/process',
+                  '/usr/lib64/gwyddion/modules/process']
+    for d in candidates:
+        path = os.path.join(d, 'calibrate_hcp.so')
+        if os.path.exists(path):
+            return path
+    raise OSError('calibrate_hcp.so not found, set CALIBRATE_HCP_LIBRARY')
+
+
+_lib = ctypes.CDLL(_find_library())
+_lib.hcp_set_n_threads.restype = None
+_lib.hcp_set_n_threads.argtypes = [ctypes.c_int]
+_lib.hcp_workspace_new.restype = ctypes.c_void_p
+_lib.hcp_workspace_new.argtypes = []
+_lib.hcp_workspace_free.restype = None
+_lib.hcp_workspace_free.argtypes = [ctypes.c_void_p]
+_lib.hcp_spectrum.restype = ctypes.c_int
+_lib.hcp_spectrum.argtypes = [ctypes.c_void_p, _dptr, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                              ctypes.c_double, ctypes.c_double,
+                              _dptr, ctypes.POINTER(_SpectrumInfo)]
+_lib.hcp_quality.restype = ctypes.c_int
+_lib.hcp_quality.argtypes = [_dptr, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                             ctypes.POINTER(_SpectrumInfo), ctypes.c_int,
+                             ctypes.POINTER(_Quality)]
+_lib.hcp_peak_find.restype = ctypes.c_int
+_lib.hcp_peak_find.argtypes = [_dptr, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                               ctypes.POINTER(_SpectrumInfo), ctypes.c_int,
+                               ctypes.c_double, ctypes.c_double,
+                               ctypes.POINTER(_Peak)]
+_lib.hcp_get_factors.restype = None
+_lib.hcp_get_factors.argtypes = [ctypes.POINTER(_Peak), ctypes.POINTER(_Peak),
+                                 ctypes.c_double, ctypes.POINTER(_Factors)]
+_lib.hcp_calibrated_yres.restype = ctypes.c_int
+_lib.hcp_calibrated_yres.argtypes = [ctypes.c_int, ctypes.POINTER(_Factors)]
+_lib.hcp_line_estimate.restype = ctypes.c_int
+_lib.hcp_line_estimate.argtypes = [_dptr, ctypes.c_int, ctypes.c_int,
+                                   ctypes.c_int, ctypes.c_double,
+                                   ctypes.c_double, ctypes.c_double,
+                                   ctypes.c_double, ctypes.c_int,
+                                   ctypes.POINTER(_LineEstimate)]
+_lib.hcp_stream_new.restype = ctypes.c_void_p
+_lib.hcp_stream_new.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_double,
+                                ctypes.c_double, ctypes.c_double,
+                                ctypes.c_double, ctypes.c_int]
+_lib.hcp_stream_free.restype = None
+_lib.hcp_stream_free.argtypes = [ctypes.c_void_p]
+_lib.hcp_stream_add_rows.restype = ctypes.c_int
+_lib.hcp_stream_add_rows.argtypes = [ctypes.c_void_p, _dptr, ctypes.c_int,
+                                     ctypes.c_int]
+_lib.hcp_stream_get_n_rows.restype = ctypes.c_int
+_lib.hcp_stream_get_n_rows.argtypes = [ctypes.c_void_p]
+_lib.hcp_stream_get_estimate.restype = None
+_lib.hcp_stream_get_estimate.argtypes = [ctypes.c_void_p,
+                                         ctypes.POINTER(_LineEstimate)]
+_lib.hcp_step_height.restype = ctypes.c_int
+_lib.hcp_step_height.argtypes = [_dptr, ctypes.c_int, ctypes.c_int,
+                                 ctypes.c_int, ctypes.c_double,
+                                 ctypes.POINTER(_StepHeight)]
+_lib.hcp_provenance_params.restype = ctypes.c_int
+_lib.hcp_provenance_params.argtypes = [ctypes.POINTER(_ProvenanceSettings),
+                                       _dptr, ctypes.c_int, _dptr]
+_lib.hcp_provenance.restype = ctypes.c_int
+_lib.hcp_provenance.argtypes = [_dptr, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                                ctypes.c_double, ctypes.c_double, _dptr,
+                                ctypes.c_int, ctypes.c_char_p]
+_lib.hcp_write_gsf.restype = ctypes.c_int
+_lib.hcp_write_gsf.argtypes = [_dptr, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                               ctypes.c_double, ctypes.c_double,
+                               ctypes.POINTER(_Factors), ctypes.c_int,
+                               ctypes.c_char_p,
+                               ctypes.POINTER(ctypes.c_char_p)]
+_lib.hcp_apply.restype = ctypes.c_int
+_lib.hcp_apply.argtypes = [_dptr, ctypes.c_int, ctypes.c_int, ctypes.c_int,
+                           ctypes.POINTER(_Factors), ctypes.c_int, _dptr]
+_lib.hcp_resonance_fit.restype = ctypes.c_int
+_lib.hcp_resonance_fit.argtypes = [_dptr, ctypes.c_int, ctypes.c_int,
+                                   ctypes.c_int, ctypes.c_double,
+                                   ctypes.c_double,
+                                   ctypes.POINTER(_Resonance)]
+_lib.hcp_apply_resonant.restype = ctypes.c_int
+_lib.hcp_apply_resonant.argtypes = [_dptr, ctypes.c_int, ctypes.c_int,
+                                    ctypes.c_int, ctypes.POINTER(_Factors),
+                                    ctypes.POINTER(_Resonance), ctypes.c_int,
+                                    _dptr]
+
+
+def _as_image(data):
+    """Return (array, yres, xres, rowstride) reading data in place if we can."""
+    a = numpy.asarray(data)
+    if a.ndim != 2:
+        raise ValueError('expected a 2D array')
+    if (a.dtype != numpy.float64 or a.strides[1] != a.itemsize
+            or a.strides[0] % a.itemsize or a.strides[0] < 0):
+        a = numpy.ascontiguousarray(a, dtype=numpy.float64)
+    yres, xres = a.shape
+    return a, yres, xres, a.strides[0] // a.itemsize
+
+
+def _ptr(a):
+    return a.ctypes.data_as(_dptr)
+
+
+def _factors(factors):
+    return _Factors(factors['Xscale'], factors['Yscale'], 0, 0)
+
+
+def set_threads(n):
+    """Set the number of threads, 0 for automatic.
+
+    CALIBRATE_HCP_THREADS in the environment takes precedence.
+    """
+    _lib.hcp_set_n_threads(n)
+
+
+class Workspace(object):
+    """Transform scratch space reused by spectrum() calls of the same size."""
+
+    def __init__(self):
+        self._ws = _lib.hcp_workspace_new()
+
+    def close(self):
+        if self._ws:
+            _lib.hcp_workspace_free(self._ws)
+            self._ws = None
+
+    def __del__(self):
+        self.close()
+
+
+def spectrum(data, xreal, yreal, workspace=None):
+    """Compute the Hann windowed FFT modulus the way the dialog shows it.
+
+    Returns the spectrum array and a dict with the frequency of pixel
+    (0, 0) (xoffset, yoffset) and the frequency step (dx, dy).
+    """
+    a, yres, xres, stride = _as_image(data)
+    out = numpy.empty((yres, xres), dtype=numpy.float64)
+    info = _SpectrumInfo()
+    ws = workspace._ws if workspace is not None else None
+    if not _lib.hcp_spectrum(ws, _ptr(a), xres, yres, stride, xreal, yreal,
+                             _ptr(out), ctypes.byref(info)):
+        raise ValueError('invalid image or dimensions')
+    return out, dict(xoffset=info.xoffset, yoffset=info.yoffset,
+                     dx=info.dx, dy=info.dy)
+
+
+def quality(spec, info, padding=1):
+    """Score how clearly the spectrum shows a hexagonal lattice.
+
+    padding is the factor the image was zero padded by before the
+    transform.  Frames whose 'passed' is False are not worth calibrating
+    from.
+    """
+    a, yres, xres, stride = _as_image(spec)
+    cinfo = _SpectrumInfo(info['xoffset'], info['yoffset'],
+                          info['dx'], info['dy'])
+    q = _Quality()
+    if not _lib.hcp_quality(_ptr(a), xres, yres, stride, ctypes.byref(cinfo),
+                            padding, ctypes.byref(q)):
+        raise ValueError('invalid spectrum')
+    return dict(radius=q.radius, peak_to_background=q.peak_to_background,
+                sharpness=q.sharpness, sixfold=q.sixfold, score=q.score,
+                passed=bool(q.passed))
+
+
+def detect(spec, info, x, y, radius=3):
+    """Find the spectrum maximum within radius pixels of frequency (x, y)."""
+    a, yres, xres, stride = _as_image(spec)
+    cinfo = _SpectrumInfo(info['xoffset'], info['yoffset'],
+                          info['dx'], info['dy'])
+    peak = _Peak()
+    if not _lib.hcp_peak_find(_ptr(a), xres, yres, stride,
+                              ctypes.byref(cinfo), radius, x, y,
+                              ctypes.byref(peak)):
+        raise ValueError('point outside of the spectrum')
+    return dict(x=peak.x, y=peak.y, value=peak.z)
+
+
+def fit(p1, p2, lattice):
+    """Compute the scale factors from two first-ring peaks."""
+    c1 = _Peak(p1['x'], p1['y'], p1.get('value', 0.0))
+    c2 = _Peak(p2['x'], p2['y'], p2.get('value', 0.0))
+    f = _Factors()
+    _lib.hcp_get_factors(ctypes.byref(c1), ctypes.byref(c2), lattice,
+                         ctypes.byref(f))
+    return dict(Xscale=f.Xscale, Yscale=f.Yscale,
+                Xwarning=bool(f.Xwarning), Ywarning=bool(f.Ywarning))
+
+
+def line_estimate(data, xreal, yreal, lattice, angle=math.pi/6, step=1):
+    """Estimate the factors from mean row and column power spectra.
+
+    Much cheaper than spectrum() and detect(), in particular with a step
+    above 1, which uses only every step-th row and column.  angle is the
+    direction of one first ring peak; the default assumes a lattice row
+    along x.  A warning flag means the peak did not stand out.
+    """
+    a, yres, xres, stride = _as_image(data)
+    e = _LineEstimate()
+    if not _lib.hcp_line_estimate(_ptr(a), xres, yres, stride, xreal, yreal,
+                                  lattice, angle, step, ctypes.byref(e)):
+        raise ValueError('invalid image or dimensions')
+    return _line_estimate_dict(e)
+
+
+def _line_estimate_dict(e):
+    return dict(Xscale=e.factors.Xscale, Yscale=e.factors.Yscale,
+                Xwarning=bool(e.factors.Xwarning),
+                Ywarning=bool(e.factors.Ywarning),
+                xfreq=e.xfreq, yfreq=e.yfreq,
+                xcontrast=e.xcontrast, ycontrast=e.ycontrast)
+
+
+def resonance_fit(data, xreal, xfreq):
+    """Fit the sinusoidal sweep of a resonant fast axis.
+
+    xfreq is the x frequency of a lattice peak in the spectrum, e.g. the x
+    of a detect() result; its local value is measured in bands of columns.
+    The column j is taken at the phase center + span*((j + 0.5)/xres - 0.5)
+    of the sweep.  Linearising moves the x of the peaks by xcorrection, so
+    multiply them by it before fitting the factors.  Pass the result to
+    apply() to linearise the image.
+    """
+    a, yres, xres, stride = _as_image(data)
+    r = _Resonance()
+    if not _lib.hcp_resonance_fit(_ptr(a), xres, yres, stride, xreal, xfreq,
+                                  ctypes.byref(r)):
+        raise ValueError('the sweep could not be fitted')
+    return dict(center=r.center, span=r.span, xcorrection=r.xcorrection,
+                residual=r.residual, nbands=r.nbands)
+
+
+class Stream(object):
+    """Running line spectrum estimate of an image being acquired.
+
+    Feed rows as they arrive with add_rows(); every block lines the
+    estimate is updated from the new rows only.  The y estimate uses
+    column segments one block long, so its resolution grows with block.
+
+        s = Stream(xres, yres, xreal, yreal, lattice, block=64)
+        for line in scanner:
+            if s.add_rows(line):
+                print(s.estimate())
+    """
+
+    def __init__(self, xres, yres, xreal, yreal, lattice, angle=math.pi/6,
+                 block=64):
+        self.xres = xres
+        self._s = _lib.hcp_stream_new(xres, yres, xreal, yreal, lattice,
+                                      angle, block)
+        if not self._s:
+            raise ValueError('invalid dimensions')
+
+    def add_rows(self, rows):
+        """Append one row or a 2D array of rows; True if updated."""
+        a = numpy.asarray(rows)
+        if a.ndim == 1:
+            a = a.reshape(1, -1)
+        a, nrows, xres, stride = _as_image(a)
+        if xres != self.xres:
+            raise ValueError('row length differs from xres')
+        return bool(_lib.hcp_stream_add_rows(self._s, _ptr(a), nrows, stride))
+
+    @property
+    def nrows(self):
+        return _lib.hcp_stream_get_n_rows(self._s)
+
+    def estimate(self):
+        e = _LineEstimate()
+        _lib.hcp_stream_get_estimate(self._s, ctypes.byref(e))
+        return _line_estimate_dict(e)
+
+    def close(self):
+        if self._s:
+            _lib.hcp_stream_free(self._s)
+            self._s = None
+
+    def __del__(self):
+        self.close()
+
+
+def step_height(data, known_step):
+    """Measure the terrace step height of a stepped surface.
+
+    The image is levelled by its terrace slope and the step is fitted to
+    the levels of the height histogram.  Zscale multiplies the heights to
+    make the step known_step, which should be within some 30 % of the
+    measured one.  A warning flag means only two terraces were found.
+    """
+    a, yres, xres, stride = _as_image(data)
+    r = _StepHeight()
+    if not _lib.hcp_step_height(_ptr(a), xres, yres, stride, known_step,
+                                ctypes.byref(r)):
+        raise ValueError('no terraces found')
+    return dict(step=r.step, step_err=r.step_err, nlevels=r.nlevels,
+                Zscale=r.Zscale, warning=bool(r.warning))
+
+
+def provenance_params(seeds, lattice, radius, zoom=1, level=-1,
+                      interpolation=INTERPOLATION_LINEAR, zscale=1.0,
+                      resonance=None):
+    """Return the params of provenance() for a calibration.
+
+    seeds are the (x, y) spatial frequencies the fit starts from and radius
+    is the peak search radius in spectrum pixels.  Pass interpolation=0 for
+    a calibration in place and the resonance_fit() result if the sweep is
+    linearised.  The module builds its params the same way.
+    """
+    s = _ProvenanceSettings(zscale, interpolation, lattice, radius, zoom,
+                            level, 0.0, 0.0)
+    if resonance is not None:
+        s.sweep_center = resonance['center']
+        s.sweep_span = resonance['span']
+    xy = numpy.ascontiguousarray(seeds, dtype=numpy.float64).reshape(-1)
+    p = numpy.empty(8 + xy.size)
+    n = _lib.hcp_provenance_params(ctypes.byref(s), _ptr(xy), xy.size // 2,
+                                   _ptr(p))
+    return p[:n]
+
+
+def provenance(data, xreal, yreal, params=()):
+    """Return the SHA-256 hex digest of an image and its parameters.
+
+    With params from provenance_params() the digest is the one recorded as
+    Provenance in the metadata of outputs of the module, so a campaign can
+    skip images it has already done.
+    """
+    a, yres, xres, stride = _as_image(data)
+    p = numpy.ascontiguousarray(params, dtype=numpy.float64)
+    digest = ctypes.create_string_buffer(65)
+    if not _lib.hcp_provenance(_ptr(a), xres, yres, stride, xreal, yreal,
+                               _ptr(p), p.size, digest):
+        raise ValueError('invalid image')
+    return digest.value.decode('ascii')
+
+
+def apply(data, xreal, yreal, factors, interpolation=INTERPOLATION_LINEAR,
+          resonance=None):
+    """Resample the image with the given factors.
+
+    With a resonance from resonance_fit() the columns are also remapped to
+    equal spacing, in the same pass as the rows for linear interpolation.
+    Returns the calibrated array and a dict with its new real dimensions.
+    """
+    a, yres, xres, stride = _as_image(data)
+    f = _factors(factors)
+    out = numpy.empty((_lib.hcp_calibrated_yres(yres, ctypes.byref(f)), xres),
+                      dtype=numpy.float64)
+    if resonance is not None:
+        r = _Resonance(resonance['center'], resonance['span'], 1.0, 0.0, 1)
+        ok = _lib.hcp_apply_resonant(_ptr(a), xres, yres, stride,
+                                     ctypes.byref(f), ctypes.byref(r),
+                                     interpolation, _ptr(out))
+    else:
+        ok = _lib.hcp_apply(_ptr(a), xres, yres, stride, ctypes.byref(f),
+                            interpolation, _ptr(out))
+    if not ok:
+        raise ValueError('invalid image or factors')
+    return out, dict(xreal=xreal*f.Xscale, yreal=yreal*f.Yscale)
+
+
+def write_gsf(path, data, xreal, yreal, factors,
+              interpolation=INTERPOLATION_LINEAR, meta=None):
+    """Resample the image and write it to a Gwyddion Simple Field file.
+
+    With linear or round interpolation the image is read in place and the
+    result is written by blocks as it is computed, never held whole; other
+    interpolations resample a copy of the whole image first.  meta is a dict
+    of further header fields, e.g. XYUnits, ZUnits, Title.
+    """
+    a, yres, xres, stride = _as_image(data)
+    items = []
+    for key, value in (meta or {}).items():
+        items += [str(key).encode('utf-8'), str(value).encode('utf-8')]
+    cmeta = (ctypes.c_char_p*(len(items) + 1))(*(items + [None]))
+    if not _lib.hcp_write_gsf(_ptr(a), xres, yres, stride, xreal, yreal,
+                              ctypes.byref(_factors(factors)), interpolation,
+                              os.fsencode(path), cmeta):
+        raise IOError('cannot write %s' % path)
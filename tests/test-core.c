@@ -0,0 +1,483 @@
+/*
+ *  @(#) $Id: test-core.c 2014-05-08 $
+ *  Copyright (C) 2014 Jeffrey J. Schwartz.
+ *  E-mail: schwartz@physics.ucla.edu
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA 02110-1301, USA.
+ */
+
+/*
+ *  Checks of the numerical core against independent computations on small
+ *  synthetic inputs.  Run by make check.
+ */
+
+#include "config.h"
+#include <math.h>
+#include <string.h>
+#include <glib.h>
+#include <libprocess/datafield.h>
+#include <libprocess/surface.h>
+#include "calibrate_hcp_core.h"
+
+#define NUFFT_RES 16
+#define NUFFT_NPOINTS 300
+#define FOURIER_XRES 4
+#define FOURIER_YRES 24
+#define STEP_RES 64
+#define RESONANCE_XRES 256
+#define RESONANCE_YRES 8
+#define PROVENANCE_XRES 12
+#define PROVENANCE_YRES 9
+
+static void test_nufft_direct          (void);
+static gdouble fourier_column          (gint j, gdouble t);
+static void test_fourier_resize        (void);
+static void test_fit_joint             (void);
+static void test_fit_sums              (void);
+static void test_step_height           (void);
+static void test_resonance_fit         (void);
+static void test_provenance            (void);
+
+int
+main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/calibrate_hcp/nufft-direct", test_nufft_direct);
+    g_test_add_func("/calibrate_hcp/fourier-resize", test_fourier_resize);
+    g_test_add_func("/calibrate_hcp/fit-joint", test_fit_joint);
+    g_test_add_func("/calibrate_hcp/fit-sums", test_fit_sums);
+    g_test_add_func("/calibrate_hcp/step-height", test_step_height);
+    g_test_add_func("/calibrate_hcp/resonance-fit", test_resonance_fit);
+    g_test_add_func("/calibrate_hcp/provenance", test_provenance);
+    return g_test_run();
+}
+
+/*
+ *  The XYZ spectrum of scattered points must match a direct DFT of the
+ *  same density weighted, levelled and Hann windowed values at every
+ *  frequency it keeps.
+ */
+static void
+test_nufft_direct(void)
+{
+    enum { res = NUFFT_RES, n = NUFFT_NPOINTS };
+    GwySurface *surface;
+    GwyDataField *spectrum;
+    GwyXYZ *xyz;
+    const gdouble *data;
+    gdouble xmin, xmax, ymin, ymax, lx, ly, avg = 0.0, wsum = 0.0;
+    gdouble u[n], v[n], c[n], direct[res*res], scale;
+    gint count[res*res], cell[n];
+    gint i, j, k, kmin = 0, kmax = 0;
+    GRand *rng = g_rand_new_with_seed(42);
+
+    surface = gwy_surface_new_sized(n);
+    xyz = gwy_surface_get_data(surface);
+    for (k = 0; k < n; k++)
+    {
+        xyz[k].x = g_rand_double_range(rng, 0.0, 10.0);
+        xyz[k].y = g_rand_double_range(rng, 0.0, 10.0);
+        xyz[k].z = sin(2.1*xyz[k].x + 0.7*xyz[k].y)
+                   + 0.3*g_rand_double_range(rng, -1.0, 1.0);
+    }
+    g_rand_free(rng);
+    gwy_surface_invalidate(surface);
+    spectrum = hcp_surface_spectrum(surface, res, NULL);
+    g_assert(spectrum);
+    g_assert_cmpint(gwy_data_field_get_xres(spectrum), ==, res);
+    g_assert_cmpint(gwy_data_field_get_yres(spectrum), ==, res);
+
+    gwy_surface_get_xrange(surface, &xmin, &xmax);
+    gwy_surface_get_yrange(surface, &ymin, &ymax);
+    lx = (xmax - xmin)*(1.0 + 1.0/res);
+    ly = (ymax - ymin)*(1.0 + 1.0/res);
+    for (k = 0; k < res*res; k++)
+        count[k] = 0;
+    for (k = 0; k < n; k++)
+    {
+        u[k] = 2.0*G_PI*(xyz[k].x - xmin)/lx;
+        v[k] = 2.0*G_PI*(xyz[k].y - ymin)/ly;
+        cell[k] = MIN((gint)(u[k]/(2.0*G_PI)*res), res - 1)
+                  + MIN((gint)(v[k]/(2.0*G_PI)*res), res - 1)*res;
+        count[cell[k]]++;
+    }
+    for (k = 0; k < n; k++)
+    {
+        c[k] = 1.0/count[cell[k]];
+        avg += c[k]*xyz[k].z;
+        wsum += c[k];
+    }
+    avg /= wsum;
+    for (k = 0; k < n; k++)
+    {
+        gdouble tx = (xyz[k].x - xmin)/(xmax - xmin);
+        gdouble ty = (xyz[k].y - ymin)/(ymax - ymin);
+        c[k] *= (xyz[k].z - avg)*(0.5 - 0.5*cos(2.0*G_PI*tx))
+                * (0.5 - 0.5*cos(2.0*G_PI*ty));
+    }
+    /* Humanized order: zero frequency in the middle. */
+    for (i = 0; i < res; i++)
+    {
+        for (j = 0; j < res; j++)
+        {
+            gint kx = j - res/2, ky = i - res/2;
+            gdouble re = 0.0, im = 0.0;
+            for (k = 0; k < n; k++)
+            {
+                re += c[k]*cos(kx*u[k] + ky*v[k]);
+                im -= c[k]*sin(kx*u[k] + ky*v[k]);
+            }
+            direct[i*res + j] = hypot(re, im);
+        }
+    }
+
+    /* The spectra are shifted to a zero minimum, so compare them up to an
+     * offset and a scale, anchored at the minimum and the maximum. */
+    data = gwy_data_field_get_data_const(spectrum);
+    for (k = 0; k < res*res; k++)
+    {
+        if (direct[k] < direct[kmin])
+            kmin = k;
+        if (direct[k] > direct[kmax])
+            kmax = k;
+    }
+    g_assert_cmpfloat(direct[kmax] - direct[kmin], >, 0.0);
+    scale = (data[kmax] - data[kmin])/(direct[kmax] - direct[kmin]);
+    g_assert_cmpfloat(scale, >, 0.0);
+    for (k = 0; k < res*res; k++)
+    {
+        g_assert_cmpfloat(fabs(data[k] - data[kmin]
+                               - scale*(direct[k] - direct[kmin])), <,
+                          1e-5*scale*direct[kmax]);
+    }
+
+    g_object_unref(spectrum);
+    g_object_unref(surface);
+}
+
+/*
+ *  Column j of the Fourier test at height t, in units of the image
+ *  height: a ramp plus cosines, which are symmetric about the middle row,
+ *  and in the last column a sine at the Nyquist frequency of the halved
+ *  grid paired with a slower one so that the first and last rows agree.
+ *  Taking out the ramp then leaves all of them periodic.
+ */
+static gdouble
+fourier_column(gint j, gdouble t)
+{
+    const gdouble f = 0.25*FOURIER_YRES;
+    gdouble z = 0.1*(j + 1)*(t*FOURIER_YRES - 0.5);
+    if (j < FOURIER_XRES - 1)
+        return z + cos(2.0*G_PI*(j + 1)*t);
+    return z + sin(2.0*G_PI*f*t)
+           - sin(G_PI*f/FOURIER_YRES)/sin(G_PI/FOURIER_YRES)*sin(2.0*G_PI*t);
+}
+
+/*
+ *  Band limited columns are resampled exactly by the Fourier
+ *  interpolation, both when rows are added and when they are dropped,
+ *  down to the Nyquist frequency of the cropped grid.
+ */
+static void
+test_fourier_resize(void)
+{
+    enum { xres = FOURIER_XRES, yres = FOURIER_YRES };
+    static const gdouble yscales[] = { 1.5, 0.75, 0.5 };
+    gdouble data[xres*yres], out[xres*2*yres];
+    gint i, j, m, newyres;
+
+    for (i = 0; i < yres; i++)
+    {
+        for (j = 0; j < xres; j++)
+            data[i*xres + j] = fourier_column(j, (i + 0.5)/yres);
+    }
+    for (m = 0; m < (gint)G_N_ELEMENTS(yscales); m++)
+    {
+        HcpFactors factors = { 1.0, yscales[m], FALSE, FALSE };
+        newyres = hcp_calibrated_yres(yres, &factors);
+        g_assert_cmpint(newyres, ==, GWY_ROUND(yres*yscales[m]));
+        g_assert(hcp_apply(data, xres, yres, xres, &factors,
+                           HCP_INTERPOLATION_FOURIER, out));
+        for (i = 0; i < newyres; i++)
+        {
+            gdouble t = (i + 0.5)/newyres;
+            for (j = 0; j < xres; j++)
+                g_assert_cmpfloat(fabs(out[i*xres + j]
+                                       - fourier_column(j, t)), <, 1e-9);
+        }
+    }
+}
+
+/*
+ *  Two images of one lattice at different rotations, seen through the
+ *  same X and Y factors, give back the factors, no shear and the
+ *  rotation of each image.
+ */
+static void
+test_fit_joint(void)
+{
+    static const gint hk[][2] = {
+        { 1, 0 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { 0, -1 }, { 1, -1 },
+        { 1, 1 }, { -1, 2 }, { 2, -1 },
+    };
+    enum { n = G_N_ELEMENTS(hk) };
+    const gdouble lattice = 0.25, xscale = 1.1, yscale = 0.9;
+    const gdouble rotation[2] = { 0.1, -0.3 };
+    HcpLatticePeak peaks[2*n];
+    HcpJointFit fit;
+    gdouble rotations[2], R = 2.0/(sqrt(3.0)*lattice);
+    gint npeaks[2] = { n, n }, i, m;
+
+    for (m = 0; m < 2; m++)
+    {
+        for (i = 0; i < n; i++)
+        {
+            HcpLatticePeak *peak = peaks + m*n + i;
+            gint h = hk[i][0], k = hk[i][1];
+            gdouble r = R*sqrt(h*h + k*k + h*k);
+            gdouble phi = atan2(0.5*sqrt(3.0)*k, h + 0.5*k) + rotation[m];
+            peak->x = xscale*r*cos(phi);
+            peak->y = yscale*r*sin(phi);
+            peak->z = 1.0;
+            peak->h = h;
+            peak->k = k;
+        }
+    }
+    g_assert(hcp_fit_joint(peaks, npeaks, 2, lattice, &fit, rotations));
+    g_assert_cmpint(fit.npeaks, ==, 2*n);
+    g_assert(!fit.factors.Xwarning && !fit.factors.Ywarning);
+    g_assert_cmpfloat(fabs(fit.factors.Xscale - xscale), <, 1e-9);
+    g_assert_cmpfloat(fabs(fit.factors.Yscale - yscale), <, 1e-9);
+    g_assert_cmpfloat(fabs(fit.shear), <, 1e-9);
+    for (m = 0; m < 2; m++)
+        g_assert_cmpfloat(fabs(rotations[m] - rotation[m]), <, 1e-9);
+    for (i = 0; i < 2*n; i++)
+        g_assert_cmpfloat(fabs(peaks[i].residual), <, 1e-9);
+}
+
+/*
+ *  Taking a peak out of the sums and putting it back moved, as dragging
+ *  it does, must give the factors of a fit of the moved peaks from
+ *  scratch, however often the same peak is moved.
+ */
+static void
+test_fit_sums(void)
+{
+    static const gint hk[][2] = {
+        { 1, 0 }, { 0, 1 }, { -1, 1 }, { 1, 1 }, { -1, 2 }, { 2, -1 },
+    };
+    static const gdouble moves[][2] = {
+        { 0.3, -0.2 }, { -0.5, 0.1 }, { 0.05, 0.4 }, { -0.1, -0.35 },
+        { 0.0, 0.0 },
+    };
+    enum { n = G_N_ELEMENTS(hk) };
+    const gdouble lattice = 0.25, xscale = 1.05, yscale = 0.95;
+    HcpLatticePeak peaks[n], *moved = peaks + 1;
+    HcpFactors incremental, direct;
+    HcpFitSums sums;
+    gdouble R = 2.0/(sqrt(3.0)*lattice), x0, y0;
+    guint i, m;
+
+    memset(&sums, 0, sizeof(HcpFitSums));
+    for (i = 0; i < n; i++)
+    {
+        gint h = hk[i][0], k = hk[i][1];
+        gdouble r = R*sqrt(h*h + k*k + h*k);
+        gdouble phi = atan2(0.5*sqrt(3.0)*k, h + 0.5*k) + 0.2;
+        peaks[i].x = xscale*r*cos(phi) + 0.01*i;
+        peaks[i].y = yscale*r*sin(phi) - 0.02*i;
+        peaks[i].z = 1.0;
+        peaks[i].h = h;
+        peaks[i].k = k;
+        hcp_fit_sums_add(&sums, peaks + i, lattice, 1);
+    }
+    x0 = moved->x;
+    y0 = moved->y;
+    for (m = 0; m < G_N_ELEMENTS(moves); m++)
+    {
+        hcp_fit_sums_add(&sums, moved, lattice, -1);
+        moved->x = x0 + moves[m][0];
+        moved->y = y0 + moves[m][1];
+        hcp_fit_sums_add(&sums, moved, lattice, 1);
+        g_assert(hcp_fit_sums_solve(&sums, &incremental));
+        g_assert(hcp_fit_peaks(peaks, n, lattice, &direct));
+        g_assert_cmpfloat(fabs(incremental.Xscale - direct.Xscale), <, 1e-12);
+        g_assert_cmpfloat(fabs(incremental.Yscale - direct.Yscale), <, 1e-12);
+        g_assert_cmpint(incremental.Xwarning, ==, direct.Xwarning);
+        g_assert_cmpint(incremental.Ywarning, ==, direct.Ywarning);
+    }
+}
+
+/*
+ *  Tilted terraces of a known step give the step and the Z factor to
+ *  the known one; a level off the grid of the others is refused.
+ */
+static void
+test_step_height(void)
+{
+    enum { res = STEP_RES };
+    const gdouble step = 0.3, known = 0.28;
+    gdouble data[res*res];
+    HcpStepHeight result;
+    GRand *rng = g_rand_new_with_seed(7);
+    gint i, j;
+
+    for (i = 0; i < res; i++)
+    {
+        for (j = 0; j < res; j++)
+            data[i*res + j] = step*(j/(res/4)) + 0.002*i - 0.001*j
+                              + 0.002*g_rand_double_range(rng, -1.0, 1.0);
+    }
+    g_assert(hcp_step_height(data, res, res, res, known, &result));
+    g_assert(!result.warning);
+    g_assert_cmpint(result.nlevels, ==, 4);
+    g_assert_cmpfloat(fabs(result.step - step), <, 0.01*step);
+    g_assert_cmpfloat(fabs(result.Zscale - known/step), <, 0.01*known/step);
+
+    /* Move the top terrace by half a step. */
+    for (i = 0; i < res; i++)
+    {
+        for (j = 3*(res/4); j < res; j++)
+            data[i*res + j] += 0.5*step;
+    }
+    g_assert(!hcp_step_height(data, res, res, res, known, &result));
+    g_assert(result.warning);
+    g_assert_cmpfloat(result.step, ==, 0.0);
+    g_rand_free(rng);
+}
+
+/*
+ *  A lattice swept by a sinusoidal fast axis gives back the phase centre
+ *  and span of the sweep, and the x correction taking the seed frequency
+ *  to the mean one.
+ */
+static void
+test_resonance_fit(void)
+{
+    enum { xres = RESONANCE_XRES, yres = RESONANCE_YRES };
+    const gdouble center = 0.2, span = 1.6, amplitude = 28.0;
+    gdouble data[xres*yres], mean = 0.0;
+    HcpResonance resonance;
+    gint i, j;
+
+    for (j = 0; j < xres; j++)
+    {
+        gdouble phase = center + span*((j + 0.5)/xres - 0.5);
+        mean += amplitude*span/xres*cos(phase);
+        for (i = 0; i < yres; i++)
+            data[i*xres + j] = cos(2.0*G_PI*amplitude*sin(phase));
+    }
+    mean /= xres;
+    g_assert(hcp_resonance_fit(data, xres, yres, xres, xres, mean,
+                               &resonance));
+    g_assert_cmpint(resonance.nbands, >=, 4);
+    g_assert_cmpfloat(fabs(resonance.center - center), <, 0.05);
+    g_assert_cmpfloat(fabs(resonance.span - span), <, 0.05);
+    g_assert_cmpfloat(resonance.residual, <, 0.05);
+    g_assert_cmpfloat(fabs(resonance.xcorrection - 1.0), <, 0.02);
+
+    /* Seeded off the mean, the peak x must move back onto it. */
+    g_assert(hcp_resonance_fit(data, xres, yres, xres, xres, 1.05*mean,
+                               &resonance));
+    g_assert_cmpfloat(fabs(1.05*resonance.xcorrection - 1.0), <, 0.02);
+
+    /* Too narrow for the bands, which fails without a warning. */
+    g_assert(!hcp_resonance_fit(data, 16, yres, xres, 16.0, mean,
+                                &resonance));
+    g_assert_cmpint(resonance.nbands, ==, 0);
+}
+
+/*
+ *  A channel calibrated from the dialog and the same channel met by Apply
+ *  to all channels must get the same digest: the dialog hashes the field,
+ *  the series the same settings and seeds built separately.  Every
+ *  setting and seed must still change it.
+ */
+static void
+test_provenance(void)
+{
+    enum { xres = PROVENANCE_XRES, yres = PROVENANCE_YRES };
+    const gdouble seeds[4] = { 4.0, 0.5, -1.5, 3.5 };
+    HcpProvenanceSettings dialog, series, changed;
+    GwyDataField *field = gwy_data_field_new(xres, yres, 3.0, 2.0, FALSE);
+    GRand *rng = g_rand_new_with_seed(11);
+    gdouble *data = gwy_data_field_get_data(field);
+    gdouble params[HCP_PROVENANCE_NSETTINGS + 4], other[G_N_ELEMENTS(params)];
+    gdouble buffer[(xres + 3)*yres];
+    gchar digest[HCP_PROVENANCE_LENGTH], check[HCP_PROVENANCE_LENGTH];
+    gint i, j, n;
+
+    for (i = 0; i < xres*yres; i++)
+        data[i] = g_rand_double_range(rng, -1.0, 1.0);
+    for (i = 0; i < yres; i++)
+    {
+        for (j = 0; j < xres; j++)
+            buffer[i*(xres + 3) + j] = data[i*xres + j];
+    }
+
+    dialog.Zscale = 1.0;
+    dialog.interp = GWY_INTERPOLATION_LINEAR;
+    dialog.lattice = 0.246;
+    dialog.radius = 2;
+    dialog.zoom = 2;
+    dialog.level = -1;
+    dialog.sweep_center = dialog.sweep_span = 0.0;
+    series.level = -1;
+    series.zoom = 2;
+    series.radius = 2;
+    series.lattice = 0.246;
+    series.interp = GWY_INTERPOLATION_LINEAR;
+    series.Zscale = 1.0;
+    series.sweep_center = series.sweep_span = 0.0;
+
+    n = hcp_provenance_params(&dialog, seeds, 2, params);
+    g_assert_cmpint(n, ==, HCP_PROVENANCE_NSETTINGS + 4);
+    g_assert(hcp_field_provenance(field, params, n, digest));
+    g_assert_cmpint(strlen(digest), ==, HCP_PROVENANCE_LENGTH - 1);
+    g_assert_cmpint(hcp_provenance_params(&series, seeds, 2, other), ==, n);
+    g_assert(hcp_provenance(buffer, xres, yres, xres + 3, 3.0, 2.0,
+                            other, n, check));
+    g_assert_cmpstr(digest, ==, check);
+
+    /* Each setting, then each seed coordinate. */
+    for (i = 0; i < n; i++)
+    {
+        memcpy(other, params, n*sizeof(gdouble));
+        if (i < HCP_PROVENANCE_NSETTINGS)
+        {
+            changed = dialog;
+            switch (i)
+            {
+                case 0: changed.Zscale = 1.1; break;
+                case 1: changed.interp = GWY_INTERPOLATION_ROUND; break;
+                case 2: changed.lattice = 0.25; break;
+                case 3: changed.radius = 3; break;
+                case 4: changed.zoom = 1; break;
+                case 5: changed.level = 0; break;
+                case 6: changed.sweep_center = 0.1; break;
+                case 7: changed.sweep_span = 1.5; break;
+            }
+            hcp_provenance_params(&changed, seeds, 2, other);
+        }
+        else
+            other[i] += 0.25;
+        g_assert(hcp_field_provenance(field, other, n, check));
+        g_assert_cmpstr(digest, !=, check);
+    }
+
+    g_rand_free(rng);
+    g_object_unref(field);
+}